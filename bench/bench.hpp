@@ -0,0 +1,99 @@
+#pragma once
+
+#include <chrono>
+#include <random>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace oxen::bench {
+
+// Parameters of a measurement, such as the number of rows in the database
+using params_t = std::vector<std::pair<std::string, uint64_t>>;
+
+struct Options {
+    // Only run the benchmarks whose name contains this
+    std::string filter;
+    // Each measurement repeats the operation for at least this long
+    std::chrono::milliseconds min_time{500};
+    // Database sizes to measure at
+    std::vector<uint64_t> rows{10'000, 1'000'000, 10'000'000};
+    // Where the benchmark databases are created (and removed afterwards)
+    std::string db_dir = "bench_db";
+};
+
+// Number of heap allocations made so far by all threads, counted by the
+// benchmark's replacement of the global `operator new`
+uint64_t allocation_count();
+
+/// Times operations and collects the results, which are written out as JSON
+/// once all benchmarks have run.
+class Runner {
+    using clock = std::chrono::steady_clock;
+
+  public:
+    explicit Runner(Options options) : options_(std::move(options)) {}
+
+    const Options& options() const { return options_; }
+
+    bool enabled(const std::string& name) const;
+
+    // Run `op` repeatedly, doubling the number of iterations until they take
+    // at least `min_time`, and record the time and allocations per call of
+    // the last round
+    template <typename F>
+    void run(const std::string& name, const params_t& params, F&& op) {
+        if (!enabled(name))
+            return;
+        for (uint64_t iterations = 1;; iterations *= 2) {
+            const uint64_t allocations = allocation_count();
+            const auto start = clock::now();
+            for (uint64_t i = 0; i < iterations; ++i)
+                op();
+            const auto elapsed = clock::now() - start;
+            if (elapsed >= options_.min_time) {
+                record(name, params, iterations, elapsed,
+                       allocation_count() - allocations);
+                return;
+            }
+        }
+    }
+
+    // Record `iterations` calls of an operation measured by the caller, for
+    // operations that can't simply be repeated
+    void record(const std::string& name, const params_t& params,
+                uint64_t iterations, clock::duration elapsed,
+                uint64_t allocations);
+
+    // Write the results as a JSON document
+    std::string to_json() const;
+
+  private:
+    struct Result {
+        std::string name;
+        params_t params;
+        uint64_t iterations;
+        double ns_per_op;
+        double allocs_per_op;
+    };
+
+    const Options options_;
+    std::vector<Result> results_;
+};
+
+// Random data from a seeded generator, so that every run measures the same
+// operations
+std::string random_hex(std::mt19937_64& rng, size_t size);
+// `size` base64 characters (valid base64 if `size` is a multiple of 4)
+std::string random_base64(std::mt19937_64& rng, size_t size);
+
+// Benchmark groups
+void bench_storage(Runner& runner);
+void bench_pow(Runner& runner);
+void bench_serialization(Runner& runner);
+void bench_crypto(Runner& runner);
+void bench_swarm(Runner& runner);
+void bench_rate_limiter(Runner& runner);
+
+} // namespace oxen::bench
@@ -0,0 +1,72 @@
+#include "bench.hpp"
+#include "channel_encryption.hpp"
+#include "signature.h"
+
+#include <oxenmq/hex.h>
+
+namespace oxen::bench {
+
+static private_key_t random_key(std::mt19937_64& rng) {
+    private_key_t key;
+    for (auto& byte : key)
+        byte = rng();
+    return key;
+}
+
+void bench_crypto(Runner& runner) {
+    std::mt19937_64 rng{42};
+
+    // Messages go from the client to us
+    const auto our_key = random_key(rng);
+    const auto client_key = random_key(rng);
+    const auto our_pubkey = derive_pubkey_x25519(our_key);
+    const auto client_pubkey = derive_pubkey_x25519(client_key);
+    const ChannelEncryption<std::string> ours(
+        std::vector<uint8_t>(our_key.begin(), our_key.end()));
+    const ChannelEncryption<std::string> client(
+        std::vector<uint8_t>(client_key.begin(), client_key.end()));
+    const auto our_pubkey_hex =
+        oxenmq::to_hex(our_pubkey.begin(), our_pubkey.end());
+    const auto client_pubkey_hex =
+        oxenmq::to_hex(client_pubkey.begin(), client_pubkey.end());
+
+    for (uint64_t data_size : {256, 4096, 65536}) {
+        const params_t params{{"data_size", data_size}};
+        const auto plaintext = random_base64(rng, data_size);
+
+        runner.run("ChannelEncryption::encrypt_gcm", params, [&] {
+            ours.encrypt_gcm(plaintext, client_pubkey_hex);
+        });
+
+        const auto gcm_ciphertext =
+            client.encrypt_gcm(plaintext, our_pubkey_hex);
+        runner.run("ChannelEncryption::decrypt_gcm", params, [&] {
+            ours.decrypt_gcm(gcm_ciphertext, client_pubkey_hex);
+        });
+
+        const auto cbc_ciphertext =
+            client.encrypt_cbc(plaintext, our_pubkey_hex);
+        runner.run("ChannelEncryption::decrypt_cbc", params, [&] {
+            ours.decrypt_cbc(cbc_ciphertext, client_pubkey_hex);
+        });
+    }
+
+    // Signatures are over a hash, so their cost doesn't depend on the data.
+    // Legacy keys must be reduced scalars, so use a known good one.
+    const private_key_t legacy_key{151, 254, 73,  194, 212, 54, 229, 163,
+                                   159, 138, 162, 227, 55,  77, 25,  181,
+                                   50,  238, 207, 178, 176, 54, 126, 170,
+                                   111, 112, 50,  121, 227, 78, 193, 2};
+    const oxend_key_pair_t key_pair{legacy_key,
+                                    derive_pubkey_legacy(legacy_key)};
+    const auto hash = hash_data(random_base64(rng, 256));
+
+    runner.run("generate_signature", {},
+               [&] { generate_signature(hash, key_pair); });
+
+    const auto sig = generate_signature(hash, key_pair);
+    runner.run("check_signature", {},
+               [&] { check_signature(sig, hash, key_pair.public_key); });
+}
+
+} // namespace oxen::bench
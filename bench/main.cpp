@@ -0,0 +1,172 @@
+#include "bench.hpp"
+
+#include <boost/program_options.hpp>
+#include <nlohmann/json.hpp>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/spdlog.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace po = boost::program_options;
+
+static std::atomic<uint64_t> num_allocations{0};
+
+// Array and nothrow forms forward to this one
+void* operator new(size_t size) {
+    num_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace oxen::bench {
+
+uint64_t allocation_count() {
+    return num_allocations.load(std::memory_order_relaxed);
+}
+
+std::string random_hex(std::mt19937_64& rng, size_t size) {
+    constexpr const char* digits = "0123456789abcdef";
+    std::string result(size, '0');
+    uint64_t bits = 0;
+    for (size_t i = 0; i < size; ++i, bits >>= 4) {
+        if (i % 16 == 0)
+            bits = rng();
+        result[i] = digits[bits & 0xf];
+    }
+    return result;
+}
+
+std::string random_base64(std::mt19937_64& rng, size_t size) {
+    constexpr const char* digits =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string result(size, 'A');
+    uint64_t bits = 0;
+    for (size_t i = 0; i < size; ++i, bits >>= 6) {
+        if (i % 10 == 0)
+            bits = rng();
+        result[i] = digits[bits & 0x3f];
+    }
+    return result;
+}
+
+bool Runner::enabled(const std::string& name) const {
+    return name.find(options_.filter) != std::string::npos;
+}
+
+void Runner::record(const std::string& name, const params_t& params,
+                    uint64_t iterations, clock::duration elapsed,
+                    uint64_t allocations) {
+    const double ns =
+        std::chrono::duration<double, std::nano>(elapsed).count() /
+        iterations;
+    const double allocs = static_cast<double>(allocations) / iterations;
+    results_.push_back(Result{name, params, iterations, ns, allocs});
+
+    std::string label = name;
+    for (const auto& [param, value] : params)
+        label += "/" + param + ":" + std::to_string(value);
+    std::cerr << label << ": " << static_cast<uint64_t>(ns) << " ns/op, "
+              << allocs << " allocs/op (" << iterations << " iterations)\n";
+}
+
+std::string Runner::to_json() const {
+    char date[32];
+    const std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%FT%TZ", std::gmtime(&now));
+
+    nlohmann::json benchmarks = nlohmann::json::array();
+    for (const auto& result : results_) {
+        nlohmann::json params = nlohmann::json::object();
+        for (const auto& [param, value] : result.params)
+            params[param] = value;
+        benchmarks.push_back({{"name", result.name},
+                              {"params", params},
+                              {"iterations", result.iterations},
+                              {"ns_per_op", result.ns_per_op},
+                              {"allocs_per_op", result.allocs_per_op}});
+    }
+
+    const nlohmann::json doc{
+        {"context",
+         {{"date", date},
+          {"build_type", BENCH_BUILD_TYPE},
+          {"num_cpus", std::thread::hardware_concurrency()},
+          {"min_time_ms", options_.min_time.count()}}},
+        {"benchmarks", benchmarks}};
+    return doc.dump(2);
+}
+
+} // namespace oxen::bench
+
+using namespace oxen::bench;
+
+int main(int argc, char* argv[]) {
+    Options options;
+    std::string rows = "10000,1000000,10000000";
+    std::string out;
+    unsigned min_time_ms = options.min_time.count();
+
+    po::options_description desc("Storage server benchmarks");
+    // clang-format off
+    desc.add_options()
+        ("filter", po::value(&options.filter), "Only run benchmarks whose name contains this")
+        ("rows", po::value(&rows)->default_value(rows), "Comma-separated database sizes to measure at")
+        ("min-time", po::value(&min_time_ms)->default_value(min_time_ms), "Minimum time spent on each measurement, in ms")
+        ("db-dir", po::value(&options.db_dir)->default_value(options.db_dir), "Where to create the benchmark databases")
+        ("out", po::value(&out), "Write the JSON results to this file rather than stdout")
+        ("help", "Shows this help message");
+    // clang-format on
+
+    try {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 0;
+        }
+
+        options.rows.clear();
+        std::istringstream rows_stream(rows);
+        for (std::string row; std::getline(rows_stream, row, ',');)
+            options.rows.push_back(std::stoull(row));
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n" << desc << std::endl;
+        return 1;
+    }
+    options.min_time = std::chrono::milliseconds(min_time_ms);
+
+    // Only warnings, so that they don't drown out the results
+    auto logger = std::make_shared<spdlog::logger>(
+        "oxen_logger", std::make_shared<spdlog::sinks::stderr_color_sink_mt>());
+    logger->set_level(spdlog::level::warn);
+    spdlog::register_logger(logger);
+
+    Runner runner(options);
+    bench_pow(runner);
+    bench_serialization(runner);
+    bench_crypto(runner);
+    bench_swarm(runner);
+    bench_rate_limiter(runner);
+    bench_storage(runner);
+
+    const auto json = runner.to_json();
+    if (out.empty()) {
+        std::cout << json << std::endl;
+    } else {
+        std::ofstream file(out);
+        file << json << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+#include "bench.hpp"
+#include "pow.hpp"
+
+#include <memory>
+
+namespace oxen::bench {
+
+// Messages per `checkPoW_batch` call, as in a small push batch
+constexpr size_t POW_BATCH_SIZE = 64;
+
+void bench_pow(Runner& runner) {
+    std::mt19937_64 rng{42};
+    const auto pubkey = "05" + random_hex(rng, 64);
+    const auto nonce = random_base64(rng, 12);
+    const uint64_t timestamp = 1554859211000;
+    const uint64_t ttl = 345600000;
+    const auto timestamp_str = std::to_string(timestamp);
+    const auto ttl_str = std::to_string(ttl);
+    const int difficulty = 100;
+
+    for (uint64_t data_size : {256, 4096, 65536}) {
+        const params_t params{{"data_size", data_size}};
+        const auto data = random_base64(rng, data_size);
+
+        std::string hash;
+        runner.run("checkPoW", params, [&] {
+            checkPoW(nonce, timestamp_str, ttl_str, pubkey, data, hash,
+                     difficulty);
+        });
+
+        pow_hash_t parsed_hash;
+        runner.run("checkPoW(parsed)", params, [&] {
+            checkPoW(nonce, timestamp, ttl, pubkey, data, parsed_hash,
+                     difficulty);
+        });
+
+        const std::vector<pow_message_t> messages(
+            POW_BATCH_SIZE,
+            pow_message_t{nonce, timestamp, ttl, pubkey, data, difficulty});
+        std::unique_ptr<bool[]> valid(new bool[messages.size()]);
+        std::vector<pow_hash_t> hashes(messages.size());
+        runner.run("checkPoW_batch",
+                   {{"data_size", data_size}, {"batch", POW_BATCH_SIZE}}, [&] {
+                       checkPoW_batch(messages.data(), messages.size(),
+                                      valid.get(), hashes.data());
+                   });
+    }
+}
+
+} // namespace oxen::bench
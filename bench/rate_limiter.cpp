@@ -0,0 +1,29 @@
+#include "bench.hpp"
+#include "rate_limiter.h"
+
+namespace oxen::bench {
+
+void bench_rate_limiter(Runner& runner) {
+    for (uint64_t num_clients : {100, 10000}) {
+        std::vector<std::string> clients;
+        for (uint64_t i = 0; i < num_clients; ++i) {
+            clients.push_back("10." + std::to_string(i >> 16) + "." +
+                              std::to_string((i >> 8) & 0xff) + "." +
+                              std::to_string(i & 0xff));
+        }
+
+        // Requests arrive every microsecond, so that some clients run out of
+        // tokens
+        RateLimiter rate_limiter;
+        auto now = std::chrono::steady_clock::now();
+        size_t i = 0;
+        runner.run("RateLimiter::should_rate_limit_client",
+                   {{"clients", num_clients}}, [&] {
+                       now += std::chrono::microseconds(1);
+                       rate_limiter.should_rate_limit_client(
+                           clients[i++ % clients.size()], now);
+                   });
+    }
+}
+
+} // namespace oxen::bench
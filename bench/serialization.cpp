@@ -0,0 +1,59 @@
+#include "bench.hpp"
+#include "http_connection.h"
+#include "oxen_common.h"
+#include "serialization.h"
+
+#include <boost/endian/conversion.hpp>
+
+namespace oxen::bench {
+
+// Messages per serialized batch
+constexpr uint64_t NUM_MESSAGES = 100;
+
+void bench_serialization(Runner& runner) {
+    std::mt19937_64 rng{42};
+
+    for (uint64_t data_size : {256, 4096, 65536}) {
+        std::vector<message_t> messages;
+        for (uint64_t i = 0; i < NUM_MESSAGES; ++i) {
+            messages.emplace_back("05" + random_hex(rng, 64),
+                                  random_base64(rng, data_size),
+                                  random_hex(rng, 128), 345600000,
+                                  1554859211000, random_base64(rng, 12));
+        }
+
+        for (bool binary_payloads : {false, true}) {
+            const params_t params{{"data_size", data_size},
+                                  {"messages", NUM_MESSAGES},
+                                  {"binary_payloads", binary_payloads}};
+
+            runner.run("serialize_messages", params, [&] {
+                serialize_messages(messages, binary_payloads);
+            });
+
+            // A blob is at most `serialize_messages`' batch size, so
+            // deserialize all of them
+            const auto blobs = serialize_messages(messages, binary_payloads);
+            runner.run("deserialize_messages", params, [&] {
+                for (const auto& blob : blobs)
+                    deserialize_messages(blob, binary_payloads);
+            });
+        }
+
+        // | <4 bytes>: N | <N bytes>: ciphertext | <rest>: json |
+        const auto ciphertext = random_base64(rng, data_size);
+        const std::string json =
+            R"({"headers":"","host":"example.com","target":"/loki/v3/lsrpc"})";
+        std::string payload(sizeof(uint32_t), '\0');
+        const auto size =
+            boost::endian::native_to_little(uint32_t(ciphertext.size()));
+        memcpy(payload.data(), &size, sizeof(size));
+        payload += ciphertext;
+        payload += json;
+
+        runner.run("parse_combined_payload", {{"data_size", data_size}},
+                   [&] { parse_combined_payload(payload); });
+    }
+}
+
+} // namespace oxen::bench
@@ -0,0 +1,240 @@
+#include "Database.hpp"
+#include "bench.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+
+namespace oxen::bench {
+
+using storage::Item;
+namespace fs = std::filesystem;
+using clock = std::chrono::steady_clock;
+
+// Base64 characters of message data, for a typical message
+constexpr size_t DATA_SIZE = 512;
+constexpr uint64_t TTL = 4 * 24 * 60 * 60 * 1000; // 4 days in ms
+// Messages are stored up to this long ago, so none expire while measuring
+constexpr uint64_t MAX_AGE = 2 * 24 * 60 * 60 * 1000;
+// Owners have this many messages on average
+constexpr uint64_t MESSAGES_PER_OWNER = 20;
+// Messages generated and stored at a time while populating
+constexpr size_t POPULATE_CHUNK = 10'000;
+// Stored messages looked up by the retrieve benchmarks
+constexpr size_t NUM_SAMPLES = 1000;
+// Messages per `bulk_store` call, as in a push batch
+constexpr uint64_t BULK_STORE_SIZE = 1000;
+// One in this many of the rows expire before the cleanup pass
+constexpr uint64_t EXPIRED_RATIO = 10;
+constexpr auto CLEANUP_TIMEOUT = std::chrono::minutes(10);
+
+constexpr const char* BENCHMARKS[] = {
+    "Database::retrieve",          "Database::retrieve(lastHash)",
+    "Database::retrieve_by_hash",  "Database::retrieve_by_index",
+    "Database::get_message_count", "Database::store",
+    "Database::bulk_store",        "Database::open",
+    "Database::perform_cleanup"};
+
+namespace {
+
+// Generates messages for a fixed set of owners, remembering a random sample
+// of them to look up
+class MessageGenerator {
+  public:
+    explicit MessageGenerator(uint64_t num_owners) {
+        owners_.reserve(num_owners);
+        for (uint64_t i = 0; i < num_owners; ++i)
+            owners_.push_back("05" + random_hex(rng_, 64));
+        // Data is the bulk of a message, so a few distinct payloads are
+        // enough and keep generation cheap
+        for (int i = 0; i < 64; ++i)
+            payloads_.push_back(random_base64(rng_, DATA_SIZE));
+    }
+
+    // A message that stays unexpired while measuring
+    Item next_live(uint64_t now) {
+        return next(now - rng_() % MAX_AGE, TTL);
+    }
+
+    // A message that expired in an earlier partition window
+    Item next_expired(uint64_t now) {
+        const uint64_t expiry = now - 2 * TTL + rng_() % MAX_AGE;
+        return next(expiry - TTL, TTL);
+    }
+
+    const std::vector<Item>& samples() const { return samples_; }
+
+  private:
+    Item next(uint64_t timestamp, uint64_t ttl) {
+        Item item(random_hex(rng_, 128), owners_[rng_() % owners_.size()],
+                  timestamp, ttl, timestamp + ttl, random_base64(rng_, 12),
+                  payloads_[rng_() % payloads_.size()]);
+
+        // Reservoir sampling
+        ++generated_;
+        if (samples_.size() < NUM_SAMPLES)
+            samples_.push_back(item);
+        else if (const uint64_t i = rng_() % generated_; i < NUM_SAMPLES)
+            samples_[i] = item;
+        return item;
+    }
+
+    std::mt19937_64 rng_{42};
+    std::vector<std::string> owners_;
+    std::vector<std::string> payloads_;
+    std::vector<Item> samples_;
+    uint64_t generated_ = 0;
+};
+
+} // namespace
+
+// Bulk store `count` messages made by `gen`
+template <typename Gen>
+static void populate(Database& db, uint64_t count, Gen&& gen) {
+    std::vector<Item> items;
+    for (uint64_t stored = 0; stored < count; stored += items.size()) {
+        items.clear();
+        while (items.size() < POPULATE_CHUNK && stored + items.size() < count)
+            items.push_back(gen());
+        db.bulk_store(items);
+    }
+}
+
+static void bench_database(Runner& runner, uint64_t rows) {
+
+    const auto dir = fs::u8path(runner.options().db_dir) / std::to_string(rows);
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    // The cleanup timer never runs, so messages are only expired when the
+    // database is opened
+    boost::asio::io_context ioc;
+    auto db = std::make_unique<Database>(ioc, dir.u8string());
+
+    const uint64_t now = util::get_time_ms();
+    MessageGenerator gen(std::max<uint64_t>(rows / MESSAGES_PER_OWNER, 1));
+
+    std::cerr << "Populating a database of " << rows << " messages\n";
+    populate(*db, rows, [&] { return gen.next_live(now); });
+
+    const params_t params{{"rows", rows}};
+    const auto& samples = gen.samples();
+    size_t next_sample = 0;
+    const auto sample = [&]() -> const Item& {
+        return samples[next_sample++ % samples.size()];
+    };
+    std::vector<Item> items;
+    Item item;
+
+    runner.run("Database::retrieve", params, [&] {
+        items.clear();
+        db->retrieve(sample().pub_key, items, "");
+    });
+
+    runner.run("Database::retrieve(lastHash)", params, [&] {
+        const Item& last = sample();
+        items.clear();
+        db->retrieve(last.pub_key, items, last.hash);
+    });
+
+    runner.run("Database::retrieve_by_hash", params,
+               [&] { db->retrieve_by_hash(sample().hash, item); });
+
+    std::mt19937_64 index_rng{7};
+    runner.run("Database::retrieve_by_index", params,
+               [&] { db->retrieve_by_index(index_rng() % rows, item); });
+
+    uint64_t count;
+    runner.run("Database::get_message_count", params,
+               [&] { db->get_message_count(count); });
+
+    // New messages are generated outside of the measurement
+    if (runner.enabled("Database::store")) {
+        uint64_t iterations = 0, allocations = 0;
+        clock::duration elapsed{0};
+        while (elapsed < runner.options().min_time) {
+            const Item msg = gen.next_live(now);
+            const uint64_t allocations_before = allocation_count();
+            const auto start = clock::now();
+            db->store(msg.hash, msg.pub_key, msg.data, msg.ttl, msg.timestamp,
+                      msg.nonce);
+            elapsed += clock::now() - start;
+            allocations += allocation_count() - allocations_before;
+            ++iterations;
+        }
+        runner.record("Database::store", params, iterations, elapsed,
+                      allocations);
+    }
+
+    if (runner.enabled("Database::bulk_store")) {
+        uint64_t iterations = 0, allocations = 0;
+        clock::duration elapsed{0};
+        while (elapsed < runner.options().min_time) {
+            items.clear();
+            for (uint64_t i = 0; i < BULK_STORE_SIZE; ++i)
+                items.push_back(gen.next_live(now));
+            const uint64_t allocations_before = allocation_count();
+            const auto start = clock::now();
+            db->bulk_store(items);
+            elapsed += clock::now() - start;
+            allocations += allocation_count() - allocations_before;
+            ++iterations;
+        }
+        runner.record("Database::bulk_store",
+                      {{"rows", rows}, {"batch", BULK_STORE_SIZE}}, iterations,
+                      elapsed, allocations);
+    }
+
+    if (runner.enabled("Database::open")) {
+        db.reset();
+        const uint64_t allocations = allocation_count();
+        const auto start = clock::now();
+        db = std::make_unique<Database>(ioc, dir.u8string());
+        runner.record("Database::open", params, 1, clock::now() - start,
+                      allocation_count() - allocations);
+    }
+
+    // The first cleanup pass starts as the database is opened, so reopen it
+    // with some expired messages and wait for the count to drop. This
+    // includes the time to open it, measured above.
+    if (runner.enabled("Database::perform_cleanup")) {
+        const uint64_t expired = std::max<uint64_t>(rows / EXPIRED_RATIO, 1);
+        populate(*db, expired, [&] { return gen.next_expired(now); });
+        uint64_t before;
+        db->get_message_count(before);
+
+        db.reset();
+        const uint64_t allocations = allocation_count();
+        const auto start = clock::now();
+        db = std::make_unique<Database>(ioc, dir.u8string());
+        while (db->get_message_count(count) && count > before - expired &&
+               clock::now() - start < CLEANUP_TIMEOUT) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        if (count > before - expired) {
+            std::cerr << "Expired messages weren't cleaned up\n";
+        } else {
+            runner.record("Database::perform_cleanup",
+                          {{"rows", rows}, {"expired", expired}}, 1,
+                          clock::now() - start,
+                          allocation_count() - allocations);
+        }
+    }
+
+    db.reset();
+    fs::remove_all(dir);
+}
+
+void bench_storage(Runner& runner) {
+    // Populating is slow, so skip it if nothing would use the database
+    if (std::none_of(std::begin(BENCHMARKS), std::end(BENCHMARKS),
+                     [&](const char* name) { return runner.enabled(name); }))
+        return;
+    for (uint64_t rows : runner.options().rows)
+        bench_database(runner, rows);
+}
+
+} // namespace oxen::bench
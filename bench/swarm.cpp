@@ -0,0 +1,85 @@
+#include "bench.hpp"
+#include "swarm.h"
+
+namespace oxen::bench {
+
+// Nodes per swarm, so that 400 swarms make about as many nodes as the network
+constexpr size_t SWARM_SIZE = 5;
+// User pubkeys looked up in turn
+constexpr size_t NUM_PUBKEYS = 1024;
+
+static std::string random_base32z(std::mt19937_64& rng, size_t size) {
+    constexpr const char* digits = "ybndrfg8ejkmcpqxot1uwisza345h769";
+    std::string result(size, 'y');
+    for (auto& c : result)
+        c = digits[rng() % 32];
+    return result;
+}
+
+static all_swarms_t make_swarms(std::mt19937_64& rng, size_t num_swarms) {
+    all_swarms_t swarms;
+    for (size_t i = 0; i < num_swarms; ++i) {
+        SwarmInfo swarm{rng(), {}};
+        for (size_t j = 0; j < SWARM_SIZE; ++j) {
+            const auto x25519 = random_hex(rng, 64);
+            swarm.snodes.emplace_back(
+                22021, 22020, random_base32z(rng, sn_record_t::BASE_LEN),
+                random_hex(rng, 64), x25519, std::string(32, 'x'),
+                random_hex(rng, 64), "127.0.0.1");
+        }
+        swarms.push_back(std::move(swarm));
+    }
+    return swarms;
+}
+
+void bench_swarm(Runner& runner) {
+    std::mt19937_64 rng{42};
+
+    std::vector<user_pubkey_t> pubkeys;
+    for (size_t i = 0; i < NUM_PUBKEYS; ++i) {
+        bool created;
+        pubkeys.push_back(
+            user_pubkey_t::create("05" + random_hex(rng, 64), created));
+    }
+
+    for (uint64_t num_swarms : {10, 100, 400}) {
+        const auto swarms = make_swarms(rng, num_swarms);
+        const params_t params{{"swarms", num_swarms},
+                              {"nodes", num_swarms * SWARM_SIZE}};
+
+        size_t i = 0;
+        runner.run("get_swarm_by_pk", params, [&] {
+            get_swarm_by_pk(swarms, pubkeys[i++ % pubkeys.size()]);
+        });
+
+        // Binary search over the sorted swarm ids
+        Swarm swarm(swarms.front().snodes.front());
+        swarm.apply_swarm_changes(swarms);
+        swarm.update_state(swarms, {}, SwarmEvents{}, false);
+        runner.run("Swarm::get_swarm_by_pk", params, [&] {
+            swarm.get_swarm_by_pk(pubkeys[i++ % pubkeys.size()]);
+        });
+
+        // As done for every onion request hop
+        std::vector<std::string> ed25519_pks;
+        for (const auto& si : swarms) {
+            for (const auto& sn : si.snodes)
+                ed25519_pks.push_back(sn.pubkey_ed25519_hex());
+        }
+        runner.run("Swarm::find_node_by_ed25519_pk", params, [&] {
+            swarm.find_node_by_ed25519_pk(
+                ed25519_pks[i++ % ed25519_pks.size()]);
+        });
+
+        // Per block work on the main thread, depending on whether the block
+        // changed the swarms
+        runner.run("Swarm::update_state", params, [&] {
+            Swarm updated(swarms.front().snodes.front());
+            updated.update_state(swarms, {}, SwarmEvents{}, false);
+        });
+        runner.run("Swarm::is_unchanged", params,
+                   [&] { swarm.is_unchanged(swarms, {}, false); });
+    }
+}
+
+} // namespace oxen::bench
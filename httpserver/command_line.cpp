@@ -23,9 +23,14 @@ void command_line_parser::parse_args(int argc, char* argv[]) {
         ("log-level", po::value(&options_.log_level), "Log verbosity level, see Log Levels below for accepted values")
         ("oxend-rpc-ip", po::value(&options_.oxend_rpc_ip), "RPC IP on which the local Oxen daemon is listening (usually localhost)")
         ("oxend-rpc-port", po::value(&options_.oxend_rpc_port), "RPC port on which the local Oxen daemon is listening")
+        ("oxend-omq-rpc", po::value(&options_.oxend_omq_rpc), "OxenMQ address of the local Oxen daemon (e.g. ipc:///home/snode/.oxen/oxend.sock); if set, swarm updates are fetched when oxend announces a new block rather than polled every second")
         ("lmq-port", po::value(&options_.lmq_port), "Port used by OxenMQ")
         ("testnet", po::bool_switch(&options_.testnet), "Start storage server in testnet mode")
         ("force-start", po::bool_switch(&options_.force_start), "Ignore the initialisation ready check")
+        ("binary-payloads", po::bool_switch(&options_.binary_payloads), "Store message data as raw bytes rather than base64 (about 25% smaller)")
+        ("message-cache-mb", po::value(&options_.message_cache_mb), "Memory used to cache recently stored messages, in MiB (0 disables the cache)")
+        ("storage-engine", po::value(&options_.storage_engine), "Where messages are stored: `sqlite' (default), `log' (append-only files expired by the hour) or `memory' (lost on restart)")
+        ("db-shards", po::value(&options_.db_shards), "Split messages by owner across this many SQLite databases, each with its own writer (can't be changed once messages are stored)")
         ("bind-ip", po::value(&options_.ip)->default_value("0.0.0.0"), "IP to which to bind the server")
         ("version,v", po::bool_switch(&options_.print_version), "Print the version of this binary")
         ("help", po::bool_switch(&options_.print_help),"Shows this help message")
@@ -84,6 +89,20 @@ void command_line_parser::parse_args(int argc, char* argv[]) {
             "lmq-port command line option is not specified");
     }
 
+    if (options_.storage_engine != "sqlite" &&
+        options_.storage_engine != "log" &&
+        options_.storage_engine != "memory") {
+        throw std::runtime_error("Invalid option: unknown storage engine " +
+                                 options_.storage_engine);
+    }
+
+    if (options_.db_shards == 0 ||
+        (options_.db_shards > 1 && options_.storage_engine != "sqlite")) {
+        throw std::runtime_error(
+            "Invalid option: db-shards must be positive, and can only be "
+            "used with the sqlite storage engine");
+    }
+
     if (!vm.count("ip") || !vm.count("port")) {
         throw std::runtime_error(
             "Invalid option: address and/or port missing.");
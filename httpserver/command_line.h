@@ -9,11 +9,21 @@ struct command_line_options {
     uint16_t port;
     std::string oxend_rpc_ip = "127.0.0.1";
     uint16_t oxend_rpc_port = 22023; // Or 38157 if `testnet`
+    // OxenMQ address of oxend, to get pushed new blocks from rather than
+    // polling its HTTP RPC for swarm updates
+    std::string oxend_omq_rpc;
     uint16_t lmq_port;
     bool force_start = false;
     bool print_version = false;
     bool print_help = false;
     bool testnet = false;
+    bool binary_payloads = false;
+    // Memory used to cache recently stored messages
+    size_t message_cache_mb = 64;
+    // "sqlite", "log" or "memory"
+    std::string storage_engine = "sqlite";
+    // Number of SQLite databases messages are split across
+    size_t db_shards = 1;
     std::string ip;
     std::string log_level = "info";
     std::string data_dir;
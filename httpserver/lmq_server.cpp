@@ -4,6 +4,7 @@
 #include "oxen_common.h"
 #include "oxen_logger.h"
 #include "oxend_key.h"
+#include "oxend_omq_client.h"
 #include "request_handler.h"
 #include "service_node.h"
 
@@ -31,7 +32,8 @@ std::string OxenmqServer::peer_lookup(std::string_view pubkey_bin) const {
     }
 }
 
-void OxenmqServer::handle_sn_data(oxenmq::Message& message) {
+void OxenmqServer::handle_sn_data(oxenmq::Message& message,
+                                  bool binary_payloads) {
 
     OXEN_LOG(debug, "[LMQ] handle_sn_data");
     OXEN_LOG(debug, "[LMQ]   thread id: {}", std::this_thread::get_id());
@@ -45,7 +47,7 @@ void OxenmqServer::handle_sn_data(oxenmq::Message& message) {
     }
 
     // TODO: proces push batch should move to "Request handler"
-    service_node_->process_push_batch(ss.str());
+    service_node_->process_push_batch(ss.str(), binary_payloads);
 
     OXEN_LOG(debug, "[LMQ] send reply");
 
@@ -167,7 +169,8 @@ void OxenmqServer::handle_get_stats(oxenmq::Message& message) {
 
 void OxenmqServer::init(ServiceNode* sn, RequestHandler* rh,
                         const oxend_key_pair_t& keypair,
-                        const std::vector<std::string>& stats_access_keys) {
+                        const std::vector<std::string>& stats_access_keys,
+                        const std::string& oxend_omq_rpc) {
 
     using oxenmq::Allow;
 
@@ -209,7 +212,8 @@ void OxenmqServer::init(ServiceNode* sn, RequestHandler* rh,
     oxenmq_->log_level(oxenmq::LogLevel::info);
     // clang-format off
     oxenmq_->add_category("sn", oxenmq::Access{oxenmq::AuthLevel::none, true, false})
-        .add_request_command("data", [this](auto& m) { this->handle_sn_data(m); })
+        .add_request_command("data", [this](auto& m) { this->handle_sn_data(m, false); })
+        .add_request_command("data_v2", [this](auto& m) { this->handle_sn_data(m, true); })
         .add_request_command("proxy_exit", [this](auto& m) { this->handle_sn_proxy_exit(m); })
         .add_request_command("onion_req", [this](auto& m) { this->handle_onion_request(m, false); })
         .add_request_command("onion_req_v2", [this](auto& m) { this->handle_onion_request(m, true); })
@@ -220,6 +224,15 @@ void OxenmqServer::init(ServiceNode* sn, RequestHandler* rh,
         .add_request_command("get_logs", [this](auto& m) { this->handle_get_logs(m); });
 
     // clang-format on
+    if (!oxend_omq_rpc.empty()) {
+        oxend_ = std::make_unique<OxendOmqClient>(
+            *oxenmq_, oxend_omq_rpc,
+            [this](std::string_view block_hash) {
+                service_node_->on_oxend_block(block_hash);
+            },
+            [this]() { service_node_->on_oxend_lost(); });
+    }
+
     oxenmq_->set_general_threads(1);
 
     oxenmq_->listen_curve(
@@ -235,6 +248,9 @@ void OxenmqServer::init(ServiceNode* sn, RequestHandler* rh,
         10 * 1024 * 1024; // 10 MB (needed by the fileserver)
 
     oxenmq_->start();
+
+    if (oxend_)
+        oxend_->connect();
 }
 
 OxenmqServer::OxenmqServer(uint16_t port) : port_(port){};
@@ -19,9 +19,14 @@ namespace oxen {
 struct oxend_key_pair_t;
 class ServiceNode;
 class RequestHandler;
+class OxendOmqClient;
 
 class OxenmqServer {
 
+    // Declared before `oxenmq_` so that it outlives OxenMQ's threads, which
+    // call into it
+    std::unique_ptr<OxendOmqClient> oxend_;
+
     std::unique_ptr<OxenMQ> oxenmq_;
 
     // Has information about current SNs
@@ -33,7 +38,7 @@ class OxenmqServer {
     std::string peer_lookup(std::string_view pubkey_bin) const;
 
     // Handle Session data coming from peer SN
-    void handle_sn_data(oxenmq::Message& message);
+    void handle_sn_data(oxenmq::Message& message, bool binary_payloads);
 
     // Handle Session client requests arrived via proxy
     void handle_sn_proxy_exit(oxenmq::Message& message);
@@ -54,13 +59,20 @@ class OxenmqServer {
     OxenmqServer(uint16_t port);
     ~OxenmqServer();
 
-    // Initialize oxenmq
+    // Initialize oxenmq. If `oxend_omq_rpc` (an OxenMQ address such as
+    // ipc:///path/to/oxend.sock) is given, we also connect to oxend there
+    // and get swarm updates on each new block.
     void init(ServiceNode* sn, RequestHandler* rh,
               const oxend_key_pair_t& keypair,
-              const std::vector<std::string>& stats_access_key);
+              const std::vector<std::string>& stats_access_key,
+              const std::string& oxend_omq_rpc = "");
 
     uint16_t port() { return port_; }
 
+    /// The connection to oxend, if we use one rather than polling it over
+    /// HTTP
+    OxendOmqClient* oxend() const { return oxend_.get(); }
+
     /// True if OxenMQ instance has been set
     explicit operator bool() const { return (bool)oxenmq_; }
     /// Dereferencing via * or -> accesses the contained OxenMQ instance.
@@ -131,6 +131,9 @@ int main(int argc, char* argv[]) {
     OXEN_LOG(info, "Setting database location to {}", options.data_dir);
     OXEN_LOG(info, "Setting Oxend RPC to {}:{}", options.oxend_rpc_ip,
              options.oxend_rpc_port);
+    if (!options.oxend_omq_rpc.empty())
+        OXEN_LOG(info, "Getting new blocks from Oxend at {}",
+                 options.oxend_omq_rpc);
     OXEN_LOG(info, "Https server is listening at {}:{}", options.ip,
              options.port);
     OXEN_LOG(info, "OxenMQ is listening at {}:{}", options.ip,
@@ -222,17 +225,28 @@ int main(int argc, char* argv[]) {
         // the rest of lmq server before we have a reference to ServiceNode
         oxen::OxenmqServer oxenmq_server(options.lmq_port);
 
+        const size_t message_cache_size = options.message_cache_mb << 20;
+        auto storage_engine = oxen::StorageEngineType::SQLITE;
+        if (options.storage_engine == "log")
+            storage_engine = oxen::StorageEngineType::LOG;
+        else if (options.storage_engine == "memory")
+            storage_engine = oxen::StorageEngineType::MEMORY;
+
         // TODO: SN doesn't need oxenmq_server, just the lmq components
         oxen::ServiceNode service_node(ioc, worker_ioc, options.port,
                                        oxenmq_server, oxend_key_pair,
                                        pubkey_ed25519_hex, options.data_dir,
-                                       oxend_client, options.force_start);
+                                       oxend_client, options.force_start,
+                                       options.binary_payloads,
+                                       message_cache_size, storage_engine,
+                                       options.db_shards);
 
         oxen::RequestHandler request_handler(ioc, service_node, oxend_client,
                                              channel_encryption);
 
         oxenmq_server.init(&service_node, &request_handler,
-                           oxend_key_pair_x25519, options.stats_access_keys);
+                           oxend_key_pair_x25519, options.stats_access_keys,
+                           options.oxend_omq_rpc);
 
         RateLimiter rate_limiter;
 
@@ -0,0 +1,165 @@
+#include "oxend_omq_client.h"
+#include "oxen_logger.h"
+
+#include <nlohmann/json.hpp>
+#include <oxenmq/oxenmq.h>
+
+namespace oxen {
+
+OxendOmqClient::OxendOmqClient(oxenmq::OxenMQ& omq, std::string address,
+                               block_callback_t on_block,
+                               lost_callback_t on_lost)
+    : omq_(omq), address_(std::move(address)), on_block_(std::move(on_block)),
+      on_lost_(std::move(on_lost)) {
+
+    // oxend is granted this level on the connection we make to it, see
+    // `tick`. Other peers can have it too (e.g. those with a stats access
+    // key), so notifications are only taken from that connection.
+    omq_.add_category("notify", oxenmq::AuthLevel::basic)
+        .add_command("block", [this](oxenmq::Message& message) {
+            {
+                std::lock_guard guard(mutex_);
+                if (!conn_ || !(*conn_ == message.conn)) {
+                    OXEN_LOG(debug, "Ignoring a block notification that "
+                                    "didn't come from oxend");
+                    return;
+                }
+            }
+            // [height, hash]
+            on_block_(message.data.size() >= 2 ? message.data[1]
+                                               : std::string_view{});
+        });
+}
+
+OxendOmqClient::~OxendOmqClient() = default;
+
+void OxendOmqClient::connect(std::chrono::milliseconds reconnect_interval,
+                             std::chrono::milliseconds renew_interval) {
+    renew_interval_ = renew_interval;
+    tick();
+    omq_.add_timer([this] { tick(); }, reconnect_interval);
+}
+
+bool OxendOmqClient::connected() const {
+    std::lock_guard guard(mutex_);
+    return conn_ != nullptr;
+}
+
+bool OxendOmqClient::subscribed() const {
+    std::lock_guard guard(mutex_);
+    return subscribed_;
+}
+
+void OxendOmqClient::tick() {
+
+    std::unique_lock lock(mutex_);
+    if (conn_) {
+        if (clock::now() - subscribed_at_ < renew_interval_)
+            return;
+        const auto conn = *conn_;
+        // Not to renew it again before the reply comes back
+        subscribed_at_ = clock::now();
+        lock.unlock();
+        subscribe(conn);
+        return;
+    }
+    if (connecting_)
+        return;
+    connecting_ = true;
+    lock.unlock();
+
+    OXEN_LOG(info, "Connecting to oxend at {}", address_);
+    omq_.connect_remote(
+        oxenmq::address{address_},
+        [this](oxenmq::ConnectionID conn) {
+            OXEN_LOG(info, "Connected to oxend at {}", address_);
+            {
+                std::lock_guard guard(mutex_);
+                conn_ = std::make_unique<oxenmq::ConnectionID>(conn);
+                connecting_ = false;
+                subscribed_at_ = clock::now();
+            }
+            subscribe(conn);
+        },
+        [this](oxenmq::ConnectionID, std::string_view reason) {
+            OXEN_LOG(error, "Failed to connect to oxend at {}: {}", address_,
+                     reason);
+            std::lock_guard guard(mutex_);
+            connecting_ = false;
+        },
+        oxenmq::AuthLevel::basic);
+}
+
+void OxendOmqClient::subscribe(const oxenmq::ConnectionID& conn) {
+
+    omq_.request(
+        conn, "sub.block",
+        [this, conn](bool success, std::vector<std::string> data) {
+            if (!success || data.empty() ||
+                (data[0] != "OK" && data[0] != "ALREADY")) {
+                OXEN_LOG(error, "Failed to subscribe to oxend blocks: {}",
+                         success && !data.empty() ? data[0] : "no reply");
+                on_disconnected(conn);
+                return;
+            }
+            {
+                std::lock_guard guard(mutex_);
+                if (!conn_ || !(*conn_ == conn))
+                    return;
+                subscribed_ = true;
+            }
+            // "ALREADY" renews a subscription, whereas a new one might have
+            // missed some blocks
+            if (data[0] == "OK") {
+                OXEN_LOG(debug, "Subscribed to oxend blocks");
+                on_block_({});
+            }
+        });
+}
+
+void OxendOmqClient::on_disconnected(const oxenmq::ConnectionID& conn) {
+    {
+        std::lock_guard guard(mutex_);
+        if (!conn_ || !(*conn_ == conn))
+            return;
+        conn_.reset();
+        subscribed_ = false;
+    }
+    omq_.disconnect(conn);
+    if (on_lost_)
+        on_lost_();
+}
+
+void OxendOmqClient::request(std::string_view method,
+                             const nlohmann::json& params, rpc_callback_t cb) {
+
+    std::unique_lock lock(mutex_);
+    if (!conn_) {
+        lock.unlock();
+        OXEN_LOG(warn, "Can't request {} from oxend: not connected", method);
+        cb(false, {});
+        return;
+    }
+    const auto conn = *conn_;
+    lock.unlock();
+
+    omq_.request(
+        conn, "rpc." + std::string(method),
+        [this, conn, cb = std::move(cb)](bool success,
+                                         std::vector<std::string> data) {
+            // A timeout means that oxend has gone away, so stop counting on
+            // its notifications until we have reconnected
+            if (!success) {
+                OXEN_LOG(error, "Request to oxend timed out");
+                on_disconnected(conn);
+            }
+            // oxend replies with an HTTP status code and the JSON result
+            if (success && data.size() == 2 && data[0] == "200")
+                cb(true, std::move(data[1]));
+            else
+                cb(false, {});
+        },
+        params.dump());
+}
+
+} // namespace oxen
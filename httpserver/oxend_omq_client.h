@@ -0,0 +1,89 @@
+#pragma once
+
+#include <nlohmann/json_fwd.hpp>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+namespace oxenmq {
+class OxenMQ;
+struct ConnectionID;
+} // namespace oxenmq
+
+namespace oxen {
+
+// How often we retry connecting to oxend while we can't
+constexpr std::chrono::seconds OXEND_RECONNECT_INTERVAL{10};
+// oxend drops block subscriptions that aren't renewed within an hour; we renew
+// more often than that so that a dead connection is noticed soon
+constexpr std::chrono::seconds OXEND_SUBSCRIPTION_RENEW_INTERVAL{30};
+
+/// A persistent OxenMQ connection to oxend. oxend pushes a `notify.block`
+/// message for each new block, so that we don't have to poll it, and RPC
+/// requests go over the same connection rather than a new HTTP one each.
+class OxendOmqClient {
+  public:
+    // Called with the hash of a new block, or with an empty hash when we
+    // (re)subscribe and might have missed some blocks. Runs on an OxenMQ
+    // thread.
+    using block_callback_t = std::function<void(std::string_view block_hash)>;
+    // Called when a subscription fails or a request times out, after which
+    // we no longer get new blocks until we have subscribed again. Runs on an
+    // OxenMQ thread.
+    using lost_callback_t = std::function<void()>;
+    // Called with the JSON body of a successful response
+    using rpc_callback_t = std::function<void(bool success, std::string body)>;
+
+    // Registers the `notify.block` command, so this has to be constructed
+    // before `omq` is started
+    OxendOmqClient(oxenmq::OxenMQ& omq, std::string address,
+                   block_callback_t on_block, lost_callback_t on_lost = {});
+    ~OxendOmqClient();
+
+    // Connects to oxend once `omq` has been started, subscribing to new
+    // blocks. The connection is retried every `reconnect_interval` until it
+    // succeeds (or after it fails), and the subscription renewed every
+    // `renew_interval`.
+    void connect(
+        std::chrono::milliseconds reconnect_interval = OXEND_RECONNECT_INTERVAL,
+        std::chrono::milliseconds renew_interval =
+            OXEND_SUBSCRIPTION_RENEW_INTERVAL);
+
+    // Makes the `rpc.<method>` request; fails right away if we aren't
+    // connected
+    void request(std::string_view method, const nlohmann::json& params,
+                 rpc_callback_t cb);
+
+    bool connected() const;
+
+    // Whether oxend has confirmed our subscription to new blocks on the
+    // current connection
+    bool subscribed() const;
+
+  private:
+    using clock = std::chrono::steady_clock;
+
+    // Connects if we aren't, or renews the subscription when it is due
+    void tick();
+    void subscribe(const oxenmq::ConnectionID& conn);
+    void on_disconnected(const oxenmq::ConnectionID& conn);
+
+    oxenmq::OxenMQ& omq_;
+    const std::string address_;
+    const block_callback_t on_block_;
+    const lost_callback_t on_lost_;
+    std::chrono::milliseconds renew_interval_{0};
+
+    mutable std::mutex mutex_;
+    // Guarded by `mutex_`
+    std::unique_ptr<oxenmq::ConnectionID> conn_;
+    bool connecting_ = false;
+    bool subscribed_ = false;
+    clock::time_point subscribed_at_;
+};
+
+} // namespace oxen
@@ -76,7 +76,8 @@ Response RequestHandler::handle_wrong_swarm(const user_pubkey_t& pubKey) {
                     ContentType::json};
 }
 
-Response RequestHandler::process_store(const json& params) {
+void RequestHandler::process_store(const json& params,
+                                   std::function<void(Response)> cb) {
 
     constexpr const char* fields[] = {"pubKey", "ttl", "nonce", "timestamp",
                                       "data"};
@@ -85,9 +86,9 @@ Response RequestHandler::process_store(const json& params) {
         if (!params.contains(field)) {
 
             OXEN_LOG(debug, "Bad client request: no `{}` field", field);
-            return Response{
-                Status::BAD_REQUEST,
-                fmt::format("invalid json: no `{}` field\n", field)};
+            cb(Response{Status::BAD_REQUEST,
+                        fmt::format("invalid json: no `{}` field\n", field)});
+            return;
         }
     }
 
@@ -107,7 +108,8 @@ Response RequestHandler::process_store(const json& params) {
         auto msg = fmt::format("Pubkey must be {} characters long\n",
                                get_user_pubkey_size());
         OXEN_LOG(debug, "{}", msg);
-        return Response{Status::BAD_REQUEST, std::move(msg)};
+        cb(Response{Status::BAD_REQUEST, std::move(msg)});
+        return;
     }
 
     if (data.size() > MAX_MESSAGE_BODY) {
@@ -116,31 +118,48 @@ Response RequestHandler::process_store(const json& params) {
         auto msg =
             fmt::format("Message body exceeds maximum allowed length of {}\n",
                         MAX_MESSAGE_BODY);
-        return Response{Status::BAD_REQUEST, std::move(msg)};
+        cb(Response{Status::BAD_REQUEST, std::move(msg)});
+        return;
     }
 
     if (!service_node_.is_pubkey_for_us(pk)) {
-        return this->handle_wrong_swarm(pk);
+        cb(this->handle_wrong_swarm(pk));
+        return;
+    }
+
+    // The PoW is checked against the hash of the parsed timestamp and TTL
+    // printed back in decimal, so any other spelling of them (leading zeros,
+    // signs, spaces, trailing characters) would fail it
+    if (!util::isCanonicalDecimal(ttl) ||
+        !util::isCanonicalDecimal(timestamp)) {
+        OXEN_LOG(debug, "Bad client request: non-canonical TTL ({}) or "
+                        "timestamp ({})",
+                 ttl, timestamp);
+        cb(Response{Status::BAD_REQUEST,
+                    "TTL and timestamp must be decimal numbers without "
+                    "leading zeros\n"});
+        return;
     }
 
     uint64_t ttlInt;
     if (!util::parseTTL(ttl, ttlInt)) {
         OXEN_LOG(debug, "Forbidden. Invalid TTL: {}", ttl);
-        return Response{Status::FORBIDDEN, "Provided TTL is not valid.\n"};
+        cb(Response{Status::FORBIDDEN, "Provided TTL is not valid.\n"});
+        return;
     }
 
     uint64_t timestampInt;
     if (!util::parseTimestamp(timestamp, ttlInt, timestampInt)) {
         OXEN_LOG(debug, "Forbidden. Invalid Timestamp: {}", timestamp);
-        return Response{Status::NOT_ACCEPTABLE,
-                        "Timestamp error: check your clock\n"};
+        cb(Response{Status::NOT_ACCEPTABLE,
+                    "Timestamp error: check your clock\n"});
+        return;
     }
 
     // Do not store message if the PoW provided is invalid
-    std::string messageHash;
-
+    pow_hash_t hash{};
     const bool valid_pow =
-        checkPoW(nonce, timestamp, ttl, pk.str(), data, messageHash,
+        checkPoW(nonce, timestampInt, ttlInt, pk.str(), data, hash,
                  service_node_.get_curr_pow_difficulty());
 #ifndef DISABLE_POW
     if (!valid_pow) {
@@ -149,38 +168,52 @@ Response RequestHandler::process_store(const json& params) {
         json res_body;
         res_body["difficulty"] = service_node_.get_curr_pow_difficulty();
 
-        return Response{Status::INVALID_POW, res_body.dump(),
-                        ContentType::json};
+        cb(Response{Status::INVALID_POW, res_body.dump(),
+                    ContentType::json});
+        return;
     }
 #endif
 
     bool success;
 
     try {
-        const auto msg =
-            message_t{pk.str(), data, messageHash, ttlInt, timestampInt, nonce};
-        success = service_node_.process_store(msg);
+        auto msg = message_t{pk.str(), data,
+                             std::string(hash.data(), hash.size()),
+                             ttlInt, timestampInt, nonce};
+        // Only respond once the message has been committed to the database
+        auto on_stored = [this, cb, pk = pk.str()](bool stored) {
+            if (!stored) {
+                OXEN_LOG(critical, "Could not commit message for {}",
+                         obfuscate_pubkey(pk));
+                cb(Response{Status::INTERNAL_SERVER_ERROR,
+                            "Could not store message\n"});
+                return;
+            }
+
+            OXEN_LOG(trace, "Successfully stored message for {}",
+                     obfuscate_pubkey(pk));
+
+            json res_body;
+            res_body["difficulty"] = service_node_.get_curr_pow_difficulty();
+
+            cb(Response{Status::OK, res_body.dump(), ContentType::json});
+        };
+        success = service_node_.process_store(std::move(msg),
+                                              std::move(on_stored));
     } catch (std::exception e) {
         OXEN_LOG(critical,
                  "Internal Server Error. Could not store message for {}",
                  obfuscate_pubkey(pk.str()));
-        return Response{Status::INTERNAL_SERVER_ERROR, e.what()};
+        cb(Response{Status::INTERNAL_SERVER_ERROR, e.what()});
+        return;
     }
 
     if (!success) {
 
         OXEN_LOG(warn, "Service node is initializing");
-        return Response{Status::SERVICE_UNAVAILABLE,
-                        "Service node is initializing\n"};
+        cb(Response{Status::SERVICE_UNAVAILABLE,
+                    "Service node is initializing\n"});
     }
-
-    OXEN_LOG(trace, "Successfully stored message for {}",
-             obfuscate_pubkey(pk.str()));
-
-    json res_body;
-    res_body["difficulty"] = service_node_.get_curr_pow_difficulty();
-
-    return Response{Status::OK, res_body.dump(), ContentType::json};
 }
 
 Response RequestHandler::process_retrieve_all() {
@@ -337,7 +370,7 @@ void RequestHandler::process_client_req(
 
     if (method_name == "store") {
         OXEN_LOG(debug, "Process client request: store");
-        cb(this->process_store(*params_it));
+        this->process_store(*params_it, std::move(cb));
 
     } else if (method_name == "retrieve") {
         OXEN_LOG(debug, "Process client request: retrieve");
@@ -37,8 +37,8 @@ enum class ContentType {
 
 namespace ss_client {
 
+// Data relays go through `ServiceNode::relay_data_reliable` instead
 enum class ReqMethod {
-    DATA,       // Database entries
     PROXY_EXIT, // A session client request coming through a proxy
     ONION_REQUEST,
 };
@@ -92,8 +92,10 @@ class RequestHandler {
     // explicitly
     Response process_snodes_by_pk(const nlohmann::json& params) const;
 
-    // Save the message and relay the swarm
-    Response process_store(const nlohmann::json& params);
+    // Save the message and relay the swarm; `cb` is invoked once the message
+    // has been committed to the database
+    void process_store(const nlohmann::json& params,
+                       std::function<void(oxen::Response)> cb);
 
     // Query the database and return requested messages
     Response process_retrieve(const nlohmann::json& params);
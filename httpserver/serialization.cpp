@@ -7,6 +7,7 @@
 
 #include <boost/endian/conversion.hpp>
 #include <boost/format.hpp>
+#include <oxenmq/base64.h>
 
 using oxen::storage::Item;
 
@@ -34,13 +35,39 @@ static void serialize(std::string& buf, const std::string& str) {
     buf += str;
 }
 
+// Binary payloads are prefixed with one of these
+enum class payload_encoding : uint8_t { verbatim = 0, base64 = 1 };
+
+static void serialize_binary_payload(std::string& buf,
+                                     const std::string& data) {
+
+    // Only decode when encoding again gives back exactly the same payload, as
+    // the message hash covers the base64 text
+    if (oxenmq::is_base64(data)) {
+        auto bytes = oxenmq::from_base64(data);
+        if (oxenmq::to_base64(bytes) == data) {
+            serialize_integer(buf,
+                              static_cast<uint8_t>(payload_encoding::base64));
+            serialize(buf, bytes);
+            return;
+        }
+    }
+
+    serialize_integer(buf,
+                      static_cast<uint8_t>(payload_encoding::verbatim));
+    serialize(buf, data);
+}
+
 template <typename T>
-void serialize_message(std::string& res, const T& msg) {
+void serialize_message(std::string& res, const T& msg, bool binary_payloads) {
 
     /// TODO: use binary / base64 representation for pk
     res += msg.pub_key;
     serialize(res, msg.hash);
-    serialize(res, msg.data);
+    if (binary_payloads)
+        serialize_binary_payload(res, msg.data);
+    else
+        serialize(res, msg.data);
     serialize_integer(res, msg.ttl);
     serialize_integer(res, msg.timestamp);
     serialize(res, msg.nonce);
@@ -48,11 +75,14 @@ void serialize_message(std::string& res, const T& msg) {
     OXEN_LOG(trace, "serialized message: {}", msg.data);
 }
 
-template void serialize_message(std::string& res, const message_t& msg);
-template void serialize_message(std::string& res, const Item& msg);
+template void serialize_message(std::string& res, const message_t& msg,
+                                bool binary_payloads);
+template void serialize_message(std::string& res, const Item& msg,
+                                bool binary_payloads);
 
 template <typename T>
-std::vector<std::string> serialize_messages(const std::vector<T>& msgs) {
+std::vector<std::string> serialize_messages(const std::vector<T>& msgs,
+                                            bool binary_payloads) {
 
     std::vector<std::string> res;
 
@@ -61,7 +91,7 @@ std::vector<std::string> serialize_messages(const std::vector<T>& msgs) {
     constexpr size_t BATCH_SIZE = 500000;
 
     for (const auto& msg : msgs) {
-        serialize_message(buf, msg);
+        serialize_message(buf, msg, binary_payloads);
         if (buf.size() > BATCH_SIZE) {
             res.push_back(std::move(buf));
             buf.clear();
@@ -76,10 +106,10 @@ std::vector<std::string> serialize_messages(const std::vector<T>& msgs) {
 }
 
 template std::vector<std::string>
-serialize_messages(const std::vector<message_t>& msgs);
+serialize_messages(const std::vector<message_t>& msgs, bool binary_payloads);
 
 template std::vector<std::string>
-serialize_messages(const std::vector<Item>& msgs);
+serialize_messages(const std::vector<Item>& msgs, bool binary_payloads);
 
 struct string_view {
 
@@ -128,7 +158,33 @@ static std::optional<uint64_t> deserialize_uint64(string_view& slice) {
     return res;
 }
 
-std::vector<message_t> deserialize_messages(const std::string& blob) {
+static std::optional<std::string>
+deserialize_binary_payload(string_view& slice) {
+
+    if (slice.size() < sizeof(payload_encoding))
+        return std::nullopt;
+
+    const auto encoding =
+        static_cast<payload_encoding>(deserialize_integer<uint8_t>(slice.it));
+
+    auto data = deserialize_string(slice);
+    if (!data)
+        return std::nullopt;
+
+    switch (encoding) {
+    case payload_encoding::verbatim:
+        return data;
+    case payload_encoding::base64:
+        return oxenmq::to_base64(*data);
+    }
+
+    OXEN_LOG(debug, "Unknown payload encoding: {}",
+             static_cast<int>(encoding));
+    return std::nullopt;
+}
+
+std::vector<message_t> deserialize_messages(const std::string& blob,
+                                            bool binary_payloads) {
 
     OXEN_LOG(trace, "=== Deserializing ===");
 
@@ -153,7 +209,8 @@ std::vector<message_t> deserialize_messages(const std::string& blob) {
         }
 
         /// Deserialize Data
-        auto data = deserialize_string(slice);
+        auto data = binary_payloads ? deserialize_binary_payload(slice)
+                                    : deserialize_string(slice);
         if (!data) {
             OXEN_LOG(debug, "Could not deserialize data");
             return {};
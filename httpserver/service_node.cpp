@@ -2,12 +2,16 @@
 
 #include "Database.hpp"
 #include "Item.hpp"
+#include "LogDatabase.hpp"
+#include "MemoryDatabase.hpp"
+#include "ShardedDatabase.hpp"
 #include "http_connection.h"
 #include "https_client.h"
 #include "lmq_server.h"
 #include "oxen_common.h"
 #include "oxen_logger.h"
 #include "oxend_key.h"
+#include "oxend_omq_client.h"
 #include "net_stats.h"
 #include "serialization.h"
 #include "signature.h"
@@ -26,6 +30,7 @@
 #include <algorithm>
 #include <chrono>
 #include <fstream>
+#include <future>
 #include <string_view>
 
 #include <boost/bind/bind.hpp>
@@ -111,42 +116,75 @@ constexpr std::chrono::minutes OXEND_PING_INTERVAL = 5min;
 constexpr std::chrono::minutes POW_DIFFICULTY_UPDATE_INTERVAL = 10min;
 constexpr std::chrono::seconds VERSION_CHECK_INTERVAL = 10min;
 constexpr int CLIENT_RETRIEVE_MESSAGE_LIMIT = 10;
+// Push batches are split into chunks of at least this many messages to
+// verify in parallel
+constexpr size_t VERIFY_CHUNK_MIN_SIZE = 16;
 
 static std::shared_ptr<request_t> make_push_all_request(std::string&& data) {
     return build_post_request("/swarms/push_batch/v1", std::move(data));
 }
 
-static bool verify_message(const message_t& msg,
-                           const std::vector<pow_difficulty_t> history,
-                           const char** error_message = nullptr) {
-    if (!util::validateTTL(msg.ttl)) {
-        if (error_message)
-            *error_message = "Provided TTL is not valid";
-        return false;
-    }
-    if (!util::validateTimestamp(msg.timestamp, msg.ttl)) {
-        if (error_message)
-            *error_message = "Provided timestamp is not valid";
-        return false;
-    }
-    std::string hash;
 #ifndef DISABLE_POW
-    const int difficulty =
-        get_valid_difficulty(std::to_string(msg.timestamp), history);
-    if (!checkPoW(msg.nonce, std::to_string(msg.timestamp),
-                  std::to_string(msg.ttl), msg.pub_key, msg.data, hash,
-                  difficulty)) {
-        if (error_message)
-            *error_message = "Provided PoW nonce is not valid";
-        return false;
+// Check the TTL, timestamp, PoW and hash of `count` messages, setting
+// `valid[i]` for `messages[i]`. The PoW of several messages is checked at
+// once (see `checkPoW_batch`).
+static void verify_messages(const message_t* messages, size_t count,
+                            const std::vector<pow_difficulty_t>& history,
+                            char* valid) {
+
+    std::vector<pow_message_t> pow_messages;
+    std::vector<size_t> indices;
+    pow_messages.reserve(count);
+    indices.reserve(count);
+
+    for (size_t i = 0; i < count; ++i) {
+        const message_t& msg = messages[i];
+        valid[i] = false;
+        if (!util::validateTTL(msg.ttl) ||
+            !util::validateTimestamp(msg.timestamp, msg.ttl))
+            continue;
+        const int difficulty = get_valid_difficulty(msg.timestamp, history);
+        pow_messages.push_back(pow_message_t{msg.nonce, msg.timestamp, msg.ttl,
+                                             msg.pub_key, msg.data,
+                                             difficulty});
+        indices.push_back(i);
+    }
+
+    std::unique_ptr<bool[]> pow_valid(new bool[pow_messages.size()]);
+    std::vector<pow_hash_t> hashes(pow_messages.size());
+    checkPoW_batch(pow_messages.data(), pow_messages.size(), pow_valid.get(),
+                   hashes.data());
+
+    for (size_t j = 0; j < indices.size(); ++j) {
+        const auto& hash = hashes[j];
+        valid[indices[j]] =
+            pow_valid[j] && messages[indices[j]].hash ==
+                                std::string_view(hash.data(), hash.size());
     }
+}
 #endif
-    if (hash != msg.hash) {
-        if (error_message)
-            *error_message = "Incorrect hash provided";
-        return false;
-    }
-    return true;
+
+static std::unique_ptr<StorageEngine>
+make_storage_engine(boost::asio::io_context& ioc, StorageEngineType type,
+                    const std::string& db_location, bool binary_payloads,
+                    size_t message_cache_size, size_t db_shards) {
+    if (type == StorageEngineType::MEMORY) {
+        OXEN_LOG(warn, "Keeping messages in memory only, they will be lost "
+                       "on restart");
+        return std::make_unique<MemoryDatabase>(ioc);
+    }
+    if (type == StorageEngineType::LOG)
+        return std::make_unique<LogDatabase>(ioc, db_location);
+    const auto payload_format = binary_payloads
+                                    ? Database::PayloadFormat::BINARY
+                                    : Database::PayloadFormat::BASE64;
+    if (db_shards > 1) {
+        OXEN_LOG(info, "Splitting messages across {} databases", db_shards);
+        return std::make_unique<ShardedDatabase>(
+            ioc, db_location, db_shards, payload_format, message_cache_size);
+    }
+    return std::make_unique<Database>(ioc, db_location, payload_format,
+                                      message_cache_size);
 }
 
 ServiceNode::ServiceNode(boost::asio::io_context& ioc,
@@ -155,9 +193,15 @@ ServiceNode::ServiceNode(boost::asio::io_context& ioc,
                          const oxend_key_pair_t& oxend_key_pair,
                          const std::string& ed25519hex,
                          const std::string& db_location,
-                         OxendClient& oxend_client, const bool force_start)
+                         OxendClient& oxend_client, const bool force_start,
+                         const bool binary_payloads,
+                         const size_t message_cache_size,
+                         const StorageEngineType storage_engine,
+                         const size_t db_shards)
     : ioc_(ioc), worker_ioc_(worker_ioc),
-      db_(std::make_unique<Database>(ioc, db_location)),
+      db_(make_storage_engine(ioc, storage_engine, db_location,
+                              binary_payloads, message_cache_size,
+                              db_shards)),
       swarm_update_timer_(ioc), oxend_ping_timer_(ioc),
       stats_cleanup_timer_(ioc), pow_update_timer_(worker_ioc),
       check_version_timer_(worker_ioc), peer_ping_timer_(ioc),
@@ -180,7 +224,7 @@ ServiceNode::ServiceNode(boost::asio::io_context& ioc,
 
     // TODO: fail hard if we can't encode our public key
     OXEN_LOG(info, "Read our snode address: {}", our_address_);
-    swarm_ = std::make_unique<Swarm>(our_address_);
+    swarm_ = std::make_shared<const Swarm>(our_address_);
 
     OXEN_LOG(info, "Requesting initial swarm state");
 
@@ -236,7 +280,8 @@ parse_swarm_update(const std::shared_ptr<std::string>& response_body) {
 
         const json body = json::parse(*response_body, nullptr, true);
 
-        const auto& result = body.at("result");
+        // JSON-RPC over HTTP wraps the result, OxenMQ RPC replies with it
+        const auto& result = body.count("result") ? body.at("result") : body;
         bu.height = result.at("height").get<uint64_t>();
         bu.block_hash = result.at("block_hash").get<std::string>();
         bu.hardfork = result.at("hardfork").get<int>();
@@ -328,8 +373,6 @@ parse_swarm_update(const std::shared_ptr<std::string>& response_body) {
 
 void ServiceNode::bootstrap_data() {
 
-    std::lock_guard guard(sn_mutex_);
-
     OXEN_LOG(trace, "Bootstrapping peer data");
 
     json params;
@@ -393,7 +436,13 @@ void ServiceNode::bootstrap_data() {
 
                 (*req_counter)++;
 
-                if (*req_counter == node_count && this->target_height_ == 0) {
+                uint64_t target_height;
+                {
+                    std::lock_guard guard(chain_mutex_);
+                    target_height = target_height_;
+                }
+
+                if (*req_counter == node_count && target_height == 0) {
                     // If target height is still 0 after having contacted
                     // (successfully or not) all seed nodes, just assume we have
                     // finished syncing. (Otherwise we will never get a chance
@@ -408,9 +457,11 @@ void ServiceNode::bootstrap_data() {
     }
 }
 
-bool ServiceNode::snode_ready(std::string* reason) {
+bool ServiceNode::snode_ready(std::string* reason) const {
+    return snode_ready(*swarm(), reason);
+}
 
-    std::lock_guard guard(sn_mutex_);
+bool ServiceNode::snode_ready(const Swarm& swarm, std::string* reason) const {
 
     bool ready = true;
     std::string buf;
@@ -418,7 +469,7 @@ bool ServiceNode::snode_ready(std::string* reason) {
         buf += "not yet on hardfork 12; ";
         ready = false;
     }
-    if (!swarm_ || !swarm_->is_valid()) {
+    if (!swarm.is_valid()) {
         buf += "not in any swarm; ";
         ready = false;
     }
@@ -439,6 +490,15 @@ ServiceNode::~ServiceNode() {
     worker_thread_.join();
 };
 
+std::shared_ptr<const Swarm> ServiceNode::swarm() const {
+    return std::atomic_load(&swarm_);
+}
+
+uint64_t ServiceNode::block_height() const {
+    std::lock_guard guard(chain_mutex_);
+    return block_height_;
+}
+
 void ServiceNode::send_onion_to_sn_v1(const sn_record_t& sn,
                                       const std::string& payload,
                                       const std::string& eph_key,
@@ -464,16 +524,7 @@ void ServiceNode::send_to_sn(const sn_record_t& sn, ss_client::ReqMethod method,
                              ss_client::Request req,
                              ss_client::Callback cb) const {
 
-    std::lock_guard guard(sn_mutex_);
-
     switch (method) {
-    case ss_client::ReqMethod::DATA: {
-        OXEN_LOG(debug, "Sending sn.data request to {}",
-                 oxenmq::to_hex(sn.pubkey_x25519_bin()));
-        lmq_server_->request(sn.pubkey_x25519_bin(), "sn.data", std::move(cb),
-                             req.body);
-        break;
-    }
     case ss_client::ReqMethod::PROXY_EXIT: {
         auto client_key = req.headers.find(OXEN_SENDER_KEY_HEADER);
 
@@ -503,7 +554,8 @@ void ServiceNode::send_to_sn(const sn_record_t& sn, ss_client::ReqMethod method,
 }
 
 void ServiceNode::relay_data_reliable(const std::string& blob,
-                                      const sn_record_t& sn) const {
+                                      const sn_record_t& sn,
+                                      bool binary_payloads) const {
 
     auto reply_callback = [](bool success, std::vector<std::string> data) {
         if (!success) {
@@ -511,56 +563,85 @@ void ServiceNode::relay_data_reliable(const std::string& blob,
         }
     };
 
-    OXEN_LOG(debug, "Relaying data to: {}", sn);
+    const auto command = binary_payloads ? "sn.data_v2" : "sn.data";
 
-    auto req = ss_client::Request{blob, {}};
+    OXEN_LOG(debug, "Sending {} request to {}", command,
+             oxenmq::to_hex(sn.pubkey_x25519_bin()));
 
-    this->send_to_sn(sn, ss_client::ReqMethod::DATA, std::move(req),
-                     reply_callback);
+    // OxenMQ copies the view into its own message, so there is no need for a
+    // copy of our own
+    lmq_server_->request(sn.pubkey_x25519_bin(), command,
+                         std::move(reply_callback), std::string_view{blob});
 }
 
-void ServiceNode::record_proxy_request() { all_stats_.bump_proxy_requests(); }
+void ServiceNode::record_proxy_request() {
+    std::lock_guard guard(stats_mutex_);
+    all_stats_.bump_proxy_requests();
+}
 
-void ServiceNode::record_onion_request() { all_stats_.bump_onion_requests(); }
+void ServiceNode::record_onion_request() {
+    std::lock_guard guard(stats_mutex_);
+    all_stats_.bump_onion_requests();
+}
 
 /// do this asynchronously on a different thread? (on the same thread?)
-bool ServiceNode::process_store(const message_t& msg) {
-
-    std::lock_guard guard(sn_mutex_);
+bool ServiceNode::process_store(message_t msg,
+                                std::function<void(bool)> on_stored) {
 
     /// only accept a message if we are in a swarm
-    if (!swarm_) {
+    if (!swarm()) {
         // This should never be printed now that we have "snode_ready"
         OXEN_LOG(error, "error: my swarm in not initialized");
         return false;
     }
 
-    all_stats_.bump_store_requests();
+    {
+        std::lock_guard guard(stats_mutex_);
+        all_stats_.bump_store_requests();
+    }
 
     /// store in the database
-    this->save_if_new(msg);
+    this->save_if_new(msg, std::move(on_stored));
 
     // Instead of sending the messages immediatly, store them in a buffer
     // and periodically send all messages from there as batches
-    this->relay_buffer_.push_back(msg);
+    std::lock_guard guard(relay_mutex_);
+    this->relay_buffer_.push_back(std::move(msg));
 
     return true;
 }
 
-void ServiceNode::save_if_new(const message_t& msg) {
+void ServiceNode::save_if_new(const message_t& msg,
+                              std::function<void(bool)> on_saved) {
 
-    std::lock_guard guard(sn_mutex_);
+    auto item = Item{msg.hash,  msg.pub_key, msg.timestamp,
+                     msg.ttl,   msg.timestamp + msg.ttl,
+                     msg.nonce, msg.data};
 
-    if (db_->store(msg.hash, msg.pub_key, msg.data, msg.ttl, msg.timestamp,
-                   msg.nonce)) {
-        OXEN_LOG(trace, "saved message: {}", msg.data);
-    }
+    // The callback runs on the database thread, so hand the result back to
+    // the io thread before doing anything else with it
+    auto on_commit = [this, hash = msg.hash,
+                      expiration = msg.timestamp + msg.ttl,
+                      on_saved = std::move(on_saved)](bool saved) {
+        if (saved) {
+            OXEN_LOG(trace, "saved message: {}", hash);
+        }
+        if (on_saved) {
+            boost::asio::post(ioc_, [this, saved, hash, expiration,
+                                     on_saved = std::move(on_saved)]() {
+                // Not saving a message we already have is fine, whereas a
+                // failed commit leaves it unsaved
+                on_saved(saved || db_->contains(hash, expiration));
+            });
+        }
+    };
+
+    db_->store_async(std::move(item), std::move(on_commit));
 }
 
 void ServiceNode::save_bulk(const std::vector<Item>& items) {
 
-    std::lock_guard guard(sn_mutex_);
-
+    // The storage engine is thread-safe, so this doesn't need any locks
     if (!db_->bulk_store(items)) {
         OXEN_LOG(error, "failed to save batch to the database");
         return;
@@ -571,11 +652,18 @@ void ServiceNode::save_bulk(const std::vector<Item>& items) {
 
 void ServiceNode::on_bootstrap_update(block_update_t&& bu) {
 
-    // Used in a callback to needs a mutex even if it is private
-    std::lock_guard guard(sn_mutex_);
+    {
+        std::lock_guard guard(swarm_update_mutex_);
+        auto swarm = std::make_shared<Swarm>(*this->swarm());
+        swarm->apply_swarm_changes(bu.swarms);
+        std::atomic_store(&swarm_,
+                          std::shared_ptr<const Swarm>(std::move(swarm)));
+    }
 
-    swarm_->apply_swarm_changes(bu.swarms);
-    target_height_ = std::max(target_height_, bu.height);
+    {
+        std::lock_guard guard(chain_mutex_);
+        target_height_ = std::max(target_height_, bu.height);
+    }
 
     if (syncing_ && lmq_server_)
         lmq_server_->set_active_sns(std::move(bu.active_x25519_pubkeys));
@@ -596,18 +684,11 @@ OStream& operator<<(OStream& os, const SnodeStatus& status) {
 }
 
 static SnodeStatus derive_snode_status(const block_update_t& bu,
+                                       const SwarmEvents& events,
                                        const sn_record_t& our_address) {
 
-    // TODO: try not to do this again in `derive_swarm_events`
-    const auto our_swarm_it =
-        std::find_if(bu.swarms.begin(), bu.swarms.end(),
-                     [&our_address](const SwarmInfo& swarm_info) {
-                         const auto& snodes = swarm_info.snodes;
-                         return std::find(snodes.begin(), snodes.end(),
-                                          our_address) != snodes.end();
-                     });
-
-    if (our_swarm_it != bu.swarms.end()) {
+    // `derive_swarm_events` already looked for us in the swarms
+    if (events.our_swarm_id != INVALID_SWARM_ID) {
         return SnodeStatus::ACTIVE;
     }
 
@@ -622,14 +703,13 @@ static SnodeStatus derive_snode_status(const block_update_t& bu,
 
 void ServiceNode::on_swarm_update(block_update_t&& bu) {
 
-    // Used in a callback to needs a mutex even if it is private
-    std::lock_guard guard(sn_mutex_);
-
     if (this->hardfork_ != bu.hardfork) {
         OXEN_LOG(debug, "New hardfork: {}", bu.hardfork);
         hardfork_ = bu.hardfork;
     }
 
+    std::unique_lock chain_lock(chain_mutex_);
+
     if (syncing_ && target_height_ != 0) {
         syncing_ = bu.height < target_height_;
     }
@@ -667,26 +747,47 @@ void ServiceNode::on_swarm_update(block_update_t&& bu) {
         return;
     }
 
+    chain_lock.unlock();
+
     if (lmq_server_)
         lmq_server_->set_active_sns(std::move(bu.active_x25519_pubkeys));
 
-    const SwarmEvents events = swarm_->derive_swarm_events(bu.swarms);
+    std::unique_lock swarm_lock(swarm_update_mutex_);
+    const auto current = this->swarm();
+
+    std::string reason;
+    bool ready = this->snode_ready(*current, &reason);
+
+    SwarmEvents events{};
+    if (current->is_unchanged(bu.swarms, bu.decommissioned_nodes, ready)) {
+        // Most blocks don't change the swarms, so there are no events and
+        // nothing to rebuild
+        events.our_swarm_id = current->our_swarm_id();
+    } else {
+        // The new swarm state is built on a copy and only published once
+        // complete, so readers never see it half updated
+        auto swarm = std::make_shared<Swarm>(*current);
 
-    // TODO: check our node's state
+        events = swarm->derive_swarm_events(bu.swarms);
 
-    const auto status = derive_snode_status(bu, our_address_);
+        const auto status = derive_snode_status(bu, events, our_address_);
 
-    if (this->status_ != status) {
-        OXEN_LOG(info, "Node status updated: {}", status);
-        this->status_ = status;
-    }
+        if (this->status_ != status) {
+            OXEN_LOG(info, "Node status updated: {}", status);
+            this->status_ = status;
+        }
 
-    swarm_->set_swarm_id(events.our_swarm_id);
+        swarm->set_swarm_id(events.our_swarm_id);
 
-    std::string reason;
-    if (!this->snode_ready(&reason)) {
+        ready = this->snode_ready(*swarm, &reason);
+        swarm->update_state(bu.swarms, bu.decommissioned_nodes, events, ready);
+        std::atomic_store(&swarm_,
+                          std::shared_ptr<const Swarm>(std::move(swarm)));
+    }
+    swarm_lock.unlock();
+
+    if (!ready) {
         OXEN_LOG(warn, "Storage server is still not ready: {}", reason);
-        swarm_->update_state(bu.swarms, bu.decommissioned_nodes, events, false);
         return;
     } else {
         static bool active = false;
@@ -704,8 +805,6 @@ void ServiceNode::on_swarm_update(block_update_t&& bu) {
         }
     }
 
-    swarm_->update_state(bu.swarms, bu.decommissioned_nodes, events, true);
-
     if (!events.new_snodes.empty()) {
         this->bootstrap_peers(events.new_snodes);
     }
@@ -726,21 +825,27 @@ void ServiceNode::on_swarm_update(block_update_t&& bu) {
 
 void ServiceNode::relay_buffered_messages() {
 
-    std::lock_guard guard(sn_mutex_);
-
     // Should we wait for the response first?
     relay_timer_.expires_after(RELAY_INTERVAL);
     relay_timer_.async_wait(
         boost::bind(&ServiceNode::relay_buffered_messages, this));
 
-    if (relay_buffer_.empty())
+    // Take the buffer so that clients can keep storing while we relay
+    std::vector<message_t> messages;
+    {
+        std::lock_guard guard(relay_mutex_);
+        messages.swap(relay_buffer_);
+    }
+
+    if (messages.empty())
         return;
 
+    const auto swarm = this->swarm();
+
     OXEN_LOG(debug, "Relaying {} messages from buffer to {} nodes",
-             relay_buffer_.size(), swarm_->other_nodes().size());
+             messages.size(), swarm->other_nodes().size());
 
-    this->relay_messages(relay_buffer_, swarm_->other_nodes());
-    relay_buffer_.clear();
+    this->relay_messages(messages, swarm->other_nodes());
 }
 
 void ServiceNode::check_version_timer_tick() {
@@ -763,11 +868,7 @@ void ServiceNode::pow_difficulty_timer_tick(const pow_dns_callback_t cb) {
         boost::bind(&ServiceNode::pow_difficulty_timer_tick, this, cb));
 }
 
-void ServiceNode::swarm_timer_tick() {
-
-    std::lock_guard guard(sn_mutex_);
-
-    OXEN_LOG(trace, "Swarm timer tick");
+static json make_swarm_update_params(const std::string& block_hash) {
 
     json params;
     json fields;
@@ -785,38 +886,37 @@ void ServiceNode::swarm_timer_tick() {
     fields["storage_lmq_port"] = true;
 
     params["fields"] = fields;
-    params["poll_block_hash"] = block_hash_;
+    params["poll_block_hash"] = block_hash;
 
     params["active_only"] = false;
 
-    static bool got_first_response = false;
+    return params;
+}
 
-    oxend_client_.make_oxend_request(
-        "get_n_service_nodes", params, [this](const sn_response_t&& res) {
-            if (res.error_code == SNodeError::NO_ERROR) {
-                try {
+void ServiceNode::swarm_timer_tick() {
 
-                    if (!got_first_response) {
-                        OXEN_LOG(
-                            info,
-                            "Got initial swarm information from local Oxend");
-                        got_first_response = true;
-#ifndef INTEGRATION_TEST
-                        // Only bootstrap (apply ips) once we have at least
-                        // some entries for snodes from oxend
-                        this->bootstrap_data();
-#endif
-                    }
+    OXEN_LOG(trace, "Swarm timer tick");
 
-                    block_update_t bu = parse_swarm_update(res.body);
-                    if (!bu.unchanged)
-                        on_swarm_update(std::move(bu));
-                } catch (const std::exception& e) {
-                    OXEN_LOG(error, "Exception caught on swarm update: {}",
-                             e.what());
-                }
-            } else {
-                OXEN_LOG(critical, "Failed to contact local Oxend");
+    std::string block_hash;
+    {
+        std::lock_guard guard(chain_mutex_);
+        block_hash = block_hash_;
+    }
+
+    oxend_client_.make_oxend_request(
+        "get_n_service_nodes", make_swarm_update_params(block_hash),
+        [this](const sn_response_t&& res) {
+            handle_swarm_update(res.error_code == SNodeError::NO_ERROR,
+                                res.body);
+
+            // Once subscribed over OxenMQ, oxend tells us about new blocks
+            // (see `on_oxend_block`) and there is nothing to poll for until
+            // the subscription is lost (see `on_oxend_lost`)
+            if (lmq_server_.oxend() && lmq_server_.oxend()->subscribed()) {
+                OXEN_LOG(info, "Getting new blocks from Oxend over OxenMQ, "
+                               "no longer polling it");
+                swarm_polling_ = false;
+                return;
             }
 
             // It would make more sense to wait the difference between the time
@@ -827,11 +927,92 @@ void ServiceNode::swarm_timer_tick() {
         });
 }
 
-void ServiceNode::cleanup_timer_tick() {
+void ServiceNode::on_oxend_block(std::string_view block_hash) {
+
+    boost::asio::post(ioc_, [this, hash = std::string(block_hash)]() {
+        if (!hash.empty()) {
+            std::lock_guard guard(chain_mutex_);
+            if (hash == block_hash_)
+                return;
+        }
+        this->fetch_swarm_update();
+    });
+}
 
-    std::lock_guard guard(sn_mutex_);
+void ServiceNode::on_oxend_lost() {
 
-    all_stats_.cleanup();
+    boost::asio::post(ioc_, [this]() {
+        if (swarm_polling_)
+            return;
+        OXEN_LOG(warn, "Lost the OxenMQ connection to Oxend, polling it "
+                       "until we get it back");
+        swarm_polling_ = true;
+        this->swarm_timer_tick();
+    });
+}
+
+void ServiceNode::fetch_swarm_update() {
+
+    // The pending request might still get the previous block
+    if (swarm_update_pending_) {
+        swarm_update_again_ = true;
+        return;
+    }
+    swarm_update_pending_ = true;
+
+    std::string block_hash;
+    {
+        std::lock_guard guard(chain_mutex_);
+        block_hash = block_hash_;
+    }
+
+    lmq_server_.oxend()->request(
+        "get_service_nodes", make_swarm_update_params(block_hash),
+        [this](bool success, std::string body) {
+            auto res = std::make_shared<std::string>(std::move(body));
+            boost::asio::post(ioc_, [this, success, res]() {
+                swarm_update_pending_ = false;
+                handle_swarm_update(success, res);
+                if (std::exchange(swarm_update_again_, false))
+                    fetch_swarm_update();
+            });
+        });
+}
+
+void ServiceNode::handle_swarm_update(
+    bool success, const std::shared_ptr<std::string>& body) {
+
+    if (!success) {
+        OXEN_LOG(critical, "Failed to contact local Oxend");
+        return;
+    }
+
+    try {
+
+        if (!got_first_swarm_update_) {
+            OXEN_LOG(info, "Got initial swarm information from local Oxend");
+            got_first_swarm_update_ = true;
+#ifndef INTEGRATION_TEST
+            // Only bootstrap (apply ips) once we have at least
+            // some entries for snodes from oxend
+            this->bootstrap_data();
+#endif
+        }
+
+        block_update_t bu = parse_swarm_update(body);
+        if (!bu.unchanged)
+            on_swarm_update(std::move(bu));
+    } catch (const std::exception& e) {
+        OXEN_LOG(error, "Exception caught on swarm update: {}", e.what());
+    }
+}
+
+void ServiceNode::cleanup_timer_tick() {
+
+    {
+        std::lock_guard guard(stats_mutex_);
+        all_stats_.cleanup();
+    }
 
     stats_cleanup_timer_.expires_after(STATS_CLEANUP_INTERVAL);
     stats_cleanup_timer_.async_wait(
@@ -840,6 +1021,8 @@ void ServiceNode::cleanup_timer_tick() {
 
 void ServiceNode::update_last_ping(ReachType type) {
 
+    std::lock_guard guard(reach_mutex_);
+
     switch (type) {
     case ReachType::HTTP: {
         reach_records_.latest_incoming_http_ = std::chrono::steady_clock::now();
@@ -858,9 +1041,6 @@ void ServiceNode::update_last_ping(ReachType type) {
 
 void ServiceNode::ping_peers_tick() {
 
-    // Used as a callback to needs a mutex even if it is private
-    std::lock_guard guard(sn_mutex_);
-
     this->peer_ping_timer_.expires_after(PING_PEERS_INTERVAL);
     this->peer_ping_timer_.async_wait(
         std::bind(&ServiceNode::ping_peers_tick, this));
@@ -873,8 +1053,17 @@ void ServiceNode::ping_peers_tick() {
         return;
     }
 
+    time_point_t reset_time;
+    {
+        std::lock_guard guard(stats_mutex_);
+        reset_time = all_stats_.get_reset_time();
+    }
+
     // Check if we've been tested (reached) recently ourselves
-    reach_records_.check_incoming_tests(all_stats_.get_reset_time());
+    {
+        std::lock_guard guard(reach_mutex_);
+        reach_records_.check_incoming_tests(reset_time);
+    }
 
     if (this->status_ == SnodeStatus::DECOMMISSIONED) {
         OXEN_LOG(debug, "Skipping this round of peer testing (decommissioned)");
@@ -884,7 +1073,8 @@ void ServiceNode::ping_peers_tick() {
     /// We always test one node already known to be offline
     /// plus one random other node (could even be the same node)
 
-    const auto random_node = swarm_->choose_funded_node();
+    const auto swarm = this->swarm();
+    const auto random_node = swarm->choose_funded_node();
 
     if (random_node) {
 
@@ -903,11 +1093,15 @@ void ServiceNode::ping_peers_tick() {
     // nodes, but then restarted, so SS won't give priority to those
     // nodes. SS will still test them eventually (through random selection) and
     // update Oxend, but this scenario could be made more robust.
-    const auto offline_node = reach_records_.next_to_test();
+    std::optional<sn_pub_key_t> offline_node;
+    {
+        std::lock_guard guard(reach_mutex_);
+        offline_node = reach_records_.next_to_test();
+    }
 
     if (offline_node) {
         const std::optional<sn_record_t> sn =
-            swarm_->get_node_by_pk(*offline_node);
+            swarm->get_node_by_pk(*offline_node);
         OXEN_LOG(debug, "No offline nodes to test for reachability yet");
         if (sn) {
             test_reachability(*sn);
@@ -915,6 +1109,7 @@ void ServiceNode::ping_peers_tick() {
             OXEN_LOG(debug, "Node does not seem to exist anymore: {}",
                      *offline_node);
             // delete its entry from test records as irrelevant
+            std::lock_guard guard(reach_mutex_);
             reach_records_.expire(*offline_node);
         }
     }
@@ -922,8 +1117,6 @@ void ServiceNode::ping_peers_tick() {
 
 void ServiceNode::sign_request(std::shared_ptr<request_t>& req) const {
 
-    std::lock_guard guard(sn_mutex_);
-
     // TODO: investigate why we are not signing headers
     const auto hash = hash_data(req->body());
     const auto signature = generate_signature(hash, oxend_key_pair_);
@@ -932,8 +1125,6 @@ void ServiceNode::sign_request(std::shared_ptr<request_t>& req) const {
 
 void ServiceNode::test_reachability(const sn_record_t& sn) {
 
-    std::lock_guard guard(sn_mutex_);
-
     OXEN_LOG(debug, "Testing node for reachability over HTTP: {}", sn);
 
     auto callback = [this, sn](sn_response_t&& res) {
@@ -968,8 +1159,6 @@ void ServiceNode::test_reachability(const sn_record_t& sn) {
 
 void ServiceNode::oxend_ping_timer_tick() {
 
-    std::lock_guard guard(sn_mutex_);
-
     /// TODO: Note that this is not actually an SN response! (but Oxend)
     auto cb = [](const sn_response_t&& res) {
         if (res.error_code == SNodeError::NO_ERROR) {
@@ -1031,8 +1220,6 @@ void ServiceNode::perform_blockchain_test(
     bc_test_params_t test_params,
     std::function<void(blockchain_test_answer_t)>&& cb) const {
 
-    std::lock_guard guard(sn_mutex_);
-
     OXEN_LOG(debug, "Delegating blockchain test to Oxend");
 
     nlohmann::json params;
@@ -1094,11 +1281,10 @@ void ServiceNode::process_storage_test_response(const sn_record_t& testee,
                                                 uint64_t test_height,
                                                 sn_response_t&& res) {
 
-    std::lock_guard guard(sn_mutex_);
-
     if (res.error_code != SNodeError::NO_ERROR) {
         // TODO: retry here, otherwise tests sometimes fail (when SN not
         // running yet)
+        std::lock_guard guard(stats_mutex_);
         this->all_stats_.record_storage_test_result(testee, ResultType::OTHER);
         OXEN_LOG(debug, "Failed to send a storage test request to snode: {}",
                  testee);
@@ -1108,6 +1294,7 @@ void ServiceNode::process_storage_test_response(const sn_record_t& testee,
     // If we got here, the response is 200 OK, but we still need to check
     // status in response body and check the answer
     if (!res.body) {
+        std::lock_guard guard(stats_mutex_);
         this->all_stats_.record_storage_test_result(testee, ResultType::OTHER);
         OXEN_LOG(debug, "Empty body in storage test response");
         return;
@@ -1151,6 +1338,7 @@ void ServiceNode::process_storage_test_response(const sn_record_t& testee,
         OXEN_LOG(debug, "Invalid json in storage test response");
     }
 
+    std::lock_guard guard(stats_mutex_);
     this->all_stats_.record_storage_test_result(testee, result);
 }
 
@@ -1158,9 +1346,6 @@ void ServiceNode::send_storage_test_req(const sn_record_t& testee,
                                         uint64_t test_height,
                                         const Item& item) {
 
-    // Used as a callback to needs a mutex even if it is private
-    std::lock_guard guard(sn_mutex_);
-
     nlohmann::json json_body;
 
     json_body["height"] = test_height;
@@ -1171,7 +1356,7 @@ void ServiceNode::send_storage_test_req(const sn_record_t& testee,
     this->sign_request(req);
 
     make_sn_request(ioc_, testee, req,
-                    [testee, item, height = this->block_height_,
+                    [testee, item, height = this->block_height(),
                      this](sn_response_t&& res) {
                         this->process_storage_test_response(
                             testee, item, height, std::move(res));
@@ -1183,9 +1368,6 @@ void ServiceNode::send_blockchain_test_req(const sn_record_t& testee,
                                            uint64_t test_height,
                                            blockchain_test_answer_t answer) {
 
-    // Used as a callback to needs a mutex even if it is private
-    std::lock_guard guard(sn_mutex_);
-
     nlohmann::json json_body;
 
     json_body["max_height"] = params.max_height;
@@ -1199,15 +1381,13 @@ void ServiceNode::send_blockchain_test_req(const sn_record_t& testee,
     make_sn_request(ioc_, testee, req,
                     std::bind(&ServiceNode::process_blockchain_test_response,
                               this, std::placeholders::_1, answer, testee,
-                              this->block_height_));
+                              this->block_height()));
 }
 
 void ServiceNode::report_node_reachability(const sn_pub_key_t& sn_pk,
                                            bool reachable) {
 
-    std::lock_guard guard(sn_mutex_);
-
-    const auto sn = swarm_->get_node_by_pk(sn_pk);
+    const auto sn = swarm()->get_node_by_pk(sn_pk);
 
     if (!sn) {
         OXEN_LOG(debug, "No Service node with pubkey: {}", sn_pk);
@@ -1223,8 +1403,6 @@ void ServiceNode::report_node_reachability(const sn_pub_key_t& sn_pk,
     /// updated to "true".
 
     auto cb = [this, sn_pk, reachable](const sn_response_t&& res) {
-        std::lock_guard guard(this->sn_mutex_);
-
         if (res.error_code != SNodeError::NO_ERROR) {
             OXEN_LOG(warn, "Could not report node status");
             return;
@@ -1254,6 +1432,7 @@ void ServiceNode::report_node_reachability(const sn_pub_key_t& sn_pk,
         }
 
         if (success) {
+            std::lock_guard guard(this->reach_mutex_);
             if (reachable) {
                 OXEN_LOG(debug, "Successfully reported node as reachable: {}",
                          sn_pk);
@@ -1273,30 +1452,32 @@ void ServiceNode::report_node_reachability(const sn_pub_key_t& sn_pk,
 void ServiceNode::process_reach_test_result(const sn_pub_key_t& pk,
                                             ReachType type, bool success) {
 
-    std::lock_guard guard(sn_mutex_);
-
+    bool report;
     if (success) {
 
+        std::lock_guard guard(reach_mutex_);
         reach_records_.record_reachable(pk, type, true);
 
         // NOTE: We don't need to report healthy nodes that previously has been
         // not been reported to Oxend as unreachable but I'm worried there might
         // be some race conditions, so do it anyway for now.
 
-        if (reach_records_.should_report_as(pk, ReportType::GOOD)) {
-            this->report_node_reachability(pk, true);
-        }
+        report = reach_records_.should_report_as(pk, ReportType::GOOD);
 
     } else {
 
         OXEN_LOG(trace, "Recording node as unreachable");
 
+        std::lock_guard guard(reach_mutex_);
         reach_records_.record_reachable(pk, type, false);
 
-        if (reach_records_.should_report_as(pk, ReportType::BAD)) {
-            // instead of this, we should set http to `unreachable`
-            this->report_node_reachability(pk, false);
-        }
+        // instead of this, we should set http to `unreachable`
+        report = reach_records_.should_report_as(pk, ReportType::BAD);
+    }
+
+    // Reported without `reach_mutex_`, which the reply handler takes
+    if (report) {
+        this->report_node_reachability(pk, success);
     }
 }
 
@@ -1304,8 +1485,6 @@ void ServiceNode::process_blockchain_test_response(
     sn_response_t&& res, blockchain_test_answer_t our_answer,
     sn_record_t testee, uint64_t bc_height) {
 
-    std::lock_guard guard(sn_mutex_);
-
     OXEN_LOG(debug,
              "Processing blockchain test response from: {} at height: {}",
              testee, bc_height);
@@ -1336,6 +1515,7 @@ void ServiceNode::process_blockchain_test_response(
                  testee);
     }
 
+    std::lock_guard guard(stats_mutex_);
     this->all_stats_.record_blockchain_test_result(testee, result);
 }
 
@@ -1343,9 +1523,7 @@ void ServiceNode::process_blockchain_test_response(
 bool ServiceNode::derive_tester_testee(uint64_t blk_height, sn_record_t& tester,
                                        sn_record_t& testee) {
 
-    std::lock_guard guard(sn_mutex_);
-
-    std::vector<sn_record_t> members = swarm_->other_nodes();
+    std::vector<sn_record_t> members = swarm()->other_nodes();
     members.push_back(our_address_);
 
     if (members.size() < 2) {
@@ -1355,6 +1533,8 @@ bool ServiceNode::derive_tester_testee(uint64_t blk_height, sn_record_t& tester,
 
     std::sort(members.begin(), members.end());
 
+    std::unique_lock chain_lock(chain_mutex_);
+
     std::string block_hash;
     if (blk_height == block_height_) {
         block_hash = block_hash_;
@@ -1382,6 +1562,8 @@ bool ServiceNode::derive_tester_testee(uint64_t blk_height, sn_record_t& tester,
         return false;
     }
 
+    chain_lock.unlock();
+
     uint64_t seed;
     if (block_hash.size() < sizeof(seed)) {
         OXEN_LOG(error, "Could not initiate peer test: invalid block hash");
@@ -1408,14 +1590,11 @@ MessageTestStatus ServiceNode::process_storage_test_req(
     uint64_t blk_height, const std::string& tester_pk,
     const std::string& msg_hash, std::string& answer) {
 
-    std::lock_guard guard(sn_mutex_);
-
     // 1. Check height, retry if we are behind
-    std::string block_hash;
-
-    if (blk_height > block_height_) {
+    const uint64_t block_height = this->block_height();
+    if (blk_height > block_height) {
         OXEN_LOG(debug, "Our blockchain is behind, height: {}, requested: {}",
-                 block_height_, blk_height);
+                 block_height, blk_height);
         return MessageTestStatus::RETRY;
     }
 
@@ -1467,10 +1646,8 @@ bool ServiceNode::select_random_message(Item& item) {
 
     // SNodes don't have to agree on this, rather they should use different
     // messages
-    const auto msg_idx = util::uniform_distribution_portable(message_count);
-
-    if (!db_->retrieve_by_index(msg_idx, item)) {
-        OXEN_LOG(error, "Could not retrieve message by index: {}", msg_idx);
+    if (!db_->retrieve_random(item)) {
+        OXEN_LOG(debug, "Could not select a random message");
         return false;
     }
 
@@ -1479,8 +1656,6 @@ bool ServiceNode::select_random_message(Item& item) {
 
 void ServiceNode::initiate_peer_test() {
 
-    std::lock_guard guard(sn_mutex_);
-
     // 1. Select the tester/testee pair
     sn_record_t tester, testee;
 
@@ -1490,13 +1665,14 @@ void ServiceNode::initiate_peer_test() {
     /// might be still different and thus derive different pairs)
     constexpr uint64_t TEST_BLOCKS_BUFFER = 4;
 
-    if (block_height_ < TEST_BLOCKS_BUFFER) {
+    const uint64_t block_height = this->block_height();
+    if (block_height < TEST_BLOCKS_BUFFER) {
         OXEN_LOG(debug, "Height {} is too small, skipping all tests",
-                 block_height_);
+                 block_height);
         return;
     }
 
-    const uint64_t test_height = block_height_ - TEST_BLOCKS_BUFFER;
+    const uint64_t test_height = block_height - TEST_BLOCKS_BUFFER;
 
     if (!this->derive_tester_testee(test_height, tester, testee)) {
         return;
@@ -1538,14 +1714,14 @@ void ServiceNode::initiate_peer_test() {
         // change if we go this many blocks back
         constexpr uint64_t SAFETY_BUFFER_BLOCKS = CHECKPOINT_DISTANCE * 3;
 
-        if (block_height_ <= SAFETY_BUFFER_BLOCKS) {
+        if (block_height <= SAFETY_BUFFER_BLOCKS) {
             OXEN_LOG(debug,
                      "Blockchain too short, skipping blockchain testing.");
             return;
         }
 
         bc_test_params_t params;
-        params.max_height = block_height_ - SAFETY_BUFFER_BLOCKS;
+        params.max_height = block_height - SAFETY_BUFFER_BLOCKS;
         params.seed = util::rng()();
 
         auto callback =
@@ -1559,10 +1735,16 @@ void ServiceNode::initiate_peer_test() {
 
 void ServiceNode::bootstrap_peers(const std::vector<sn_record_t>& peers) const {
 
-    std::vector<Item> all_entries;
-    this->get_all_messages(all_entries);
+    // Relay a chunk at a time so that we never hold the whole database in
+    // memory
+    const bool success = db_->for_each_chunk([&](std::vector<Item>& chunk) {
+        this->relay_messages(chunk, peers);
+        return true;
+    });
 
-    this->relay_messages(all_entries, peers);
+    if (!success) {
+        OXEN_LOG(error, "Could not retrieve entries from the database");
+    }
 }
 
 template <typename T>
@@ -1588,99 +1770,107 @@ std::string vec_to_string(const std::vector<T>& vec) {
 void ServiceNode::bootstrap_swarms(
     const std::vector<swarm_id_t>& swarms) const {
 
-    std::lock_guard guard(sn_mutex_);
-
     if (swarms.empty()) {
         OXEN_LOG(info, "Bootstrapping all swarms");
     } else {
         OXEN_LOG(info, "Bootstrapping swarms: {}", vec_to_string(swarms));
     }
 
-    const auto& all_swarms = swarm_->all_valid_swarms();
-
-    std::vector<Item> all_entries;
-    if (!get_all_messages(all_entries)) {
-        OXEN_LOG(error, "Could not retrieve entries from the database");
-        return;
-    }
-
-    std::unordered_map<swarm_id_t, size_t> swarm_id_to_idx;
-    for (auto i = 0u; i < all_swarms.size(); ++i) {
-        swarm_id_to_idx.insert({all_swarms[i].swarm_id, i});
-    }
+    const auto swarm = this->swarm();
 
     /// See what pubkeys we have
     std::unordered_map<std::string, swarm_id_t> cache;
 
-    OXEN_LOG(debug, "We have {} messages", all_entries.size());
+    size_t total_entries = 0;
 
-    std::unordered_map<swarm_id_t, std::vector<Item>> to_relay;
+    /// Messages are loaded and relayed a chunk at a time so that memory use
+    /// doesn't grow with the size of the database
+    auto relay_chunk = [&](std::vector<Item>& chunk) {
+        total_entries += chunk.size();
 
-    for (auto& entry : all_entries) {
+        std::unordered_map<swarm_id_t, std::vector<Item>> to_relay;
 
-        swarm_id_t swarm_id;
-        const auto it = cache.find(entry.pub_key);
-        if (it == cache.end()) {
+        for (auto& entry : chunk) {
 
-            bool success;
-            auto pk = user_pubkey_t::create(entry.pub_key, success);
+            swarm_id_t swarm_id;
+            const auto it = cache.find(entry.pub_key);
+            if (it == cache.end()) {
 
-            if (!success) {
-                OXEN_LOG(error, "Invalid pubkey in a message while "
-                                "bootstrapping other nodes");
-                continue;
+                bool success;
+                auto pk = user_pubkey_t::create(entry.pub_key, success);
+
+                if (!success) {
+                    OXEN_LOG(error, "Invalid pubkey in a message while "
+                                    "bootstrapping other nodes");
+                    continue;
+                }
+
+                swarm_id = swarm->get_swarm_by_pk(pk);
+                cache.insert({entry.pub_key, swarm_id});
+            } else {
+                swarm_id = it->second;
             }
 
-            swarm_id = get_swarm_by_pk(all_swarms, pk);
-            cache.insert({entry.pub_key, swarm_id});
-        } else {
-            swarm_id = it->second;
-        }
+            bool relevant = false;
+            for (const auto sid : swarms) {
 
-        bool relevant = false;
-        for (const auto swarm : swarms) {
+                if (sid == swarm_id) {
+                    relevant = true;
+                }
+            }
 
-            if (swarm == swarm_id) {
-                relevant = true;
+            if (relevant || swarms.empty()) {
+
+                to_relay[swarm_id].emplace_back(std::move(entry));
             }
         }
 
-        if (relevant || swarms.empty()) {
+        OXEN_LOG(trace, "Bootstrapping {} swarms", to_relay.size());
 
-            to_relay[swarm_id].emplace_back(std::move(entry));
-        }
-    }
+        for (const auto& kv : to_relay) {
+            const auto* snodes = swarm->get_swarm_members(kv.first);
+            if (!snodes) {
+                OXEN_LOG(error, "No members found for swarm {}", kv.first);
+                continue;
+            }
 
-    OXEN_LOG(trace, "Bootstrapping {} swarms", to_relay.size());
+            relay_messages(kv.second, *snodes);
+        }
 
-    for (const auto& kv : to_relay) {
-        const uint64_t swarm_id = kv.first;
-        /// what if not found?
-        const size_t idx = swarm_id_to_idx[swarm_id];
+        return true;
+    };
 
-        relay_messages(kv.second, all_swarms[idx].snodes);
+    if (!db_->for_each_chunk(relay_chunk)) {
+        OXEN_LOG(error, "Could not retrieve entries from the database");
+        return;
     }
+
+    OXEN_LOG(debug, "We have {} messages", total_entries);
 }
 
 template <typename Message>
 void ServiceNode::relay_messages(const std::vector<Message>& messages,
                                  const std::vector<sn_record_t>& snodes) const {
-    std::vector<std::string> batches = serialize_messages(messages);
-
-    OXEN_LOG(debug, "Relayed messages:");
-    for (auto msg : batches) {
-        OXEN_LOG(debug, "    {}", msg);
+    // Payloads are sent as raw bytes once every peer understands it
+    const bool binary_payloads = hardfork_ >= BINARY_PUSH_HARDFORK;
+    // Serialized once for the requests to every peer
+    const std::vector<std::string> batches =
+        serialize_messages(messages, binary_payloads);
+
+    // Batches can be binary, so only log their sizes
+    OXEN_LOG(debug, "Relaying {} messages in {} batches:", messages.size(),
+             batches.size());
+    for (const auto& batch : batches) {
+        OXEN_LOG(debug, "    {} bytes", batch.size());
     }
     OXEN_LOG(debug, "To Snodes:");
-    for (auto sn : snodes) {
+    for (const auto& sn : snodes) {
         OXEN_LOG(debug, "    {}", sn);
     }
 
-    OXEN_LOG(debug, "Serialised batches: {}", batches.size());
     for (const sn_record_t& sn : snodes) {
-        for (auto& batch : batches) {
-            // TODO: I could probably avoid copying here
-            this->relay_data_reliable(batch, sn);
+        for (const auto& batch : batches) {
+            this->relay_data_reliable(batch, sn, binary_payloads);
         }
     }
 }
@@ -1695,9 +1885,14 @@ bool ServiceNode::retrieve(const std::string& pubKey,
                            const std::string& last_hash,
                            std::vector<Item>& items) {
 
-    std::lock_guard guard(sn_mutex_);
+    {
+        std::lock_guard guard(stats_mutex_);
+        all_stats_.bump_retrieve_requests();
+    }
 
-    all_stats_.bump_retrieve_requests();
+    // Most polls come from clients that already have every message
+    if (!last_hash.empty() && db_->is_latest_message(pubKey, last_hash))
+        return true;
 
     return db_->retrieve(pubKey, items, last_hash,
                          CLIENT_RETRIEVE_MESSAGE_LIMIT);
@@ -1706,7 +1901,7 @@ bool ServiceNode::retrieve(const std::string& pubKey,
 void ServiceNode::set_difficulty_history(
     const std::vector<pow_difficulty_t>& new_history) {
 
-    std::lock_guard guard(sn_mutex_);
+    std::lock_guard guard(pow_mutex_);
 
     pow_history_ = new_history;
     for (const auto& difficulty : pow_history_) {
@@ -1770,19 +1965,31 @@ std::string ServiceNode::get_stats_for_session_client() const {
 
 std::string ServiceNode::get_stats() const {
 
-    std::lock_guard guard(sn_mutex_);
-
-    auto val = to_json(all_stats_);
+    nlohmann::json val;
+    {
+        std::lock_guard guard(stats_mutex_);
+        val = to_json(all_stats_);
+    }
 
     val["version"] = STORAGE_SERVER_VERSION_STRING;
-    val["height"] = block_height_;
-    val["target_height"] = target_height_;
+    {
+        std::lock_guard guard(chain_mutex_);
+        val["height"] = block_height_;
+        val["target_height"] = target_height_;
+    }
 
     uint64_t total_stored;
     if (db_->get_message_count(total_stored)) {
         val["total_stored"] = total_stored;
     }
 
+    StorageEngine::MessageCacheStats cache_stats;
+    if (db_->get_message_cache_stats(cache_stats)) {
+        val["message_cache_hits"] = cache_stats.hits;
+        val["message_cache_misses"] = cache_stats.misses;
+        val["message_cache_bytes"] = cache_stats.bytes;
+    }
+
     val["connections_in"] = get_net_stats().connections_in.load();
     val["http_connections_out"] = get_net_stats().http_connections_out.load();
     val["https_connections_out"] = get_net_stats().https_connections_out.load();
@@ -1799,7 +2006,7 @@ std::string ServiceNode::get_status_line() const {
     // status message has to be fairly short: has to fit on one line, and if
     // it's too long systemd just truncates it when displaying it.
 
-    std::lock_guard guard(sn_mutex_);
+    const auto swarm = this->swarm();
 
     std::ostringstream s;
     s << 'v' << STORAGE_SERVER_VERSION_STRING;
@@ -1809,21 +2016,24 @@ std::string ServiceNode::get_status_line() const {
     if (syncing_)
         s << "; SYNCING";
     s << "; sw=";
-    if (!swarm_ || !swarm_->is_valid())
+    if (!swarm->is_valid())
         s << "NONE";
     else {
-        std::string swarm = std::to_string(swarm_->our_swarm_id());
-        if (swarm.size() <= 6)
-            s << swarm;
+        std::string swarm_id = std::to_string(swarm->our_swarm_id());
+        if (swarm_id.size() <= 6)
+            s << swarm_id;
         else
-            s << swarm.substr(0, 4) << u8"…" << swarm.back();
-        s << "(n=" << (1 + swarm_->other_nodes().size()) << ")";
+            s << swarm_id.substr(0, 4) << u8"…" << swarm_id.back();
+        s << "(n=" << (1 + swarm->other_nodes().size()) << ")";
     }
     uint64_t total_stored;
     if (db_->get_message_count(total_stored))
         s << "; " << total_stored << " msgs";
-    s << "; reqs(S/R): " << all_stats_.get_total_store_requests() << '/'
-      << all_stats_.get_total_retrieve_requests();
+    {
+        std::lock_guard guard(stats_mutex_);
+        s << "; reqs(S/R): " << all_stats_.get_total_store_requests() << '/'
+          << all_stats_.get_total_retrieve_requests();
+    }
     s << "; conns(in/http/https): " << get_net_stats().connections_in << '/'
       << get_net_stats().http_connections_out << '/'
       << get_net_stats().https_connections_out;
@@ -1832,45 +2042,99 @@ std::string ServiceNode::get_status_line() const {
 
 int ServiceNode::get_curr_pow_difficulty() const {
 
-    std::lock_guard guard(sn_mutex_);
+    std::lock_guard guard(pow_mutex_);
 
     return curr_pow_difficulty_.difficulty;
 }
 
 bool ServiceNode::get_all_messages(std::vector<Item>& all_entries) const {
 
-    std::lock_guard guard(sn_mutex_);
-
     OXEN_LOG(trace, "Get all messages");
 
     return db_->retrieve("", all_entries, "");
 }
 
-void ServiceNode::process_push_batch(const std::string& blob) {
+#ifndef DISABLE_POW
+void ServiceNode::verify_batch(std::vector<message_t>& messages) {
+
+    std::vector<pow_difficulty_t> history;
+    {
+        std::lock_guard guard(pow_mutex_);
+        history = pow_history_;
+    }
+
+    // Each chunk writes to its own range of `valid` (which is why it isn't a
+    // vector<bool>)
+    std::vector<char> valid(messages.size());
+    const size_t num_chunks = std::clamp<size_t>(
+        messages.size() / VERIFY_CHUNK_MIN_SIZE, 1, verify_threads_);
+    const size_t chunk_size = (messages.size() + num_chunks - 1) / num_chunks;
+
+    std::vector<std::future<void>> chunks;
+    chunks.reserve(num_chunks);
+    for (size_t begin = 0; begin < messages.size(); begin += chunk_size) {
+        const size_t end = std::min(begin + chunk_size, messages.size());
+        std::packaged_task<void()> task([&messages, &history, &valid, begin,
+                                         end] {
+            verify_messages(messages.data() + begin, end - begin, history,
+                            valid.data() + begin);
+        });
+        chunks.push_back(task.get_future());
+        boost::asio::post(verify_pool_, std::move(task));
+    }
+    for (auto& chunk : chunks)
+        chunk.get();
+
+    size_t kept = 0;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        if (!valid[i])
+            continue;
+        if (kept != i)
+            messages[kept] = std::move(messages[i]);
+        ++kept;
+    }
+    if (kept != messages.size()) {
+        OXEN_LOG(warn,
+                 "{} of the batch messages were removed due to incorrect PoW",
+                 messages.size() - kept);
+        messages.erase(messages.begin() + kept, messages.end());
+    }
+}
+#endif
 
-    std::lock_guard guard(sn_mutex_);
+void ServiceNode::process_push_batch(const std::string& blob,
+                                     bool binary_payloads) {
 
+    // Verification runs without any locks, so that a large batch doesn't
+    // hold up other requests
     if (blob.empty())
         return;
 
-    std::vector<message_t> messages = deserialize_messages(blob);
+    std::vector<message_t> messages =
+        deserialize_messages(blob, binary_payloads);
 
     OXEN_LOG(trace, "Saving all: begin");
 
     OXEN_LOG(debug, "Got {} messages from peers, size: {}", messages.size(),
              blob.size());
 
-#ifndef DISABLE_POW
-    const auto it = std::remove_if(
+    // While bootstrapping, most messages pushed to us are already stored:
+    // drop those before checking their PoW
+    const auto known = std::remove_if(
         messages.begin(), messages.end(), [this](const message_t& message) {
-            return verify_message(message, pow_history_) == false;
+            return db_->contains(message.hash,
+                                 message.timestamp + message.ttl);
         });
-    messages.erase(it, messages.end());
-    if (it != messages.end()) {
-        OXEN_LOG(
-            warn,
-            "Some of the batch messages were removed due to incorrect PoW");
+    if (known != messages.end()) {
+        OXEN_LOG(debug, "Skipping {} messages that are already stored",
+                 std::distance(known, messages.end()));
+        messages.erase(known, messages.end());
+        if (messages.empty())
+            return;
     }
+
+#ifndef DISABLE_POW
+    verify_batch(messages);
 #endif
 
     std::vector<Item> items;
@@ -1891,36 +2155,17 @@ void ServiceNode::process_push_batch(const std::string& blob) {
 }
 
 bool ServiceNode::is_pubkey_for_us(const user_pubkey_t& pk) const {
-
-    std::lock_guard guard(sn_mutex_);
-
-    if (!swarm_) {
-        OXEN_LOG(error, "Swarm data missing");
-        return false;
-    }
-    return swarm_->is_pubkey_for_us(pk);
+    return swarm()->is_pubkey_for_us(pk);
 }
 
 std::vector<sn_record_t>
-ServiceNode::get_snodes_by_pk(const user_pubkey_t& pk) {
-
-    std::lock_guard guard(sn_mutex_);
-
-    if (!swarm_) {
-        OXEN_LOG(error, "Swarm data missing");
-        return {};
-    }
-
-    const auto& all_swarms = swarm_->all_valid_swarms();
+ServiceNode::get_snodes_by_pk(const user_pubkey_t& pk) const {
 
-    swarm_id_t swarm_id = get_swarm_by_pk(all_swarms, pk);
+    const auto swarm = this->swarm();
 
-    // TODO: have get_swarm_by_pk return idx into all_swarms instead,
-    // so we don't have to find it again
-
-    for (const auto& si : all_swarms) {
-        if (si.swarm_id == swarm_id)
-            return si.snodes;
+    if (const auto* snodes =
+            swarm->get_swarm_members(swarm->get_swarm_by_pk(pk))) {
+        return *snodes;
     }
 
     OXEN_LOG(critical, "Something went wrong in get_snodes_by_pk");
@@ -1928,41 +2173,18 @@ ServiceNode::get_snodes_by_pk(const user_pubkey_t& pk) {
     return {};
 }
 
-bool ServiceNode::is_snode_address_known(const std::string& sn_address) {
-
-    std::lock_guard guard(sn_mutex_);
-
-    // TODO: need more robust handling of uninitialized swarm_
-    if (!swarm_) {
-        OXEN_LOG(error, "Swarm data missing");
-        return false;
-    }
-
-    return swarm_->is_fully_funded_node(sn_address);
+bool ServiceNode::is_snode_address_known(const std::string& sn_address) const {
+    return swarm()->is_fully_funded_node(sn_address);
 }
 
 std::optional<sn_record_t>
 ServiceNode::find_node_by_x25519_bin(const sn_pub_key_t& pk) const {
-
-    std::lock_guard guard(sn_mutex_);
-
-    if (swarm_) {
-        return swarm_->find_node_by_x25519_bin(pk);
-    }
-
-    return std::nullopt;
+    return swarm()->find_node_by_x25519_bin(pk);
 }
 
 std::optional<sn_record_t>
 ServiceNode::find_node_by_ed25519_pk(const std::string& pk) const {
-
-    std::lock_guard guard(sn_mutex_);
-
-    if (swarm_) {
-        return swarm_->find_node_by_ed25519_pk(pk);
-    }
-
-    return std::nullopt;
+    return swarm()->find_node_by_ed25519_pk(pk);
 }
 
 } // namespace oxen
@@ -1,10 +1,13 @@
 #pragma once
 
 #include <Database.hpp>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <thread>
 #include <unordered_map>
@@ -24,8 +27,9 @@ static constexpr size_t BLOCK_HASH_CACHE_SIZE = 30;
 static constexpr int STORAGE_SERVER_HARDFORK = 12;
 static constexpr int ENFORCED_REACHABILITY_HARDFORK = 13;
 static constexpr int OXENMQ_ONION_HARDFORK = 15;
-
-class Database;
+// From this hardfork on, every node handles push batches with binary payloads
+// (`sn.data_v2`)
+static constexpr int BINARY_PUSH_HARDFORK = 17;
 
 namespace http = boost::beast::http;
 using request_t = http::request<http::string_body>;
@@ -110,29 +114,54 @@ class ServiceNode {
     boost::asio::io_context& ioc_;
     boost::asio::io_context& worker_ioc_;
     std::thread worker_thread_;
+    // Verifies the PoW of pushed messages, one thread per core
+    const size_t verify_threads_ =
+        std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    boost::asio::thread_pool verify_pool_{verify_threads_};
 
     // We set the default difficulty to some low value, so that we don't reject
     // clients unnecessarily before we get the DNS record
     pow_difficulty_t curr_pow_difficulty_{std::chrono::milliseconds(0), 1};
     std::vector<pow_difficulty_t> pow_history_{curr_pow_difficulty_};
+    // Guards `curr_pow_difficulty_` and `pow_history_`
+    mutable std::mutex pow_mutex_;
 
     bool force_start_ = false;
-    bool syncing_ = true;
-    int hardfork_ = 0;
+    std::atomic<bool> syncing_{true};
+    std::atomic<int> hardfork_{0};
     uint64_t block_height_ = 0;
     uint64_t target_height_ = 0;
     const OxendClient& oxend_client_;
     std::string block_hash_;
-    std::unique_ptr<Swarm> swarm_;
-    std::unique_ptr<Database> db_;
-
-    SnodeStatus status_ = SnodeStatus::UNKNOWN;
+    // Only used on `ioc_`
+    bool got_first_swarm_update_ = false;
+    // A swarm update is being fetched from oxend over OxenMQ, and whether
+    // another block came in meanwhile (only used on `ioc_`)
+    bool swarm_update_pending_ = false;
+    bool swarm_update_again_ = false;
+    // `swarm_timer_tick` is polling oxend over HTTP, which it does until we
+    // are subscribed to its new blocks over OxenMQ (only used on `ioc_`)
+    bool swarm_polling_ = true;
+
+    /// Swarm composition as of the latest block. Never modified once
+    /// published: updates build a new one and swap it in atomically, so
+    /// readers only need `swarm()` and no lock.
+    std::shared_ptr<const Swarm> swarm_;
+    // Serializes the writers of `swarm_`
+    std::mutex swarm_update_mutex_;
+
+    std::unique_ptr<StorageEngine> db_;
+
+    std::atomic<SnodeStatus> status_{SnodeStatus::UNKNOWN};
 
     sn_record_t our_address_;
 
     /// Cache for block_height/block_hash mapping
     boost::circular_buffer<std::pair<uint64_t, std::string>>
         block_hashes_cache_{BLOCK_HASH_CACHE_SIZE};
+    // Guards `block_height_`, `target_height_`, `block_hash_` and
+    // `block_hashes_cache_`
+    mutable std::mutex chain_mutex_;
 
     boost::asio::steady_timer pow_update_timer_;
 
@@ -153,55 +182,78 @@ class ServiceNode {
 
     // Need to make sure we only use this to get lmq() object and
     // not call any method that would in turn call a method in SN
-    // causing a deadlock
+    // while holding one of our locks, causing a deadlock
     OxenmqServer& lmq_server_;
 
     reachability_records_t reach_records_;
+    std::mutex reach_mutex_;
 
     /// Container for recently received messages directly from
     /// clients;
     std::vector<message_t> relay_buffer_;
+    std::mutex relay_mutex_;
 
     mutable all_stats_t all_stats_;
+    mutable std::mutex stats_mutex_;
+
+    /// The current swarm snapshot, which stays valid (if outdated) for as
+    /// long as the caller holds on to it
+    std::shared_ptr<const Swarm> swarm() const;
 
-    mutable std::recursive_mutex sn_mutex_;
+    /// `snode_ready` for a swarm that is not yet published
+    bool snode_ready(const Swarm& swarm, std::string* reason) const;
 
-    void save_if_new(const message_t& msg);
+    uint64_t block_height() const;
+
+    // Queue `msg` for the next group commit; `on_saved` is posted to `ioc_`
+    // once it has been written to the database, with whether it is now
+    // stored (false if the commit failed)
+    void save_if_new(const message_t& msg,
+                     std::function<void(bool stored)> on_saved);
 
     // Save items to the database, notifying listeners as necessary
     void save_bulk(const std::vector<storage::Item>& items);
 
+    // Remove the messages with invalid PoW from a push batch, verifying them
+    // in parallel on `verify_pool_`
+    void verify_batch(std::vector<message_t>& messages);
+
     void on_bootstrap_update(block_update_t&& bu);
 
     void on_swarm_update(block_update_t&& bu);
 
     void bootstrap_data();
 
-    void bootstrap_peers(
-        const std::vector<sn_record_t>& peers) const; // mutex not needed
+    void bootstrap_peers(const std::vector<sn_record_t>& peers) const;
 
     void bootstrap_swarms(const std::vector<swarm_id_t>& swarms) const;
 
     /// Distribute all our data to where it belongs
     /// (called when our old node got dissolved)
-    void salvage_data() const; // mutex not needed
+    void salvage_data() const;
 
     void attach_signature(std::shared_ptr<request_t>& request,
-                          const signature& sig) const; // mutex not needed
+                          const signature& sig) const;
 
     /// Reliably push message/batch to a service node
-    void
-    relay_data_reliable(const std::string& blob,
-                        const sn_record_t& address) const; // mutex not needed
+    void relay_data_reliable(const std::string& blob,
+                             const sn_record_t& address,
+                             bool binary_payloads) const;
 
     template <typename Message>
-    void relay_messages(
-        const std::vector<Message>& messages,
-        const std::vector<sn_record_t>& snodes) const; // mutex not needed
+    void relay_messages(const std::vector<Message>& messages,
+                        const std::vector<sn_record_t>& snodes) const;
 
     /// Request swarm structure from the deamon and reset the timer
     void swarm_timer_tick();
 
+    /// Request swarm structure from the daemon over OxenMQ
+    void fetch_swarm_update();
+
+    /// Apply the daemon's response to a swarm structure request
+    void handle_swarm_update(bool success,
+                             const std::shared_ptr<std::string>& body);
+
     void cleanup_timer_tick();
 
     void ping_peers_tick();
@@ -209,10 +261,9 @@ class ServiceNode {
     void relay_buffered_messages();
 
     /// Check the latest version from DNS text record
-    void check_version_timer_tick(); // mutex not needed
+    void check_version_timer_tick();
     /// Update PoW difficulty from DNS text record
-    void
-    pow_difficulty_timer_tick(const pow_dns_callback_t cb); // mutex not needed
+    void pow_difficulty_timer_tick(const pow_dns_callback_t cb);
 
     /// Ping the storage server periodically as required for uptime proofs
     void oxend_ping_timer_tick();
@@ -250,10 +301,10 @@ class ServiceNode {
     void initiate_peer_test();
 
     // Select a random message from our database, return false on error
-    bool select_random_message(storage::Item& item); // mutex not needed
+    bool select_random_message(storage::Item& item);
 
     // Ping some node and record its reachability
-    void test_reachability(const sn_record_t& sn); // mutex not needed
+    void test_reachability(const sn_record_t& sn);
 
     void sign_request(std::shared_ptr<request_t>& req) const;
 
@@ -263,7 +314,12 @@ class ServiceNode {
                 OxenmqServer& lmq_server,
                 const oxen::oxend_key_pair_t& key_pair,
                 const std::string& ed25519hex, const std::string& db_location,
-                OxendClient& oxend_client, const bool force_start);
+                OxendClient& oxend_client, const bool force_start,
+                const bool binary_payloads = false,
+                const size_t message_cache_size = DEFAULT_MESSAGE_CACHE_SIZE,
+                const StorageEngineType storage_engine =
+                    StorageEngineType::SQLITE,
+                const size_t db_shards = 1);
 
     ~ServiceNode();
 
@@ -273,6 +329,14 @@ class ServiceNode {
     // Record the time of our last being tested over lmq/http
     void update_last_ping(ReachType type);
 
+    // oxend told us about a new block over OxenMQ (an empty hash if we
+    // don't know which one), called from an OxenMQ thread
+    void on_oxend_block(std::string_view block_hash);
+
+    // We no longer get new blocks from oxend over OxenMQ, so go back to
+    // polling it until we do; called from an OxenMQ thread
+    void on_oxend_lost();
+
     // These two are only needed because we store stats in Service Node,
     // might move it out later
     void record_proxy_request();
@@ -295,13 +359,17 @@ class ServiceNode {
                     ss_client::Request req, ss_client::Callback cb) const;
 
     // Return true if the service node is ready to start running
-    bool snode_ready(std::string* reason = nullptr);
+    bool snode_ready(std::string* reason = nullptr) const;
 
-    /// Process message received from a client, return false if not in a swarm
-    bool process_store(const message_t& msg);
+    /// Process message received from a client, return false if not in a
+    /// swarm. `on_stored` is invoked on the io thread once the message has
+    /// been committed to the database, or with false if that failed.
+    bool process_store(message_t msg,
+                       std::function<void(bool stored)> on_stored);
 
     /// Process incoming blob of messages: add to DB if new
-    void process_push_batch(const std::string& blob);
+    void process_push_batch(const std::string& blob,
+                            bool binary_payloads = false);
 
     /// request blockchain test from a peer
     void perform_blockchain_test(
@@ -316,9 +384,9 @@ class ServiceNode {
 
     bool is_pubkey_for_us(const user_pubkey_t& pk) const;
 
-    std::vector<sn_record_t> get_snodes_by_pk(const user_pubkey_t& pk);
+    std::vector<sn_record_t> get_snodes_by_pk(const user_pubkey_t& pk) const;
 
-    bool is_snode_address_known(const std::string&);
+    bool is_snode_address_known(const std::string&) const;
 
     /// return all messages for a particular PK (in JSON)
     bool get_all_messages(std::vector<storage::Item>& all_entries) const;
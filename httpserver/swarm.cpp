@@ -4,9 +4,13 @@
 
 #include "service_node.h"
 
+#include <algorithm>
+#include <iterator>
 #include <ostream>
 #include <stdlib.h>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "utils.hpp"
 
@@ -43,11 +47,7 @@ void debug_print(std::ostream& os, const block_update_t& bu) {
 Swarm::~Swarm() = default;
 
 bool Swarm::is_existing_swarm(swarm_id_t sid) const {
-
-    return std::any_of(all_valid_swarms_.begin(), all_valid_swarms_.end(),
-                       [sid](const SwarmInfo& cur_swarm_info) {
-                           return cur_swarm_info.swarm_id == sid;
-                       });
+    return std::binary_search(swarm_ids_.begin(), swarm_ids_.end(), sid);
 }
 
 SwarmEvents Swarm::derive_swarm_events(const all_swarms_t& swarms) const {
@@ -91,17 +91,23 @@ SwarmEvents Swarm::derive_swarm_events(const all_swarms_t& swarms) const {
 
     /// --- WE are still in the same swarm if we reach here ---
 
-    /// See if anyone joined our swarm
-    for (const auto& sn : new_swarm_snodes) {
+    /// See if anyone joined our swarm (nodes are compared by their key, as
+    /// with `sn_record_t::operator==`)
+    std::unordered_set<std::string_view> peers;
+    peers.reserve(swarm_peers_.size());
+    for (const auto& sn : swarm_peers_) {
+        peers.insert(sn.pub_key_hex());
+    }
 
-        const auto it = std::find(swarm_peers_.begin(), swarm_peers_.end(), sn);
+    for (const auto& sn : new_swarm_snodes) {
 
-        if (it == swarm_peers_.end() && sn != our_address_) {
+        if (!peers.count(sn.pub_key_hex()) && sn != our_address_) {
             events.new_snodes.push_back(sn);
         }
     }
 
-    /// See if there are any new swarms
+    /// See if there are any new swarms (`is_existing_swarm` is a binary
+    /// search)
 
     for (const auto& swarm_info : swarms) {
 
@@ -150,6 +156,20 @@ static all_swarms_t apply_ips(const all_swarms_t& swarms_to_keep,
                               const all_swarms_t& other_swarms) {
 
     all_swarms_t result_swarms = swarms_to_keep;
+
+    /// Usually every node has an IP, so there's nothing to look up
+    const bool missing_ips =
+        std::any_of(result_swarms.begin(), result_swarms.end(),
+                    [](const SwarmInfo& swarm) {
+                        return std::any_of(swarm.snodes.begin(),
+                                           swarm.snodes.end(),
+                                           [](const sn_record_t& snode) {
+                                               return snode.ip() == "0.0.0.0";
+                                           });
+                    });
+    if (!missing_ips)
+        return result_swarms;
+
     const auto other_snode_map = get_snode_map_from_swarms(other_swarms);
 
     int updates_count = 0;
@@ -176,13 +196,32 @@ void Swarm::apply_swarm_changes(const all_swarms_t& new_swarms) {
 
     OXEN_LOG(trace, "Applying swarm changes");
 
+    last_update_.reset();
     all_valid_swarms_ = apply_ips(new_swarms, all_valid_swarms_);
+
+    std::sort(all_valid_swarms_.begin(), all_valid_swarms_.end(),
+              [](const SwarmInfo& lhs, const SwarmInfo& rhs) {
+                  return lhs.swarm_id < rhs.swarm_id;
+              });
+
+    swarm_ids_.clear();
+    swarm_ids_.reserve(all_valid_swarms_.size());
+    for (const auto& si : all_valid_swarms_) {
+        /// Decommissioned nodes are never exposed to clients
+        if (si.swarm_id != INVALID_SWARM_ID)
+            swarm_ids_.push_back(si.swarm_id);
+    }
 }
 
 void Swarm::update_state(const all_swarms_t& swarms,
                          const std::vector<sn_record_t>& decommissioned,
                          const SwarmEvents& events, bool active) {
 
+    if (is_unchanged(swarms, decommissioned, active)) {
+        OXEN_LOG(trace, "Swarm composition is unchanged");
+        return;
+    }
+
     if (active) {
 
         // The following only makes sense for active nodes in a swarm
@@ -229,6 +268,76 @@ void Swarm::update_state(const all_swarms_t& swarms,
     for (const auto& sn : decommissioned) {
         all_funded_nodes_.push_back(sn);
     }
+
+    index_funded_nodes();
+
+    last_update_ = std::make_shared<const last_update_t>(
+        last_update_t{swarms, decommissioned, active});
+}
+
+/// Unlike `operator==`, this compares every field, so that a changed IP
+/// or port counts as a change
+static bool same_record(const sn_record_t& lhs, const sn_record_t& rhs) {
+    return lhs.pub_key_hex() == rhs.pub_key_hex() && lhs.ip() == rhs.ip() &&
+           lhs.port() == rhs.port() && lhs.lmq_port() == rhs.lmq_port() &&
+           lhs.sn_address() == rhs.sn_address() &&
+           lhs.pubkey_x25519_hex() == rhs.pubkey_x25519_hex() &&
+           lhs.pubkey_x25519_bin() == rhs.pubkey_x25519_bin() &&
+           lhs.pubkey_ed25519_hex() == rhs.pubkey_ed25519_hex();
+}
+
+static bool same_records(const std::vector<sn_record_t>& lhs,
+                         const std::vector<sn_record_t>& rhs) {
+    return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+                      same_record);
+}
+
+bool Swarm::is_unchanged(const all_swarms_t& swarms,
+                         const std::vector<sn_record_t>& decommissioned,
+                         bool is_active) const {
+
+    if (!last_update_ || last_update_->is_active != is_active)
+        return false;
+
+    return std::equal(swarms.begin(), swarms.end(),
+                      last_update_->swarms.begin(),
+                      last_update_->swarms.end(),
+                      [](const SwarmInfo& lhs, const SwarmInfo& rhs) {
+                          return lhs.swarm_id == rhs.swarm_id &&
+                                 same_records(lhs.snodes, rhs.snodes);
+                      }) &&
+           same_records(decommissioned, last_update_->decommissioned);
+}
+
+void Swarm::index_funded_nodes() {
+
+    for (auto* index : {&nodes_by_address_, &nodes_by_pubkey_,
+                        &nodes_by_ed25519_, &nodes_by_x25519_}) {
+        index->clear();
+        index->reserve(all_funded_nodes_.size());
+    }
+
+    /// Like the linear searches these replace, the first node with a given
+    /// key wins
+    for (size_t i = 0; i < all_funded_nodes_.size(); ++i) {
+        const auto& sn = all_funded_nodes_[i];
+        nodes_by_address_.emplace(sn.sn_address(), i);
+        nodes_by_pubkey_.emplace(sn.pub_key_base32z(), i);
+        nodes_by_ed25519_.emplace(sn.pubkey_ed25519_hex(), i);
+        nodes_by_x25519_.emplace(sn.pubkey_x25519_bin(), i);
+    }
+}
+
+/// The node that `index` has for `key`, if any
+static std::optional<sn_record_t>
+find_indexed(const std::unordered_map<std::string, size_t>& index,
+             const std::string& key, const std::vector<sn_record_t>& nodes) {
+
+    const auto it = index.find(key);
+    if (it == index.end())
+        return std::nullopt;
+
+    return nodes[it->second];
 }
 
 std::optional<sn_record_t> Swarm::choose_funded_node() const {
@@ -256,71 +365,92 @@ std::optional<sn_record_t> Swarm::find_node_by_port(uint16_t port) const {
 
 std::optional<sn_record_t>
 Swarm::find_node_by_ed25519_pk(const std::string& pk) const {
-
-    for (const auto& sn : all_funded_nodes_) {
-        if (sn.pubkey_ed25519_hex() == pk) {
-            return sn;
-        }
-    }
-
-    return std::nullopt;
+    return find_indexed(nodes_by_ed25519_, pk, all_funded_nodes_);
 }
 
 std::optional<sn_record_t>
 Swarm::find_node_by_x25519_bin(const std::string& pk) const {
-
-    for (const auto& sn : all_funded_nodes_) {
-        if (sn.pubkey_x25519_bin() == pk) {
-            return sn;
-        }
-    }
-
-    return std::nullopt;
+    return find_indexed(nodes_by_x25519_, pk, all_funded_nodes_);
 }
 
 std::optional<sn_record_t> Swarm::get_node_by_pk(const sn_pub_key_t& pk) const {
-
-    for (const auto& sn : all_funded_nodes_) {
-        if (sn.pub_key_base32z() == pk) {
-            return sn;
-        }
-    }
-
-    return std::nullopt;
+    return find_indexed(nodes_by_pubkey_, pk, all_funded_nodes_);
 }
 
-static uint64_t hex_to_u64(const user_pubkey_t& pk) {
+/// Slow path of `hex_to_u64` for pubkeys that aren't all hex, which must
+/// still map to the same swarm on every node
+static uint64_t hex_to_u64_strtoull(const std::string& pk) {
 
     /// Create a buffer for 16 characters null terminated
     char buf[17] = {};
 
-    /// Note: pk is expected to contain two leading characters
-    /// (05 for the messenger) that do not participate in mapping
-
     /// Note: if conversion is not possible, we will still
     /// get a value in res (possibly 0 or UINT64_MAX), which
     /// we are not handling at the moment
     uint64_t res = 0;
-    for (auto it = pk.str().begin() + 2; it < pk.str().end(); it += 16) {
-        memcpy(buf, &(*it), 16);
+    for (size_t i = 2; i < pk.size(); i += 16) {
+        const size_t len = std::min<size_t>(16, pk.size() - i);
+        memcpy(buf, pk.data() + i, len);
+        buf[len] = '\0';
         res ^= strtoull(buf, nullptr, 16);
     }
 
     return res;
 }
 
+static uint64_t hex_to_u64(const user_pubkey_t& pk) {
+
+    /// Note: pk is expected to contain two leading characters
+    /// (05 for the messenger) that do not participate in mapping
+    const std::string& str = pk.str();
+
+    /// Every 16 digits are xor-ed together. A digit's value is its low
+    /// nibble, plus 9 for letters (which have bit 6 set), so there are no
+    /// branches on the data.
+    uint64_t res = 0;
+    bool all_hex = true;
+    for (size_t i = 2; i < str.size(); i += 16) {
+        const size_t end = std::min<size_t>(i + 16, str.size());
+        uint64_t chunk = 0;
+        for (size_t j = i; j < end; ++j) {
+            const auto c = static_cast<uint8_t>(str[j]);
+            all_hex &= (static_cast<uint8_t>(c - '0') < 10) |
+                       (static_cast<uint8_t>((c | 0x20) - 'a') < 6);
+            chunk = (chunk << 4) | ((c & 0xf) + 9 * (c >> 6));
+        }
+        res ^= chunk;
+    }
+
+    return all_hex ? res : hex_to_u64_strtoull(str);
+}
+
 bool Swarm::is_pubkey_for_us(const user_pubkey_t& pk) const {
 
     /// TODO: Make sure no exceptions bubble up from here!
-    return cur_swarm_id_ == get_swarm_by_pk(all_valid_swarms_, pk);
+    return cur_swarm_id_ == get_swarm_by_pk(pk);
 }
 
-bool Swarm::is_fully_funded_node(const std::string& sn_address) const {
+swarm_id_t Swarm::get_swarm_by_pk(const user_pubkey_t& pk) const {
+    return oxen::get_swarm_by_pk(swarm_ids_, pk);
+}
+
+const std::vector<sn_record_t>*
+Swarm::get_swarm_members(swarm_id_t sid) const {
 
-    return std::any_of(all_funded_nodes_.begin(), all_funded_nodes_.end(),
-                       [&sn_address](const sn_record_t& sn) {
-                           return sn.sn_address() == sn_address;
-                       });
+    const auto it =
+        std::lower_bound(all_valid_swarms_.begin(), all_valid_swarms_.end(),
+                         sid, [](const SwarmInfo& si, swarm_id_t id) {
+                             return si.swarm_id < id;
+                         });
+
+    if (it == all_valid_swarms_.end() || it->swarm_id != sid)
+        return nullptr;
+
+    return &it->snodes;
+}
+
+bool Swarm::is_fully_funded_node(const std::string& sn_address) const {
+    return nodes_by_address_.count(sn_address) > 0;
 }
 
 swarm_id_t get_swarm_by_pk(const std::vector<SwarmInfo>& all_swarms,
@@ -383,6 +513,51 @@ swarm_id_t get_swarm_by_pk(const std::vector<SwarmInfo>& all_swarms,
     return cur_best;
 }
 
+swarm_id_t get_swarm_by_pk(const std::vector<swarm_id_t>& sorted_ids,
+                           const user_pubkey_t& pk) {
+
+    if (sorted_ids.empty())
+        return INVALID_SWARM_ID;
+
+    const uint64_t res = hex_to_u64(pk);
+
+    /// We reserve UINT64_MAX as a sentinel swarm id for unassigned snodes
+    constexpr swarm_id_t MAX_ID = INVALID_SWARM_ID - 1;
+
+    /// The closest swarm is on either side of `res`. Ties go to the lower
+    /// id, as with the linear search above over swarms in order.
+    swarm_id_t cur_best = INVALID_SWARM_ID;
+    uint64_t cur_min = INVALID_SWARM_ID;
+
+    const auto it =
+        std::lower_bound(sorted_ids.begin(), sorted_ids.end(), res);
+    if (it != sorted_ids.begin() && res - *std::prev(it) < cur_min) {
+        cur_best = *std::prev(it);
+        cur_min = res - cur_best;
+    }
+    if (it != sorted_ids.end() && *it - res < cur_min) {
+        cur_best = *it;
+        cur_min = *it - res;
+    }
+
+    /// Wrap around past the largest/smallest swarm id
+    const swarm_id_t leftmost_id = sorted_ids.front();
+    const swarm_id_t rightmost_id = sorted_ids.back();
+    if (res > rightmost_id) {
+        const uint64_t dist = (MAX_ID - res) + leftmost_id;
+        if (dist < cur_min) {
+            cur_best = leftmost_id;
+        }
+    } else if (res < leftmost_id) {
+        const uint64_t dist = res + (MAX_ID - rightmost_id);
+        if (dist < cur_min) {
+            cur_best = rightmost_id;
+        }
+    }
+
+    return cur_best;
+}
+
 const std::vector<sn_record_t>& Swarm::other_nodes() const {
     return swarm_peers_;
 }
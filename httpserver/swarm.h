@@ -1,8 +1,10 @@
 #pragma once
 
 #include <iostream>
+#include <memory>
 #include <oxenmq/auth.h>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "oxen_common.h"
@@ -39,6 +41,11 @@ void debug_print(std::ostream& os, const block_update_t& bu);
 swarm_id_t get_swarm_by_pk(const std::vector<SwarmInfo>& all_swarms,
                            const user_pubkey_t& pk);
 
+/// Same as above, but for the (ascending) ids of valid swarms; finds the
+/// closest one by binary search
+swarm_id_t get_swarm_by_pk(const std::vector<swarm_id_t>& sorted_ids,
+                           const user_pubkey_t& pk);
+
 struct SwarmEvents {
 
     /// our (potentially new) swarm id
@@ -57,16 +64,36 @@ struct SwarmEvents {
 class Swarm {
 
     swarm_id_t cur_swarm_id_ = INVALID_SWARM_ID;
-    /// Note: this excludes the "dummy" swarm
+    /// Note: this excludes the "dummy" swarm. Sorted by swarm id.
     std::vector<SwarmInfo> all_valid_swarms_;
+    /// Ids of `all_valid_swarms_` in ascending order, for mapping pubkeys
+    /// to swarms
+    std::vector<swarm_id_t> swarm_ids_;
     sn_record_t our_address_;
     std::vector<sn_record_t> swarm_peers_;
     /// This includes decommissioned nodes
     std::vector<sn_record_t> all_funded_nodes_;
+    /// Positions in `all_funded_nodes_` by each of the node's keys
+    std::unordered_map<std::string, size_t> nodes_by_address_;
+    std::unordered_map<std::string, size_t> nodes_by_pubkey_;
+    std::unordered_map<std::string, size_t> nodes_by_ed25519_;
+    std::unordered_map<std::string, size_t> nodes_by_x25519_;
+
+    /// The arguments of the last `update_state`, unless the swarms have been
+    /// changed since. Shared between copies, as it is never modified.
+    struct last_update_t {
+        all_swarms_t swarms;
+        std::vector<sn_record_t> decommissioned;
+        bool is_active;
+    };
+    std::shared_ptr<const last_update_t> last_update_;
 
     /// Check if `sid` is an existing (active) swarm
     bool is_existing_swarm(swarm_id_t sid) const;
 
+    /// Rebuild the indexes of `all_funded_nodes_`
+    void index_funded_nodes();
+
   public:
     Swarm(sn_record_t address) : our_address_(address) {}
 
@@ -81,10 +108,23 @@ class Swarm {
                       const std::vector<sn_record_t>& decommissioned,
                       const SwarmEvents& events, bool is_active);
 
+    /// Whether `update_state` was last called with exactly these swarms and
+    /// nodes (and `is_active`), so that calling it again would change
+    /// nothing
+    bool is_unchanged(const all_swarms_t& swarms,
+                      const std::vector<sn_record_t>& decommissioned,
+                      bool is_active) const;
+
     void apply_swarm_changes(const all_swarms_t& new_swarms);
 
     bool is_pubkey_for_us(const user_pubkey_t& pk) const;
 
+    /// The swarm that `pk` belongs to
+    swarm_id_t get_swarm_by_pk(const user_pubkey_t& pk) const;
+
+    /// Members of swarm `sid`, or nullptr if there is no such swarm
+    const std::vector<sn_record_t>* get_swarm_members(swarm_id_t sid) const;
+
     /// Whether `sn_address` is found in any of the swarms, including the
     /// dummy swarm with decommissioned nodes
     bool is_fully_funded_node(const std::string& sn_address) const;
@@ -1,5 +1,9 @@
+#pragma once
+
+#include <array>
 #include <chrono>
 #include <iostream>
+#include <string_view>
 #include <vector>
 
 struct pow_difficulty_t {
@@ -7,6 +11,12 @@ struct pow_difficulty_t {
     int difficulty;
 };
 
+// A message hash: 128 lowercase hex digits
+using pow_hash_t = std::array<char, 128>;
+
+int get_valid_difficulty(uint64_t timestamp,
+                         const std::vector<pow_difficulty_t>& history);
+
 int get_valid_difficulty(const std::string& timestamp,
                          const std::vector<pow_difficulty_t>& history);
 
@@ -14,3 +24,28 @@ bool checkPoW(const std::string& nonce, const std::string& timestamp,
               const std::string& ttl, const std::string& recipient,
               const std::string& data, std::string& messageHash,
               const int difficulty);
+
+// As above, for an already parsed timestamp and TTL (hashed in decimal),
+// without allocating: the payload is hashed in pieces and the hash is
+// written into `messageHash`, unless the TTL or nonce is invalid.
+bool checkPoW(std::string_view nonce, uint64_t timestamp, uint64_t ttl,
+              std::string_view recipient, std::string_view data,
+              pow_hash_t& messageHash, int difficulty);
+
+// A message to check with `checkPoW_batch`, which must outlive the call
+struct pow_message_t {
+    std::string_view nonce;
+    uint64_t timestamp;
+    uint64_t ttl;
+    std::string_view recipient;
+    std::string_view data;
+    int difficulty;
+};
+
+// Check the PoW of `count` messages as `checkPoW` would (with the timestamp
+// and TTL in decimal), setting `valid[i]` and `hashes[i]` for `messages[i]`.
+// Like with `checkPoW`, the hash is left unset if the TTL or nonce is
+// invalid. Messages are hashed several at a time with the multi-buffer
+// SHA-512 of `sha512_multi.hpp` when the CPU has AVX2 or AVX-512.
+void checkPoW_batch(const pow_message_t* messages, size_t count, bool* valid,
+                    pow_hash_t* hashes);
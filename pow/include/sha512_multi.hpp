@@ -0,0 +1,35 @@
+#pragma once
+
+#include <array>
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+// A message to hash, made of consecutive pieces (unused pieces are left
+// empty) so that it doesn't need to be concatenated first
+struct sha512_input_t {
+    std::array<std::string_view, 4> pieces;
+};
+
+using sha512_digest_t = std::array<uint8_t, 64>;
+
+// Implementations of `sha512_multi`, hashing one message per lane
+enum class sha512_kernel {
+    SCALAR, // 1 lane
+    AVX2,   // 4 lanes
+    AVX512  // 8 lanes
+};
+
+bool sha512_kernel_supported(sha512_kernel kernel);
+
+// The widest kernel supported by the CPU
+sha512_kernel best_sha512_kernel();
+
+// Hash `count` independent messages, several at a time (multi-buffer
+// SHA-512): each lane of a SIMD register runs the compression function for a
+// different message, so the cost of a block is shared by up to 8 messages.
+// Messages of different lengths can be mixed, but lanes sit idle once their
+// message is done.
+void sha512_multi(const sha512_input_t* inputs, size_t count,
+                  sha512_digest_t* digests,
+                  sha512_kernel kernel = best_sha512_kernel());
@@ -1,18 +1,28 @@
 #include "pow.hpp"
+#include "sha512_multi.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
 #include <array>
-#include <iomanip>
+#include <charconv>
 #include <limits>
 #include <oxenmq/base64.h>
+// The incremental SHA512_* functions are deprecated (but kept) in OpenSSL 3
+#define OPENSSL_SUPPRESS_DEPRECATED
 #include <openssl/sha.h>
-#include <sstream>
 #include <string.h>
 
 using namespace std::chrono_literals;
 
 constexpr int BYTE_LEN = 8;
 constexpr std::chrono::milliseconds TIMESTAMP_VARIANCE = 15min;
+// Messages checked at once by `checkPoW_batch`: the lane count of AVX-512
+constexpr size_t POW_BATCH_SIZE = 8;
+// Longest nonce (in base64) that `checkPoW_batch` decodes into a fixed
+// buffer; nonces are normally 12 characters
+constexpr size_t MAX_BATCH_NONCE_SIZE = 64;
+// Longest decimal uint64_t
+constexpr size_t MAX_DIGITS = 20;
 
 using uint64Bytes = std::array<uint8_t, BYTE_LEN>;
 
@@ -35,12 +45,12 @@ bool multWillOverflow(uint64_t left, uint64_t right) {
            (std::numeric_limits<std::uint64_t>::max() / left < right);
 }
 
-bool calcTarget(const std::string& payload, const uint64_t ttlInt,
+bool calcTarget(const size_t payloadSize, const uint64_t ttlInt,
                 const int difficulty, uint64Bytes& target) {
-    bool overflow = addWillOverflow(payload.size(), BYTE_LEN);
+    bool overflow = addWillOverflow(payloadSize, BYTE_LEN);
     if (overflow)
         return false;
-    uint64_t totalLen = payload.size() + BYTE_LEN;
+    uint64_t totalLen = payloadSize + BYTE_LEN;
     overflow = multWillOverflow(ttlInt, totalLen);
     if (overflow)
         return false;
@@ -60,16 +70,25 @@ bool calcTarget(const std::string& payload, const uint64_t ttlInt,
     return true;
 }
 
-int get_valid_difficulty(const std::string& timestamp,
-                         const std::vector<pow_difficulty_t>& history) {
-    uint64_t timestamp_long;
-    try {
-        timestamp_long = std::stoull(timestamp);
-    } catch (...) {
-        // Should never happen, checked previously
-        return false;
+// Two hex digits for every byte value
+static constexpr auto HEX_TABLE = [] {
+    constexpr const char* digits = "0123456789abcdef";
+    std::array<char, 512> table{};
+    for (int i = 0; i < 256; ++i) {
+        table[2 * i] = digits[i >> 4];
+        table[2 * i + 1] = digits[i & 0xf];
     }
-    const auto msg_timestamp = std::chrono::milliseconds(timestamp_long);
+    return table;
+}();
+
+static void toHex(const uint8_t* bytes, size_t size, char* out) {
+    for (size_t i = 0; i < size; ++i)
+        memcpy(out + 2 * i, &HEX_TABLE[2 * bytes[i]], 2);
+}
+
+int get_valid_difficulty(uint64_t timestamp,
+                         const std::vector<pow_difficulty_t>& history) {
+    const auto msg_timestamp = std::chrono::milliseconds(timestamp);
 
     int difficulty = std::numeric_limits<int>::max();
     int most_recent_difficulty = std::numeric_limits<int>::max();
@@ -91,47 +110,209 @@ int get_valid_difficulty(const std::string& timestamp,
     return std::min(most_recent_difficulty, difficulty);
 }
 
+int get_valid_difficulty(const std::string& timestamp,
+                         const std::vector<pow_difficulty_t>& history) {
+    uint64_t timestamp_long;
+    const auto end = timestamp.data() + timestamp.size();
+    const auto res = std::from_chars(timestamp.data(), end, timestamp_long);
+    if (res.ec != std::errc() || res.ptr != end) {
+        // Should never happen, checked previously
+        return false;
+    }
+    return get_valid_difficulty(timestamp_long, history);
+}
+
+// Size of the decoded value of a base64 string
+static size_t decodedBase64Size(std::string_view base64) {
+    while (!base64.empty() && base64.back() == '=')
+        base64.remove_suffix(1);
+    return base64.size() * 6 / 8;
+}
+
+// Decode a base64 nonce into `ctx` a chunk at a time; `nonce` must be valid
+// base64
+static void hashNonce(SHA512_CTX& ctx, std::string_view nonce) {
+    // A multiple of 4 characters, so that only the last chunk has padding
+    constexpr size_t CHUNK_SIZE = 64;
+    uint8_t decoded[CHUNK_SIZE / 4 * 3];
+    while (!nonce.empty()) {
+        const auto chunk = nonce.substr(0, CHUNK_SIZE);
+        oxenmq::from_base64(chunk.begin(), chunk.end(), decoded);
+        SHA512_Update(&ctx, decoded, decodedBase64Size(chunk));
+        nonce.remove_prefix(chunk.size());
+    }
+}
+
+// Hash the payload pieces, then the (valid base64) nonce followed by the
+// payload hash, and compare the result with the target. `ttlInt` is the
+// parsed `ttl`.
+static bool checkPoWPieces(std::string_view nonce, std::string_view timestamp,
+                           std::string_view ttl, uint64_t ttlInt,
+                           std::string_view recipient, std::string_view data,
+                           int difficulty,
+                           uint8_t (&hashResult)[SHA512_DIGEST_LENGTH]) {
+    SHA512_CTX ctx;
+    // Initial hash
+    SHA512_Init(&ctx);
+    for (const auto piece : {timestamp, ttl, recipient, data})
+        SHA512_Update(&ctx, piece.data(), piece.size());
+    SHA512_Final(hashResult, &ctx);
+    // Final hash
+    SHA512_Init(&ctx);
+    hashNonce(ctx, nonce);
+    SHA512_Update(&ctx, hashResult, SHA512_DIGEST_LENGTH);
+    SHA512_Final(hashResult, &ctx);
+
+    const size_t payloadSize =
+        timestamp.size() + ttl.size() + recipient.size() + data.size();
+    uint64Bytes target;
+    // ttl is in milliseconds, but target calculation wants seconds
+    if (!calcTarget(payloadSize, ttlInt / 1000, difficulty, target))
+        return false;
+
+    return memcmp(hashResult, target.data(), BYTE_LEN) < 0;
+}
+
 bool checkPoW(const std::string& nonce, const std::string& timestamp,
               const std::string& ttl, const std::string& recipient,
               const std::string& data, std::string& messageHash,
               const int difficulty) {
-    std::string payload;
-    payload.reserve(timestamp.size() + ttl.size() + recipient.size() +
-                    data.size());
-    payload += timestamp;
-    payload += ttl;
-    payload += recipient;
-    payload += data;
-
     uint64_t ttlInt;
     if (!util::parseTTL(ttl, ttlInt))
         return false;
-    // ttl is in milliseconds, but target calculation wants seconds
-    ttlInt = ttlInt / 1000;
-    uint64Bytes target;
-    calcTarget(payload, ttlInt, difficulty, target);
+    if (!oxenmq::is_base64(nonce))
+        return false;
 
     uint8_t hashResult[SHA512_DIGEST_LENGTH];
-    // Initial hash
-    SHA512((const unsigned char*)payload.data(), payload.size(), hashResult);
-    // Convert nonce to binary
+    const bool valid = checkPoWPieces(nonce, timestamp, ttl, ttlInt, recipient,
+                                      data, difficulty, hashResult);
+    messageHash.resize(2 * SHA512_DIGEST_LENGTH);
+    toHex(hashResult, SHA512_DIGEST_LENGTH, messageHash.data());
+    return valid;
+}
+
+bool checkPoW(std::string_view nonce, uint64_t timestamp, uint64_t ttl,
+              std::string_view recipient, std::string_view data,
+              pow_hash_t& messageHash, int difficulty) {
+    if (!util::validateTTL(ttl))
+        return false;
     if (!oxenmq::is_base64(nonce))
         return false;
-    std::string decodedNonce = oxenmq::from_base64(nonce);
-    // Convert decoded nonce string into uint8_t vector. Will have length 8
-    std::vector<uint8_t> innerPayload;
-    innerPayload.reserve(decodedNonce.size() + SHA512_DIGEST_LENGTH);
-    innerPayload.insert(std::end(innerPayload), std::begin(decodedNonce),
-                        std::end(decodedNonce));
-    innerPayload.insert(std::end(innerPayload), hashResult,
-                        hashResult + SHA512_DIGEST_LENGTH);
-    // Final hash
-    SHA512(innerPayload.data(), innerPayload.size(), hashResult);
-    std::stringstream ss;
-    ss << std::hex << std::setfill('0');
-    for (int i = 0; i < SHA512_DIGEST_LENGTH; i++)
-        ss << std::setw(2) << static_cast<unsigned>(hashResult[i]);
-    messageHash = ss.str();
 
-    return memcmp(hashResult, target.data(), BYTE_LEN) < 0;
+    char timestampBuf[MAX_DIGITS];
+    char ttlBuf[MAX_DIGITS];
+    const auto timestampEnd =
+        std::to_chars(timestampBuf, timestampBuf + MAX_DIGITS, timestamp).ptr;
+    const auto ttlEnd = std::to_chars(ttlBuf, ttlBuf + MAX_DIGITS, ttl).ptr;
+
+    uint8_t hashResult[SHA512_DIGEST_LENGTH];
+    const bool valid = checkPoWPieces(
+        nonce, std::string_view(timestampBuf, timestampEnd - timestampBuf),
+        std::string_view(ttlBuf, ttlEnd - ttlBuf), ttl, recipient, data,
+        difficulty, hashResult);
+    toHex(hashResult, SHA512_DIGEST_LENGTH, messageHash.data());
+    return valid;
+}
+
+static void checkPoWSingle(const pow_message_t& message, bool& valid,
+                           pow_hash_t& hash) {
+    valid = checkPoW(message.nonce, message.timestamp, message.ttl,
+                     message.recipient, message.data, hash,
+                     message.difficulty);
+}
+
+// Check the PoW of up to `POW_BATCH_SIZE` messages
+static void checkPoWGroup(const pow_message_t* messages, size_t count,
+                          bool* valid, pow_hash_t* hashes) {
+
+    // The payload is the timestamp, TTL, recipient and data, hashed in place
+    char timestamps[POW_BATCH_SIZE][MAX_DIGITS];
+    char ttls[POW_BATCH_SIZE][MAX_DIGITS];
+    std::array<char, MAX_BATCH_NONCE_SIZE> nonces[POW_BATCH_SIZE];
+    size_t nonceSizes[POW_BATCH_SIZE];
+    uint64Bytes targets[POW_BATCH_SIZE];
+
+    // Messages that get hashed, by index in `messages`
+    size_t indices[POW_BATCH_SIZE];
+    sha512_input_t inputs[POW_BATCH_SIZE];
+    size_t hashed = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        const pow_message_t& message = messages[i];
+        valid[i] = false;
+
+        if (!util::validateTTL(message.ttl))
+            continue;
+
+        if (message.nonce.size() > MAX_BATCH_NONCE_SIZE) {
+            checkPoWSingle(message, valid[i], hashes[i]);
+            continue;
+        }
+
+        const auto timestamp =
+            std::to_chars(timestamps[i], timestamps[i] + MAX_DIGITS,
+                          message.timestamp)
+                .ptr;
+        const auto ttl =
+            std::to_chars(ttls[i], ttls[i] + MAX_DIGITS, message.ttl).ptr;
+        sha512_input_t& input = inputs[hashed];
+        input.pieces = {
+            std::string_view(timestamps[i], timestamp - timestamps[i]),
+            std::string_view(ttls[i], ttl - ttls[i]), message.recipient,
+            message.data};
+
+        const size_t payloadSize = input.pieces[0].size() +
+                                   input.pieces[1].size() +
+                                   message.recipient.size() +
+                                   message.data.size();
+        // ttl is in milliseconds, but target calculation wants seconds
+        if (!calcTarget(payloadSize, message.ttl / 1000, message.difficulty,
+                        targets[i]))
+            continue;
+
+        if (!oxenmq::is_base64(message.nonce))
+            continue;
+        nonceSizes[i] = decodedBase64Size(message.nonce);
+        oxenmq::from_base64(message.nonce.begin(), message.nonce.end(),
+                            nonces[i].begin());
+
+        indices[hashed++] = i;
+    }
+
+    sha512_digest_t digests[POW_BATCH_SIZE];
+    sha512_multi(inputs, hashed, digests);
+
+    // The final hash is of the nonce followed by the payload hash
+    for (size_t j = 0; j < hashed; ++j) {
+        const size_t i = indices[j];
+        inputs[j].pieces = {
+            std::string_view(nonces[i].data(), nonceSizes[i]),
+            std::string_view(reinterpret_cast<const char*>(digests[j].data()),
+                             digests[j].size()),
+            {},
+            {}};
+    }
+    sha512_multi(inputs, hashed, digests);
+
+    for (size_t j = 0; j < hashed; ++j) {
+        const size_t i = indices[j];
+        toHex(digests[j].data(), digests[j].size(), hashes[i].data());
+        valid[i] = memcmp(digests[j].data(), targets[i].data(), BYTE_LEN) < 0;
+    }
+}
+
+void checkPoW_batch(const pow_message_t* messages, size_t count, bool* valid,
+                    pow_hash_t* hashes) {
+
+    // Without SIMD, hashing a message at a time with OpenSSL is faster
+    if (best_sha512_kernel() == sha512_kernel::SCALAR) {
+        for (size_t i = 0; i < count; ++i)
+            checkPoWSingle(messages[i], valid[i], hashes[i]);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i += POW_BATCH_SIZE) {
+        checkPoWGroup(messages + i, std::min(POW_BATCH_SIZE, count - i),
+                      valid + i, hashes + i);
+    }
 }
@@ -0,0 +1,287 @@
+#include "sha512_multi.hpp"
+
+#include <algorithm>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA512_MULTI_X86 1
+#endif
+
+namespace {
+
+constexpr size_t BLOCK_SIZE = 128;
+
+constexpr uint64_t IV[8] = {0x6a09e667f3bcc908, 0xbb67ae8584caa73b,
+                            0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1,
+                            0x510e527fade682d1, 0x9b05688c2b3e6c1f,
+                            0x1f83d9abfb41bd6b, 0x5be0cd19137e2179};
+
+constexpr uint64_t K[80] = {
+    0x428a2f98d728ae22, 0x7137449123ef65cd, 0xb5c0fbcfec4d3b2f,
+    0xe9b5dba58189dbbc, 0x3956c25bf348b538, 0x59f111f1b605d019,
+    0x923f82a4af194f9b, 0xab1c5ed5da6d8118, 0xd807aa98a3030242,
+    0x12835b0145706fbe, 0x243185be4ee4b28c, 0x550c7dc3d5ffb4e2,
+    0x72be5d74f27b896f, 0x80deb1fe3b1696b1, 0x9bdc06a725c71235,
+    0xc19bf174cf692694, 0xe49b69c19ef14ad2, 0xefbe4786384f25e3,
+    0x0fc19dc68b8cd5b5, 0x240ca1cc77ac9c65, 0x2de92c6f592b0275,
+    0x4a7484aa6ea6e483, 0x5cb0a9dcbd41fbd4, 0x76f988da831153b5,
+    0x983e5152ee66dfab, 0xa831c66d2db43210, 0xb00327c898fb213f,
+    0xbf597fc7beef0ee4, 0xc6e00bf33da88fc2, 0xd5a79147930aa725,
+    0x06ca6351e003826f, 0x142929670a0e6e70, 0x27b70a8546d22ffc,
+    0x2e1b21385c26c926, 0x4d2c6dfc5ac42aed, 0x53380d139d95b3df,
+    0x650a73548baf63de, 0x766a0abb3c77b2a8, 0x81c2c92e47edaee6,
+    0x92722c851482353b, 0xa2bfe8a14cf10364, 0xa81a664bbc423001,
+    0xc24b8b70d0f89791, 0xc76c51a30654be30, 0xd192e819d6ef5218,
+    0xd69906245565a910, 0xf40e35855771202a, 0x106aa07032bbd1b8,
+    0x19a4c116b8d2d0c8, 0x1e376c085141ab53, 0x2748774cdf8eeb99,
+    0x34b0bcb5e19b48a8, 0x391c0cb3c5c95a63, 0x4ed8aa4ae3418acb,
+    0x5b9cca4f7763e373, 0x682e6ff3d6b2b8a3, 0x748f82ee5defb2fc,
+    0x78a5636f43172f60, 0x84c87814a1f0ab72, 0x8cc702081a6439ec,
+    0x90befffa23631e28, 0xa4506cebde82bde9, 0xbef9a3f7b2c67915,
+    0xc67178f2e372532b, 0xca273eceea26619c, 0xd186b8c721c0c207,
+    0xeada7dd6cde0eb1e, 0xf57d4f7fee6ed178, 0x06f067aa72176fba,
+    0x0a637dc5a2c898a6, 0x113f9804bef90dae, 0x1b710b35131c471b,
+    0x28db77f523047d84, 0x32caab7b40c72493, 0x3c9ebe0a15c9bebc,
+    0x431d67c49c100d4c, 0x4cc5d4becb3e42b6, 0x597f299cfc657e2a,
+    0x5fcb6fab3ad6faec, 0x6c44198c4a475817};
+
+// Registers of 4 and 8 lanes (GCC/clang vector extensions), compiled to AVX2
+// or AVX-512 instructions in functions targeting those; the scalar kernel
+// uses plain integers as single-lane registers
+typedef uint64_t u64x4 __attribute__((vector_size(32)));
+typedef uint64_t u64x8 __attribute__((vector_size(64)));
+
+inline uint64_t load_be64(const uint8_t* p) {
+    uint64_t x = 0;
+    for (int i = 0; i < 8; ++i)
+        x = (x << 8) | p[i];
+    return x;
+}
+
+inline void store_be64(uint8_t* p, uint64_t x) {
+    for (int i = 7; i >= 0; --i) {
+        p[i] = x & 0xff;
+        x >>= 8;
+    }
+}
+
+size_t input_size(const sha512_input_t& input) {
+    size_t size = 0;
+    for (const auto& piece : input.pieces)
+        size += piece.size();
+    return size;
+}
+
+// Padding adds a 0x80 byte and the 16-byte length
+size_t num_blocks(size_t size) {
+    return (size + 17 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Write block `index` of the padded message into `block`
+void fill_block(const sha512_input_t& input, size_t size, size_t index,
+                uint8_t* block) {
+
+    const size_t begin = index * BLOCK_SIZE;
+    const size_t end = begin + BLOCK_SIZE;
+
+    size_t offset = 0;
+    for (const auto& piece : input.pieces) {
+        const size_t piece_end = offset + piece.size();
+        if (piece_end > begin && offset < end) {
+            const size_t from = std::max(begin, offset);
+            const size_t to = std::min(end, piece_end);
+            memcpy(block + (from - begin), piece.data() + (from - offset),
+                   to - from);
+        }
+        offset = piece_end;
+    }
+
+    const size_t filled = size > begin ? std::min(size - begin, BLOCK_SIZE) : 0;
+    memset(block + filled, 0, BLOCK_SIZE - filled);
+    if (size >= begin && size < end)
+        block[size - begin] = 0x80;
+    if (index + 1 == num_blocks(size)) {
+        store_be64(block + BLOCK_SIZE - 16, static_cast<uint64_t>(size) >> 61);
+        store_be64(block + BLOCK_SIZE - 8, static_cast<uint64_t>(size) << 3);
+    }
+}
+
+// A macro rather than a function: returning vectors from functions that
+// aren't compiled for AVX changes their ABI
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+template <typename V>
+__attribute__((always_inline)) inline void compress(V* state, V* w) {
+
+    V a = state[0], b = state[1], c = state[2], d = state[3];
+    V e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int t = 0; t < 80; ++t) {
+        // `w` is a rolling window of the message schedule: before this
+        // update, w[t & 15] holds W[t - 16]
+        if (t >= 16) {
+            const V w15 = w[(t + 1) & 15];
+            const V w2 = w[(t + 14) & 15];
+            const V s0 = ROTR(w15, 1) ^ ROTR(w15, 8) ^ (w15 >> 7);
+            const V s1 = ROTR(w2, 19) ^ ROTR(w2, 61) ^ (w2 >> 6);
+            w[t & 15] += s0 + s1 + w[(t + 9) & 15];
+        }
+        const V s1 = ROTR(e, 14) ^ ROTR(e, 18) ^ ROTR(e, 41);
+        const V ch = (e & f) ^ (~e & g);
+        const V t1 = h + s1 + ch + K[t] + w[t & 15];
+        const V s0 = ROTR(a, 28) ^ ROTR(a, 34) ^ ROTR(a, 39);
+        const V maj = (a & b) ^ (a & c) ^ (b & c);
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + s0 + maj;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+// Access a lane of a register
+template <typename V>
+__attribute__((always_inline)) inline uint64_t& lane_of(V& v, size_t lane) {
+    return reinterpret_cast<uint64_t*>(&v)[lane];
+}
+
+// Hash up to `LANES` messages, one per lane
+template <typename V, size_t LANES>
+__attribute__((always_inline)) inline void
+hash_lanes(const sha512_input_t* inputs, size_t count,
+           sha512_digest_t* digests) {
+
+    size_t sizes[LANES];
+    size_t blocks[LANES];
+    size_t max_blocks = 0;
+    for (size_t lane = 0; lane < count; ++lane) {
+        sizes[lane] = input_size(inputs[lane]);
+        blocks[lane] = num_blocks(sizes[lane]);
+        max_blocks = std::max(max_blocks, blocks[lane]);
+    }
+
+    V state[8];
+    for (int i = 0; i < 8; ++i)
+        state[i] = V{} + IV[i];
+
+    alignas(64) uint8_t block[LANES][BLOCK_SIZE] = {};
+
+    for (size_t b = 0; b < max_blocks; ++b) {
+        bool all_active = count == LANES;
+        for (size_t lane = 0; lane < count; ++lane) {
+            if (b < blocks[lane])
+                fill_block(inputs[lane], sizes[lane], b, block[lane]);
+            else
+                all_active = false;
+        }
+
+        V w[16];
+        for (int t = 0; t < 16; ++t) {
+            for (size_t lane = 0; lane < LANES; ++lane)
+                lane_of(w[t], lane) = load_be64(block[lane] + 8 * t);
+        }
+
+        V saved[8];
+        if (!all_active)
+            std::copy(state, state + 8, saved);
+
+        compress(state, w);
+
+        // Lanes whose message is done (or unused) keep their state
+        if (!all_active) {
+            for (size_t lane = 0; lane < LANES; ++lane) {
+                if (lane < count && b < blocks[lane])
+                    continue;
+                for (int i = 0; i < 8; ++i)
+                    lane_of(state[i], lane) = lane_of(saved[i], lane);
+            }
+        }
+    }
+
+    for (size_t lane = 0; lane < count; ++lane) {
+        for (int i = 0; i < 8; ++i)
+            store_be64(digests[lane].data() + 8 * i,
+                       lane_of(state[i], lane));
+    }
+}
+
+void hash_scalar(const sha512_input_t* inputs, size_t count,
+                 sha512_digest_t* digests) {
+    for (size_t i = 0; i < count; ++i)
+        hash_lanes<uint64_t, 1>(inputs + i, 1, digests + i);
+}
+
+#ifdef SHA512_MULTI_X86
+__attribute__((target("avx2"))) void
+hash_avx2(const sha512_input_t* inputs, size_t count,
+          sha512_digest_t* digests) {
+    for (size_t i = 0; i < count; i += 4)
+        hash_lanes<u64x4, 4>(inputs + i, std::min<size_t>(count - i, 4),
+                             digests + i);
+}
+
+__attribute__((target("avx512f"))) void
+hash_avx512(const sha512_input_t* inputs, size_t count,
+            sha512_digest_t* digests) {
+    for (size_t i = 0; i < count; i += 8)
+        hash_lanes<u64x8, 8>(inputs + i, std::min<size_t>(count - i, 8),
+                             digests + i);
+}
+#endif
+
+} // namespace
+
+bool sha512_kernel_supported(sha512_kernel kernel) {
+    switch (kernel) {
+    case sha512_kernel::SCALAR:
+        return true;
+#ifdef SHA512_MULTI_X86
+    case sha512_kernel::AVX2:
+        return __builtin_cpu_supports("avx2");
+    case sha512_kernel::AVX512:
+        return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+        return false;
+    }
+}
+
+sha512_kernel best_sha512_kernel() {
+    static const sha512_kernel best = [] {
+        for (auto kernel : {sha512_kernel::AVX512, sha512_kernel::AVX2}) {
+            if (sha512_kernel_supported(kernel))
+                return kernel;
+        }
+        return sha512_kernel::SCALAR;
+    }();
+    return best;
+}
+
+void sha512_multi(const sha512_input_t* inputs, size_t count,
+                  sha512_digest_t* digests, sha512_kernel kernel) {
+    switch (kernel) {
+#ifdef SHA512_MULTI_X86
+    case sha512_kernel::AVX512:
+        hash_avx512(inputs, count, digests);
+        break;
+    case sha512_kernel::AVX2:
+        hash_avx2(inputs, count, digests);
+        break;
+#endif
+    default:
+        hash_scalar(inputs, count, digests);
+        break;
+    }
+}
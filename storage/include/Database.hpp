@@ -1,12 +1,24 @@
 #pragma once
 
+#include "HashFilter.hpp"
 #include "Item.hpp"
+#include "MessageCache.hpp"
+#include "StorageEngine.hpp"
 #include "oxen_common.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <stdint.h>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <boost/asio.hpp>
@@ -17,49 +29,245 @@ class Timer;
 
 namespace oxen {
 
-class Database {
+constexpr size_t DEFAULT_DB_READERS = 4;
+
+/// SQLite-backed message store. The database runs in WAL journal mode with a
+/// single writer connection (serialised by `write_mutex_`) and a pool of
+/// read-only connections, so that reads are never blocked by a long write
+/// transaction (such as a bulk store of a push batch). Client stores are
+/// queued with `store_async` and committed in groups by a dedicated database
+/// thread, so that many stores share a single fsync.
+///
+/// Messages are partitioned by expiration time into `Messages_<window>`
+/// tables, so that the database thread expires messages by dropping whole
+/// partitions rather than deleting them row by row. Tables store hex hashes
+/// and pubkeys as raw bytes and nonces base64-decoded. Databases created by
+/// older versions keep their messages in the `Data` table; these are moved
+/// into the partitions in the background by the database thread while all
+/// tables are served to readers.
+class Database : public StorageEngine {
   public:
-    Database(boost::asio::io_context& ioc, const std::string& db_path);
-    ~Database();
+    // How new message payloads are stored: as received (base64 text), or
+    // base64-decoded, which takes about 25% less space. Payloads are always
+    // returned base64-encoded, so databases can hold both.
+    enum class PayloadFormat { BASE64, BINARY };
 
-    enum class DuplicateHandling { IGNORE, FAIL };
+    // `cache_size` is the memory budget, in bytes, for caching recent
+    // messages (see `MessageCache`)
+    Database(boost::asio::io_context& ioc, const std::string& db_path,
+             PayloadFormat payload_format = PayloadFormat::BASE64,
+             size_t cache_size = DEFAULT_MESSAGE_CACHE_SIZE,
+             size_t num_readers = DEFAULT_DB_READERS);
+    ~Database() override;
 
     bool store(const std::string& hash, const std::string& pubKey,
                const std::string& bytes, uint64_t ttl, uint64_t timestamp,
                const std::string& nonce,
-               DuplicateHandling behaviour = DuplicateHandling::FAIL);
+               DuplicateHandling behaviour = DuplicateHandling::FAIL) override;
+
+    // Queue `item` to be stored by the database thread. Stores queued
+    // concurrently are committed in a single transaction; `cb` is invoked on
+    // the database thread after the commit with `true` if the item was
+    // inserted.
+    void
+    store_async(storage::Item item, store_callback_t cb,
+                DuplicateHandling behaviour = DuplicateHandling::FAIL) override;
 
-    bool bulk_store(const std::vector<storage::Item>& items);
+    bool bulk_store(const std::vector<storage::Item>& items) override;
 
     bool retrieve(const std::string& key, std::vector<storage::Item>& items,
-                  const std::string& lastHash, int num_results = -1);
+                  const std::string& lastHash, int num_results = -1) override;
 
-    // Return the total number of messages stored
-    bool get_message_count(uint64_t& count);
+    // Iterate over all unexpired messages in insertion order, `chunk_size`
+    // messages at a time, so that only a single chunk is held in memory. No
+    // database connection is held while `cb` runs. Returns false on database
+    // errors.
+    bool for_each_chunk(const chunk_callback_t& cb,
+                        size_t chunk_size = DEFAULT_DB_CHUNK_SIZE) override;
+
+    // Return the total number of messages stored (including expired
+    // messages that haven't been cleaned up yet)
+    bool get_message_count(uint64_t& count) override;
 
     // Get message by `index` (must be smaller than the result of
-    // `get_message_count`).
+    // `get_message_count`), counting through the partitions in window order
+    // and then the legacy table. This is linear in the index within its
+    // table; use `retrieve_random` to sample messages.
     bool retrieve_by_index(uint64_t index, storage::Item& item);
 
+    // Get a randomly selected unexpired message in logarithmic time, return
+    // false if there are none
+    bool retrieve_random(storage::Item& item) override;
+
     // Get message by `msg_hash`, return true if found
-    bool retrieve_by_hash(const std::string& msg_hash, storage::Item& item);
+    bool retrieve_by_hash(const std::string& msg_hash,
+                          storage::Item& item) override;
+
+    // Checked against an in-memory filter of the hashes in each partition
+    // first, so that only likely duplicates need a query
+    bool contains(const std::string& msg_hash,
+                  uint64_t expiration_timestamp) override;
+
+    // Whether `msg_hash` is the most recent unexpired message for `pubKey`,
+    // i.e. there is nothing newer to retrieve. Answered from memory.
+    bool is_latest_message(const std::string& pubKey,
+                           const std::string& msg_hash) override;
+
+    bool get_message_cache_stats(MessageCacheStats& stats) const override;
+
+    const MessageCache* message_cache() const { return &cache_; }
 
   private:
-    sqlite3_stmt* prepare_statement(const std::string& query);
-    void open_and_prepare(const std::string& db_path);
+    struct ReadConnection;
+    class ReaderGuard;
+
+    struct PendingStore {
+        storage::Item item;
+        DuplicateHandling behaviour;
+        store_callback_t cb;
+    };
+
+    struct OwnerHead {
+        std::string hash;
+        uint64_t expiration_timestamp;
+    };
+
+    // Writer statements of a partition
+    struct Partition {
+        sqlite3_stmt* save_stmt = nullptr;
+        sqlite3_stmt* save_or_ignore_stmt = nullptr;
+        // Number of rows, to update the message count when it is dropped
+        uint64_t rows = 0;
+    };
+
+    void open_and_prepare(const std::string& db_path, size_t num_readers);
+    // Timer handler: asks the database thread to expire old messages
+    void schedule_cleanup();
+
+    // Drop expired partitions. Runs on the database thread.
     void perform_cleanup();
 
+    // Find the existing partitions on startup
+    void load_partitions();
+    // Get the partition for messages expiring at `expiration_timestamp`,
+    // creating it if necessary (returns nullptr on errors); `write_mutex_`
+    // must be held. Callers get the partitions they need before beginning a
+    // transaction, so that a rolled back transaction can't take a new table
+    // with it.
+    Partition* get_partition(uint64_t expiration_timestamp);
+    Partition* create_partition(uint64_t window);
+    // Count a committed message in its partition; `write_mutex_` must be held
+    void count_partition_row(uint64_t expiration_timestamp);
+    // Drop the partitions whose window has passed by `now_ms`, returning the
+    // number of messages dropped; `write_mutex_` must be held
+    uint64_t drop_expired_partitions(uint64_t now_ms);
+    // Bring the statements of `reader` up to date with `read_tables_`;
+    // `read_tables_mutex_` must be held
+    void sync_tables(ReadConnection& reader);
+
+    // Find the latest message of every owner on startup
+    void load_heads();
+    // Record a committed message as the latest one of its owner
+    void update_head(const std::string& pubKey, const std::string& hash,
+                     uint64_t expiration_timestamp);
+    // Forget the latest messages that have expired by `now_ms`
+    void remove_expired_heads(uint64_t now_ms);
+
+    // Load up to `limit` unexpired messages with a rowid greater than
+    // `after_rowid`, setting `after_rowid` to the last rowid loaded
+    bool retrieve_chunk(int64_t& after_rowid, size_t limit,
+                        std::vector<storage::Item>& items);
+
+    // Insert a new message on the writer connection; `write_mutex_` must be
+    // held by the caller. `added` is set if a row was actually inserted,
+    // which is not the case for ignored duplicates.
+    bool insert(const std::string& hash, const std::string& pubKey,
+                const std::string& bytes, uint64_t ttl, uint64_t timestamp,
+                const std::string& nonce, DuplicateHandling behaviour,
+                bool& added);
+    // Insert a row with the given `id` into the partition of its expiry
+    bool insert_row(int64_t id, const std::string& hash,
+                    const std::string& pubKey, const std::string& bytes,
+                    uint64_t ttl, uint64_t timestamp, const std::string& nonce,
+                    DuplicateHandling behaviour, bool& added);
+
+    // Move a chunk of rows from the legacy `Data` table into partitions;
+    // returns true if there are rows left to move. Runs on the database
+    // thread.
+    bool migrate_chunk();
+    // Whether `hash` is in the legacy table; `write_mutex_` must be held
+    bool is_legacy_hash(const std::string& hash);
+
+    // Take a reader connection from the pool (waiting if all are busy)
+    ReadConnection* acquire_reader();
+    void release_reader(ReadConnection* reader);
+
+    // Body of `write_thread_`: waits for queued stores and commits them
+    void write_loop();
+    void commit_batch(std::vector<PendingStore>& batch);
+
   private:
+    const PayloadFormat payload_format_;
+
+    // Writer connection, only used while holding `write_mutex_`
     sqlite3* db;
-    sqlite3_stmt* save_stmt;
-    sqlite3_stmt* save_or_ignore_stmt;
-    sqlite3_stmt* get_all_for_pk_stmt;
-    sqlite3_stmt* get_all_stmt;
-    sqlite3_stmt* get_stmt;
-    sqlite3_stmt* get_row_count_stmt;
-    sqlite3_stmt* get_by_index_stmt;
-    sqlite3_stmt* get_by_hash_stmt;
-    sqlite3_stmt* delete_expired_stmt;
+    // Partitions by window
+    std::map<uint64_t, Partition> partitions_;
+    // Only prepared while the legacy table is being migrated
+    sqlite3_stmt* legacy_get_by_hash_stmt = nullptr;
+    sqlite3_stmt* legacy_get_chunk_stmt = nullptr;
+    sqlite3_stmt* legacy_delete_chunk_stmt = nullptr;
+    std::mutex write_mutex_;
+
+    // Rows in partitions are numbered explicitly, carrying over the rowids of
+    // migrated rows, so that the order of all messages is preserved; only
+    // accessed while holding `write_mutex_`
+    int64_t next_id_ = 1;
+
+    // Whether the legacy table might still have rows that readers need to
+    // look at
+    std::atomic<bool> legacy_rows_{false};
+    // Only accessed by the database thread
+    bool migrating_ = false;
+
+    // Number of rows in the database, counted once on startup and then kept
+    // up to date as messages are committed and expired
+    std::atomic<uint64_t> message_count_{0};
+
+    // The latest message of each owner, so that polls that have everything
+    // already don't need a query
+    std::unordered_map<std::string, OwnerHead> heads_;
+    std::mutex heads_mutex_;
+
+    // Hashes of the messages in each partition, by window, filled on startup
+    // and as rows are inserted (so before they are committed)
+    std::map<uint64_t, HashFilter> hash_filters_;
+    std::mutex hash_filters_mutex_;
+
+    // Recently stored messages, added as they are committed (while holding
+    // `write_mutex_`, so that they are added in order)
+    MessageCache cache_;
+
+    // Tables that readers query (other than the legacy one), bumping the
+    // version on every change. Readers hold a shared lock while querying, so
+    // that tables are only dropped once no reader is using them.
+    std::vector<std::string> read_tables_;
+    uint64_t read_tables_version_ = 0;
+    std::shared_mutex read_tables_mutex_;
+
+    // Read-only connections, each with its own prepared statements
+    std::vector<std::unique_ptr<ReadConnection>> readers_;
+    std::vector<ReadConnection*> idle_readers_;
+    std::mutex readers_mutex_;
+    std::condition_variable reader_available_;
+
+    // Stores waiting for the next group commit
+    std::deque<PendingStore> write_queue_;
+    std::mutex write_queue_mutex_;
+    std::condition_variable write_queue_cv_;
+    bool stopping_ = false;
+    bool cleanup_due_ = false;
+    std::thread write_thread_;
 
     boost::asio::steady_timer cleanup_timer_;
 };
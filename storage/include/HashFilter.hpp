@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+
+namespace oxen {
+
+/// Bloom filter of message hashes: `might_contain` never gives a false
+/// negative, and gives a false positive for a small fraction of the hashes
+/// that were never added (about 0.06% per stage). The filter grows as hashes
+/// are added, by adding a new stage twice the size of the last one once it
+/// is full. Hashes can't be removed; drop the whole filter instead. Not
+/// thread-safe.
+class HashFilter {
+  public:
+    explicit HashFilter(size_t initial_capacity = 1024);
+
+    void add(std::string_view hash);
+
+    bool might_contain(std::string_view hash) const;
+
+    // Number of hashes added
+    size_t size() const { return size_; }
+
+  private:
+    struct Stage {
+        // Bit count is a power of two
+        std::vector<uint64_t> bits;
+        size_t capacity;
+        size_t count = 0;
+    };
+
+    void add_stage(size_t capacity);
+
+    std::vector<Stage> stages_;
+    size_t size_ = 0;
+};
+
+} // namespace oxen
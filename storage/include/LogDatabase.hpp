@@ -0,0 +1,148 @@
+#pragma once
+
+#include "StorageEngine.hpp"
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+namespace oxen {
+
+/// Message store that appends messages to segment files, one per window of
+/// expiration times (`LOG_SEGMENT_WINDOW`), and keeps the hash and owner
+/// indices in memory. As messages are immutable and expire at a fixed time,
+/// nothing is ever deleted from a segment: once the window of a segment has
+/// passed, the whole file is unlinked. Stores are sequential appends and
+/// expiry costs one unlink per segment, with no free pages left behind.
+///
+/// Segments live in `<db_path>/messages` and are read back on startup; a
+/// record torn by a crash at the end of a segment is discarded. Stores are
+/// queued to a sync thread, which appends everything queued and syncs it
+/// with one `fdatasync` per segment before reporting back, so stores only
+/// complete once they are durable and concurrent stores share a sync.
+class LogDatabase : public StorageEngine {
+  public:
+    LogDatabase(boost::asio::io_context& ioc, const std::string& db_path);
+    ~LogDatabase() override;
+
+    bool store(const std::string& hash, const std::string& pubKey,
+               const std::string& bytes, uint64_t ttl, uint64_t timestamp,
+               const std::string& nonce,
+               DuplicateHandling behaviour = DuplicateHandling::FAIL) override;
+
+    // `cb` is invoked on the sync thread once the message has been synced
+    void
+    store_async(storage::Item item, store_callback_t cb,
+                DuplicateHandling behaviour = DuplicateHandling::FAIL) override;
+
+    bool bulk_store(const std::vector<storage::Item>& items) override;
+
+    bool retrieve(const std::string& key, std::vector<storage::Item>& items,
+                  const std::string& lastHash, int num_results = -1) override;
+
+    bool for_each_chunk(const chunk_callback_t& cb,
+                        size_t chunk_size = DEFAULT_DB_CHUNK_SIZE) override;
+
+    bool get_message_count(uint64_t& count) override;
+
+    bool retrieve_random(storage::Item& item) override;
+
+    bool retrieve_by_hash(const std::string& msg_hash,
+                          storage::Item& item) override;
+
+    bool contains(const std::string& msg_hash,
+                  uint64_t expiration_timestamp) override;
+
+    bool is_latest_message(const std::string& pubKey,
+                           const std::string& msg_hash) override;
+
+    // Unlink the segments whose window has passed by `now_ms`
+    void remove_expired(uint64_t now_ms);
+
+  private:
+    struct Segment;
+
+    // Messages to append, and what to report once they are synced (whether
+    // all of them were stored, and whether all of them were new)
+    struct PendingAppend {
+        std::vector<storage::Item> items;
+        DuplicateHandling behaviour;
+        std::function<void(bool success, bool added)> cb;
+    };
+
+    // Where a message is stored; segments stay open (even once unlinked) for
+    // as long as a reader holds on to them
+    struct Location {
+        std::shared_ptr<Segment> segment;
+        uint64_t offset;
+        uint32_t size;
+        uint64_t expiration_timestamp;
+        // Keys of `ids_by_hash_` and `ids_by_owner_`, which are never moved
+        const std::string* hash;
+        const std::string* owner;
+    };
+
+    // Read the existing segments into the indices
+    void load_segments();
+    // Get the segment for messages expiring at `expiration_timestamp`,
+    // creating it if necessary; `mutex_` must be held
+    std::shared_ptr<Segment> get_segment(uint64_t expiration_timestamp);
+    // Append `item` to its segment and index it; `mutex_` must be held.
+    // `added` is set if it was not a duplicate.
+    bool append(const storage::Item& item, DuplicateHandling behaviour,
+                bool& added);
+    // Queue `pending` for the sync thread
+    void enqueue(PendingAppend pending);
+    // Queue `pending` and wait until it has been synced
+    void enqueue_and_wait(PendingAppend pending, bool& success, bool& added);
+    // Body of `sync_thread_`: appends queued messages and syncs them
+    void sync_loop();
+    void sync_batch(std::vector<PendingAppend>& batch);
+    // Sync the segments in `unsynced_`, keeping those that failed queued
+    bool sync_segments();
+    void add_to_index(int64_t id, const std::string& hash,
+                      const std::string& owner, Location location);
+    // Read the messages at `locations`, without holding `mutex_`
+    static bool read_items(const std::vector<Location>& locations,
+                           std::vector<storage::Item>& items);
+
+    void schedule_cleanup();
+
+    const std::string dir_;
+
+    // All messages by id, i.e. in the order they were stored
+    std::map<int64_t, Location> messages_;
+    std::unordered_map<std::string, int64_t> ids_by_hash_;
+    // Ids of each owner's messages, oldest first
+    std::unordered_map<std::string, std::set<int64_t>> ids_by_owner_;
+    // Open segments by window
+    std::map<uint64_t, std::shared_ptr<Segment>> segments_;
+    // Total size of the segments
+    uint64_t size_ = 0;
+    int64_t next_id_ = 1;
+    std::mutex mutex_;
+
+    // Segments appended to since they were last synced; only accessed by the
+    // sync thread, which does all the appends
+    std::vector<std::shared_ptr<Segment>> unsynced_;
+
+    std::vector<PendingAppend> sync_queue_;
+    bool stopping_ = false;
+    std::mutex sync_queue_mutex_;
+    std::condition_variable sync_queue_cv_;
+    std::thread sync_thread_;
+
+    boost::asio::steady_timer cleanup_timer_;
+};
+
+} // namespace oxen
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "StorageEngine.hpp"
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+namespace oxen {
+
+/// Message store that keeps everything in memory, for nodes (and tests) that
+/// don't need messages to survive a restart. Messages are numbered in the
+/// order they are stored and indexed by hash and by owner; expiration times
+/// are kept in a min-heap so that cleanup only touches expired messages.
+class MemoryDatabase : public StorageEngine {
+  public:
+    explicit MemoryDatabase(boost::asio::io_context& ioc);
+    ~MemoryDatabase() override;
+
+    bool store(const std::string& hash, const std::string& pubKey,
+               const std::string& bytes, uint64_t ttl, uint64_t timestamp,
+               const std::string& nonce,
+               DuplicateHandling behaviour = DuplicateHandling::FAIL) override;
+
+    // Stores immediately; `cb` is invoked before this returns
+    void
+    store_async(storage::Item item, store_callback_t cb,
+                DuplicateHandling behaviour = DuplicateHandling::FAIL) override;
+
+    bool bulk_store(const std::vector<storage::Item>& items) override;
+
+    bool retrieve(const std::string& key, std::vector<storage::Item>& items,
+                  const std::string& lastHash, int num_results = -1) override;
+
+    // Messages are copied one chunk at a time, and the lock is not held
+    // while `cb` runs
+    bool for_each_chunk(const chunk_callback_t& cb,
+                        size_t chunk_size = DEFAULT_DB_CHUNK_SIZE) override;
+
+    bool get_message_count(uint64_t& count) override;
+
+    bool retrieve_random(storage::Item& item) override;
+
+    bool retrieve_by_hash(const std::string& msg_hash,
+                          storage::Item& item) override;
+
+    bool contains(const std::string& msg_hash,
+                  uint64_t expiration_timestamp) override;
+
+    bool is_latest_message(const std::string& pubKey,
+                           const std::string& msg_hash) override;
+
+    // Remove messages that have expired by `now_ms`
+    void remove_expired(uint64_t now_ms);
+
+  private:
+    // Store `item` under the next id; `mutex_` must be held
+    bool insert(storage::Item item, DuplicateHandling behaviour);
+
+    void schedule_cleanup();
+
+    // All messages by id, i.e. in the order they were stored
+    std::map<int64_t, storage::Item> messages_;
+    std::unordered_map<std::string, int64_t> ids_by_hash_;
+    // Ids of each owner's messages, oldest first
+    std::unordered_map<std::string, std::set<int64_t>> ids_by_owner_;
+    // (expiration time, id) of every message, earliest first
+    std::priority_queue<std::pair<uint64_t, int64_t>,
+                        std::vector<std::pair<uint64_t, int64_t>>,
+                        std::greater<>>
+        expiries_;
+    int64_t next_id_ = 1;
+    std::mutex mutex_;
+
+    boost::asio::steady_timer cleanup_timer_;
+};
+
+} // namespace oxen
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "Item.hpp"
+
+#include <atomic>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace oxen {
+
+// Default memory budget of `MessageCache`
+constexpr size_t DEFAULT_MESSAGE_CACHE_SIZE = 64 * 1024 * 1024;
+
+/// Keeps the most recent messages of recently active owners in memory, up to
+/// a total size in bytes, so that clients retrieving messages shortly after
+/// they were stored don't need a database query. For every cached owner the
+/// cache holds all (unexpired) messages newer than its oldest cached one, so
+/// any retrieve that continues from a cached message can be answered from the
+/// cache alone. Owners are evicted least recently used first, oldest message
+/// first.
+class MessageCache {
+  public:
+    explicit MessageCache(size_t max_bytes = DEFAULT_MESSAGE_CACHE_SIZE);
+
+    // Add a committed message; it must be newer than every message already
+    // stored for its owner
+    void add(const storage::Item& item);
+
+    // Get up to `num_results` (if non-negative) messages for `pub_key` newer
+    // than the message with `last_hash`. Returns false if that can't be
+    // answered from the cache.
+    bool retrieve(const std::string& pub_key, const std::string& last_hash,
+                  int num_results, std::vector<storage::Item>& items);
+
+    // Drop messages that have expired by `now_ms`
+    void remove_expired(uint64_t now_ms);
+
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+    size_t size_bytes() const;
+
+  private:
+    struct Entry {
+        std::deque<storage::Item> messages;
+        // Position in `lru_`
+        std::list<std::string>::iterator lru_it;
+    };
+
+    // Evict until the cache fits in `max_bytes_`; `mutex_` must be held
+    void evict();
+    void remove_entry(std::unordered_map<std::string, Entry>::iterator it);
+
+    const size_t max_bytes_;
+    size_t bytes_ = 0;
+
+    std::unordered_map<std::string, Entry> entries_;
+    // Owners, most recently used first
+    std::list<std::string> lru_;
+    mutable std::mutex mutex_;
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+};
+
+} // namespace oxen
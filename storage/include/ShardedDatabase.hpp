@@ -0,0 +1,84 @@
+#pragma once
+
+#include "Database.hpp"
+#include "StorageEngine.hpp"
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+namespace oxen {
+
+/// Message store that splits messages across several SQLite databases
+/// (`Database`s) by a hash of the owner's pubkey, so that stores for
+/// different owners are committed in parallel by the shards' own database
+/// threads rather than all waiting on a single writer. All of an owner's
+/// messages are in the same shard, so per-owner operations go to a single
+/// shard and keep their order; counting, sampling and iteration go through
+/// every shard. Lookups by hash alone try each shard in turn.
+///
+/// Shards live in `<db_path>/shards/<index>/storage.db`. The number of shards
+/// can't be changed once messages have been stored, as owners would be looked
+/// for in the wrong shard.
+class ShardedDatabase : public StorageEngine {
+  public:
+    // `cache_size` is the total memory budget of the shards' message caches
+    ShardedDatabase(boost::asio::io_context& ioc, const std::string& db_path,
+                    size_t num_shards,
+                    Database::PayloadFormat payload_format =
+                        Database::PayloadFormat::BASE64,
+                    size_t cache_size = DEFAULT_MESSAGE_CACHE_SIZE);
+
+    bool store(const std::string& hash, const std::string& pubKey,
+               const std::string& bytes, uint64_t ttl, uint64_t timestamp,
+               const std::string& nonce,
+               DuplicateHandling behaviour = DuplicateHandling::FAIL) override;
+
+    void
+    store_async(storage::Item item, store_callback_t cb,
+                DuplicateHandling behaviour = DuplicateHandling::FAIL) override;
+
+    // Stores each shard's items in parallel on `pool_`
+    bool bulk_store(const std::vector<storage::Item>& items) override;
+
+    // With an empty `key`, messages are returned shard by shard
+    bool retrieve(const std::string& key, std::vector<storage::Item>& items,
+                  const std::string& lastHash, int num_results = -1) override;
+
+    // Iterates over the shards one after the other, so messages are only in
+    // insertion order within each shard
+    bool for_each_chunk(const chunk_callback_t& cb,
+                        size_t chunk_size = DEFAULT_DB_CHUNK_SIZE) override;
+
+    bool get_message_count(uint64_t& count) override;
+
+    // Picks a shard with probability proportional to its message count
+    bool retrieve_random(storage::Item& item) override;
+
+    bool retrieve_by_hash(const std::string& msg_hash,
+                          storage::Item& item) override;
+
+    bool contains(const std::string& msg_hash,
+                  uint64_t expiration_timestamp) override;
+
+    bool is_latest_message(const std::string& pubKey,
+                           const std::string& msg_hash) override;
+
+    // Sums the stats of the shards' caches
+    bool get_message_cache_stats(MessageCacheStats& stats) const override;
+
+    size_t num_shards() const { return shards_.size(); }
+
+  private:
+    Database& shard_for(const std::string& pubKey);
+
+    std::vector<std::unique_ptr<Database>> shards_;
+    // Runs `bulk_store` batches of all but one shard (which is stored on the
+    // calling thread); declared after `shards_` so that it is joined first
+    boost::asio::thread_pool pool_;
+};
+
+} // namespace oxen
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "Item.hpp"
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace oxen {
+
+// Default number of messages loaded at a time by `for_each_chunk`
+constexpr size_t DEFAULT_DB_CHUNK_SIZE = 500;
+
+enum class StorageEngineType {
+    SQLITE, // `Database`: persistent, the default
+    LOG,    // `LogDatabase`: append-only segment files
+    MEMORY  // `MemoryDatabase`: nothing survives a restart
+};
+
+/// Interface of message stores. Expired messages are removed by the engine
+/// itself and are never returned, even if they haven't been removed yet.
+/// All methods are safe to call from any thread.
+class StorageEngine {
+  public:
+    virtual ~StorageEngine() = default;
+
+    enum class DuplicateHandling { IGNORE, FAIL };
+
+    virtual bool
+    store(const std::string& hash, const std::string& pubKey,
+          const std::string& bytes, uint64_t ttl, uint64_t timestamp,
+          const std::string& nonce,
+          DuplicateHandling behaviour = DuplicateHandling::FAIL) = 0;
+
+    using store_callback_t = std::function<void(bool)>;
+
+    // Store `item` asynchronously; `cb` is invoked (on an unspecified thread)
+    // once it has been stored with `true` if the item was inserted
+    virtual void
+    store_async(storage::Item item, store_callback_t cb,
+                DuplicateHandling behaviour = DuplicateHandling::FAIL) = 0;
+
+    // Store `items`, ignoring duplicates
+    virtual bool bulk_store(const std::vector<storage::Item>& items) = 0;
+
+    // Get up to `num_results` (if non-negative) unexpired messages for `key`
+    // newer than the one with `lastHash` (all of them if it isn't found), or
+    // all unexpired messages if `key` is empty
+    virtual bool retrieve(const std::string& key,
+                          std::vector<storage::Item>& items,
+                          const std::string& lastHash,
+                          int num_results = -1) = 0;
+
+    // Return false from the callback to stop the iteration early
+    using chunk_callback_t = std::function<bool(std::vector<storage::Item>&)>;
+
+    // Iterate over all unexpired messages in insertion order, `chunk_size`
+    // messages at a time. Returns false on errors.
+    virtual bool for_each_chunk(const chunk_callback_t& cb,
+                                size_t chunk_size = DEFAULT_DB_CHUNK_SIZE) = 0;
+
+    // Return the total number of messages stored (including expired
+    // messages that haven't been cleaned up yet)
+    virtual bool get_message_count(uint64_t& count) = 0;
+
+    // Get a randomly selected unexpired message, return false if there are
+    // none
+    virtual bool retrieve_random(storage::Item& item) = 0;
+
+    // Get message by `msg_hash`, return true if found
+    virtual bool retrieve_by_hash(const std::string& msg_hash,
+                                  storage::Item& item) = 0;
+
+    // Whether a message with `msg_hash`, expiring at `expiration_timestamp`,
+    // is stored (even if it has expired), i.e. storing it again would be a
+    // no-op. Meant to be cheap when it isn't.
+    virtual bool contains(const std::string& msg_hash,
+                          uint64_t expiration_timestamp) = 0;
+
+    // Whether `msg_hash` is the most recent unexpired message for `pubKey`,
+    // i.e. there is nothing newer to retrieve
+    virtual bool is_latest_message(const std::string& pubKey,
+                                   const std::string& msg_hash) = 0;
+
+    struct MessageCacheStats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        size_t bytes = 0;
+    };
+
+    // Get the totals of the engine's caches of recent messages, return false
+    // if it has none
+    virtual bool get_message_cache_stats(MessageCacheStats& stats) const {
+        return false;
+    }
+};
+
+} // namespace oxen
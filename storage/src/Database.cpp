@@ -3,62 +3,293 @@
 #include "utils.hpp"
 
 #include "sqlite3.h"
+#include <algorithm>
 #include <cstdlib>
 #include <exception>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+#include <oxenmq/base64.h>
+#include <oxenmq/hex.h>
 
 namespace oxen {
 using namespace storage;
 
 constexpr auto CLEANUP_PERIOD = std::chrono::seconds(10);
+// How long a connection waits on a lock held by another connection before
+// giving up with SQLITE_BUSY
+constexpr int BUSY_TIMEOUT_MS = 5000;
+// How long the database thread waits for more stores to join a transaction
+// once the first one has been queued
+constexpr auto GROUP_COMMIT_INTERVAL = std::chrono::milliseconds(5);
+// Commit early once this many stores are waiting
+constexpr size_t GROUP_COMMIT_MAX_BATCH = 500;
+// Number of rows moved out of the legacy table per transaction
+constexpr int MIGRATION_CHUNK_SIZE = 1000;
+// Messages are partitioned by expiration time in windows of this length.
+// Every query has to look at all live partitions, so rather than hourly
+// windows these are long enough to keep the count low: with the maximum TTL
+// of 14 days there are at most 29 partitions. Expired messages are kept
+// around for at most this long.
+constexpr uint64_t PARTITION_WINDOW = 12 * 60 * 60 * 1000; // 12 hours in ms
+constexpr const char* PARTITION_PREFIX = "Messages_";
+
+// Columns selected for every message, in the order `extract_item` expects,
+// followed by the rowid. Legacy nonces and payloads were bound as blobs of
+// base64 text.
+constexpr const char* MESSAGE_COLUMNS =
+    "`Hash`, `Owner`, `TTL`, `Timestamp`, `TimeExpires`, `Nonce`, `Data`, "
+    "rowid";
+constexpr const char* LEGACY_COLUMNS =
+    "`Hash`, `Owner`, `TTL`, `Timestamp`, `TimeExpires`, "
+    "CAST(`Nonce` AS TEXT), CAST(`Data` AS TEXT), rowid";
+
+/// Statements used by readers to query one of the message tables
+struct TableStatements {
+    std::string name;
+    // Whether this is the legacy table, which stores hashes and pubkeys as
+    // text
+    bool legacy = false;
+    sqlite3_stmt* get_stmt = nullptr;
+    sqlite3_stmt* get_id_by_hash_stmt = nullptr;
+    sqlite3_stmt* get_by_hash_stmt = nullptr;
+    sqlite3_stmt* get_rowid_range_stmt = nullptr;
+    sqlite3_stmt* get_from_rowid_stmt = nullptr;
+    sqlite3_stmt* get_chunk_stmt = nullptr;
+    sqlite3_stmt* get_by_offset_stmt = nullptr;
+
+    void finalize() {
+        sqlite3_finalize(get_stmt);
+        sqlite3_finalize(get_id_by_hash_stmt);
+        sqlite3_finalize(get_by_hash_stmt);
+        sqlite3_finalize(get_rowid_range_stmt);
+        sqlite3_finalize(get_from_rowid_stmt);
+        sqlite3_finalize(get_chunk_stmt);
+        sqlite3_finalize(get_by_offset_stmt);
+    }
+};
+
+/// A read-only connection along with the statements prepared on it. Every
+/// reader has its own copy of the statements as a prepared statement can only
+/// be used by one thread at a time.
+struct Database::ReadConnection {
+    sqlite3* db = nullptr;
+    // Statements of the tables in `read_tables_` by name, as of
+    // `tables_version`
+    std::map<std::string, TableStatements> tables;
+    uint64_t tables_version = 0;
+    // Only prepared while the legacy table is being migrated
+    std::unique_ptr<TableStatements> legacy;
+
+    ~ReadConnection() {
+        for (auto& [name, table] : tables)
+            table.finalize();
+        if (legacy)
+            legacy->finalize();
+        sqlite3_close(db);
+    }
+};
+
+/// Checks a reader out of the pool for the lifetime of the guard, keeping
+/// the tables it queries from being dropped
+class Database::ReaderGuard {
+    Database& database_;
+    ReadConnection* reader_;
+    std::shared_lock<std::shared_mutex> tables_lock_;
+
+  public:
+    explicit ReaderGuard(Database& database)
+        : database_(database), reader_(database.acquire_reader()),
+          tables_lock_(database.read_tables_mutex_) {
+        database_.sync_tables(*reader_);
+    }
+    ~ReaderGuard() {
+        tables_lock_.unlock();
+        database_.release_reader(reader_);
+    }
+
+    ReaderGuard(const ReaderGuard&) = delete;
+    ReaderGuard& operator=(const ReaderGuard&) = delete;
+
+    ReadConnection* operator->() const { return reader_; }
+
+    // All the tables to query, the legacy table (if any) last
+    std::vector<TableStatements*> tables() const {
+        std::vector<TableStatements*> tables;
+        tables.reserve(reader_->tables.size() + 1);
+        for (auto& [name, table] : reader_->tables)
+            tables.push_back(&table);
+        if (database_.legacy_rows_)
+            tables.push_back(reader_->legacy.get());
+        return tables;
+    }
+};
+
+/// Runs the statements of a reader against a single snapshot of the
+/// database, so that messages stored while the reader goes through the
+/// partitions don't show up out of order, and rows being moved out of the
+/// legacy table are seen exactly once
+class ReadTransaction {
+    sqlite3* db_;
+    bool active_ = false;
+
+  public:
+    ReadTransaction(sqlite3* db, bool needed) : db_(db) {
+        if (needed)
+            active_ =
+                sqlite3_exec(db_, "BEGIN;", NULL, NULL, NULL) == SQLITE_OK;
+    }
+    ~ReadTransaction() {
+        if (active_)
+            sqlite3_exec(db_, "COMMIT;", NULL, NULL, NULL);
+    }
+
+    ReadTransaction(const ReadTransaction&) = delete;
+    ReadTransaction& operator=(const ReadTransaction&) = delete;
+};
+
+/// Hashes and pubkeys are stored as raw bytes, and nonces (and optionally
+/// payloads) base64-decoded, whenever decoding is lossless (i.e. re-encoding
+/// gives back the same string). Anything else is stored as text; the type of
+/// the value tells the two apart when reading.
+struct encoded_t {
+    std::string value;
+    bool binary;
+};
+
+static encoded_t encode_hex(const std::string& str) {
+    if (!str.empty() && oxenmq::is_hex(str)) {
+        auto bytes = oxenmq::from_hex(str);
+        if (oxenmq::to_hex(bytes) == str)
+            return {std::move(bytes), true};
+    }
+    return {str, false};
+}
+
+static encoded_t encode_base64(const std::string& str) {
+    if (!str.empty() && oxenmq::is_base64(str)) {
+        auto bytes = oxenmq::from_base64(str);
+        if (oxenmq::to_base64(bytes) == str)
+            return {std::move(bytes), true};
+    }
+    return {str, false};
+}
+
+// `value` must outlive the execution of the statement
+static void bind_encoded(sqlite3_stmt* stmt, int idx, const encoded_t& value) {
+    if (value.binary)
+        sqlite3_bind_blob(stmt, idx, value.value.data(), value.value.size(),
+                          SQLITE_STATIC);
+    else
+        sqlite3_bind_text(stmt, idx, value.value.data(), value.value.size(),
+                          SQLITE_STATIC);
+}
+
+static std::string column_string(sqlite3_stmt* stmt, int idx) {
+    const auto* data = static_cast<const char*>(sqlite3_column_blob(stmt, idx));
+    if (!data)
+        return {};
+    return std::string(data, sqlite3_column_bytes(stmt, idx));
+}
+
+static std::string column_hex(sqlite3_stmt* stmt, int idx) {
+    if (sqlite3_column_type(stmt, idx) == SQLITE_BLOB)
+        return oxenmq::to_hex(column_string(stmt, idx));
+    return column_string(stmt, idx);
+}
+
+static std::string column_base64(sqlite3_stmt* stmt, int idx) {
+    if (sqlite3_column_type(stmt, idx) == SQLITE_BLOB)
+        return oxenmq::to_base64(column_string(stmt, idx));
+    return column_string(stmt, idx);
+}
 
 Database::~Database() {
-    sqlite3_finalize(save_stmt);
-    sqlite3_finalize(save_or_ignore_stmt);
-    sqlite3_finalize(get_all_for_pk_stmt);
-    sqlite3_finalize(get_all_stmt);
-    sqlite3_finalize(get_stmt);
-    sqlite3_finalize(delete_expired_stmt);
+    // Let the database thread commit whatever is still queued
+    {
+        std::lock_guard lock(write_queue_mutex_);
+        stopping_ = true;
+    }
+    write_queue_cv_.notify_one();
+    if (write_thread_.joinable())
+        write_thread_.join();
+
+    // Readers must be closed before the writer so that the writer, being the
+    // last connection, checkpoints and removes the WAL file
+    readers_.clear();
+    for (auto& [window, partition] : partitions_) {
+        sqlite3_finalize(partition.save_stmt);
+        sqlite3_finalize(partition.save_or_ignore_stmt);
+    }
+    sqlite3_finalize(legacy_get_by_hash_stmt);
+    sqlite3_finalize(legacy_get_chunk_stmt);
+    sqlite3_finalize(legacy_delete_chunk_stmt);
     sqlite3_close(db);
     std::cerr << "~Database\n";
 }
 
-Database::Database(boost::asio::io_context& ioc, const std::string& db_path)
-    : cleanup_timer_(ioc) {
-    open_and_prepare(db_path);
+Database::Database(boost::asio::io_context& ioc, const std::string& db_path,
+                   PayloadFormat payload_format, size_t cache_size,
+                   size_t num_readers)
+    : payload_format_(payload_format), cache_(cache_size),
+      cleanup_timer_(ioc) {
+    open_and_prepare(db_path, std::max<size_t>(num_readers, 1));
 
-    perform_cleanup();
-}
+    write_thread_ = std::thread([this] { write_loop(); });
 
-void Database::perform_cleanup() {
-    const auto now_ms = util::get_time_ms();
+    // The first pass runs on the database thread, so startup doesn't wait for
+    // a large backlog of expired messages to be deleted
+    schedule_cleanup();
+}
 
-    sqlite3_bind_int64(delete_expired_stmt, 1, now_ms);
+Database::ReadConnection* Database::acquire_reader() {
+    std::unique_lock lock(readers_mutex_);
+    reader_available_.wait(lock, [this] { return !idle_readers_.empty(); });
+    ReadConnection* reader = idle_readers_.back();
+    idle_readers_.pop_back();
+    return reader;
+}
 
-    int rc;
-    while (true) {
-        rc = sqlite3_step(delete_expired_stmt);
-        if (rc == SQLITE_BUSY) {
-            continue;
-        } else if (rc == SQLITE_DONE) {
-            break;
-        } else {
-            fprintf(stderr, "Can't delete expired messages: %s\n",
-                    sqlite3_errmsg(db));
-        }
+void Database::release_reader(ReadConnection* reader) {
+    {
+        std::lock_guard lock(readers_mutex_);
+        idle_readers_.push_back(reader);
     }
-    int reset_rc = sqlite3_reset(delete_expired_stmt);
-    // If the most recent call to sqlite3_step(S) for the prepared statement S
-    // indicated an error, then sqlite3_reset(S) returns an appropriate error
-    // code.
-    if (reset_rc != SQLITE_OK && reset_rc != rc) {
-        fprintf(stderr, "sql error: unexpected value from sqlite3_reset");
+    reader_available_.notify_one();
+}
+
+void Database::schedule_cleanup() {
+    {
+        std::lock_guard lock(write_queue_mutex_);
+        cleanup_due_ = true;
     }
+    write_queue_cv_.notify_one();
 
     cleanup_timer_.expires_after(CLEANUP_PERIOD);
-    cleanup_timer_.async_wait(std::bind(&Database::perform_cleanup, this));
+    cleanup_timer_.async_wait([this](const boost::system::error_code& ec) {
+        if (ec != boost::asio::error::operation_aborted)
+            schedule_cleanup();
+    });
 }
 
-sqlite3_stmt* Database::prepare_statement(const std::string& query) {
+void Database::perform_cleanup() {
+    const auto now_ms = util::get_time_ms();
+
+    uint64_t total_deleted;
+    {
+        std::lock_guard lock(write_mutex_);
+        total_deleted = drop_expired_partitions(now_ms);
+    }
+
+    if (total_deleted > 0) {
+        OXEN_LOG(debug, "Removed {} expired messages", total_deleted);
+        remove_expired_heads(now_ms);
+        cache_.remove_expired(now_ms);
+    }
+}
+
+static sqlite3_stmt* prepare_statement(sqlite3* db, const std::string& query) {
     const char* pzTest;
     sqlite3_stmt* stmt;
     int rc = sqlite3_prepare_v2(db, query.c_str(), query.length() + 1, &stmt,
@@ -141,124 +372,530 @@ static void check_page_size(sqlite3* db) {
     }
 }
 
-void Database::open_and_prepare(const std::string& db_path) {
-    const std::string file_path = db_path + "/storage.db";
-    int rc = sqlite3_open_v2(file_path.c_str(), &db,
-                             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
-                                 SQLITE_OPEN_FULLMUTEX,
-                             NULL);
+static void exec_or_throw(sqlite3* db, const char* query,
+                          const char* error) {
+    char* errMsg = nullptr;
+    int rc = sqlite3_exec(db, query, nullptr, nullptr, &errMsg);
+    if (rc) {
+        if (errMsg) {
+            OXEN_LOG(error, "Query error: {}", errMsg);
+            sqlite3_free(errMsg);
+        }
+        throw std::runtime_error(error);
+    }
+}
 
+// Run a query returning a single integer (NULL is returned as 0)
+static int64_t query_int_or_throw(sqlite3* db, const char* query,
+                                  const char* error) {
+    auto cb = [](void* result, int argc, char** argv, char**) -> int {
+        if (argc > 0 && argv[0])
+            *static_cast<int64_t*>(result) = strtoll(argv[0], NULL, 10);
+        return 0;
+    };
+    int64_t result = 0;
+    char* errMsg = nullptr;
+    if (sqlite3_exec(db, query, cb, &result, &errMsg) != SQLITE_OK) {
+        if (errMsg) {
+            OXEN_LOG(error, "Query error: {}", errMsg);
+            sqlite3_free(errMsg);
+        }
+        throw std::runtime_error(error);
+    }
+    return result;
+}
+
+static bool table_exists(sqlite3* db, const char* name) {
+    return query_int_or_throw(
+               db,
+               fmt::format("SELECT count(*) FROM sqlite_master WHERE "
+                           "type = 'table' AND name = '{}';",
+                           name)
+                   .c_str(),
+               "Can't query the database schema") > 0;
+}
+
+static sqlite3* open_connection(const std::string& file_path, int flags) {
+    sqlite3* db = nullptr;
+    int rc = sqlite3_open_v2(file_path.c_str(), &db,
+                             flags | SQLITE_OPEN_NOMUTEX, NULL);
     if (rc) {
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
+        const std::string error =
+            fmt::format("Can't open database: {}", sqlite3_errmsg(db));
         sqlite3_close(db);
-        // throw?
-        return;
+        throw std::runtime_error(error);
     }
 
+    // Rather than spinning on SQLITE_BUSY, let sqlite wait for the lock held
+    // by another connection (e.g. during a WAL checkpoint)
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+
+    return db;
+}
+
+static void prepare_table_statements(sqlite3* db, TableStatements& stmts,
+                                     const char* table, const char* columns) {
+
+    stmts.name = table;
+
+    stmts.get_stmt = prepare_statement(
+        db, fmt::format("SELECT {} FROM `{}` WHERE `Owner` = ? AND rowid > ? "
+                        "AND `TimeExpires` > ? ORDER BY rowid LIMIT ?;",
+                        columns, table));
+    if (!stmts.get_stmt)
+        throw std::runtime_error("could not prepare get statement");
+
+    stmts.get_id_by_hash_stmt = prepare_statement(
+        db, fmt::format("SELECT rowid FROM `{}` WHERE `Hash` = ?;", table));
+    if (!stmts.get_id_by_hash_stmt)
+        throw std::runtime_error("could not prepare get id by hash statement");
+
+    stmts.get_by_hash_stmt = prepare_statement(
+        db, fmt::format("SELECT {} FROM `{}` WHERE `Hash` = ? AND "
+                        "`TimeExpires` > ?;",
+                        columns, table));
+    if (!stmts.get_by_hash_stmt)
+        throw std::runtime_error("could not prepare get by hash statement");
+
+    // Separate subqueries so that each is a single b-tree seek
+    stmts.get_rowid_range_stmt = prepare_statement(
+        db, fmt::format("SELECT (SELECT MIN(rowid) FROM `{0}`), "
+                        "(SELECT MAX(rowid) FROM `{0}`);",
+                        table));
+    if (!stmts.get_rowid_range_stmt)
+        throw std::runtime_error("could not prepare rowid range statement");
+
+    // The unary `+` stops sqlite from using the TimeExpires index instead of
+    // seeking by rowid
+    stmts.get_from_rowid_stmt = prepare_statement(
+        db, fmt::format("SELECT {} FROM `{}` WHERE rowid >= ? AND "
+                        "+`TimeExpires` > ? ORDER BY rowid LIMIT 1;",
+                        columns, table));
+    if (!stmts.get_from_rowid_stmt)
+        throw std::runtime_error("could not prepare get from rowid statement");
+
+    stmts.get_chunk_stmt = prepare_statement(
+        db, fmt::format("SELECT {} FROM `{}` WHERE rowid > ? AND "
+                        "+`TimeExpires` > ? ORDER BY rowid LIMIT ?;",
+                        columns, table));
+    if (!stmts.get_chunk_stmt)
+        throw std::runtime_error("could not prepare get chunk statement");
+
+    // Steps through the rowid index, so no sorting is needed
+    stmts.get_by_offset_stmt = prepare_statement(
+        db, fmt::format("SELECT {} FROM `{}` ORDER BY rowid LIMIT 1 OFFSET ?;",
+                        columns, table));
+    if (!stmts.get_by_offset_stmt)
+        throw std::runtime_error("could not prepare get by offset statement");
+}
+
+void Database::open_and_prepare(const std::string& db_path,
+                                size_t num_readers) {
+    const std::string file_path = db_path + "/storage.db";
+
+    // The writer connection is only ever used by one thread at a time (under
+    // `write_mutex_`), so we don't need sqlite's own serialisation
+    db = open_connection(file_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+
     check_page_size(db);
     set_page_count(db);
 
-    const char* create_table_query =
-        "CREATE TABLE IF NOT EXISTS `Data`("
-        "    `Hash` VARCHAR(128) NOT NULL,"
-        "    `Owner` VARCHAR(256) NOT NULL,"
+    // WAL mode is persistent, so this only changes the journal the first time
+    // the database is opened. Readers then see the last committed state
+    // without waiting for writers (and vice versa).
+    exec_or_throw(db, "PRAGMA journal_mode = WAL;",
+                  "Can't enable WAL journal mode");
+    // In WAL mode NORMAL only syncs on checkpoints, which can lose the most
+    // recent transactions on power loss; keep FULL to not weaken durability
+    exec_or_throw(db, "PRAGMA synchronous = FULL;",
+                  "Can't set synchronous mode");
+
+    // Messages stored by older versions are in the `Data` table
+    int64_t legacy_count = 0;
+    if (table_exists(db, "Data")) {
+        legacy_count = query_int_or_throw(db, "SELECT count(*) FROM `Data`;",
+                                          "Can't count legacy messages");
+        if (legacy_count == 0) {
+            // Migrated by a previous run
+            exec_or_throw(db, "DROP TABLE `Data`;",
+                          "Can't drop the legacy table");
+            OXEN_LOG(info, "Dropped the empty legacy message table");
+        } else {
+            OXEN_LOG(info, "Migrating {} messages to the new database schema",
+                     legacy_count);
+        }
+    }
+    migrating_ = legacy_count > 0;
+    legacy_rows_ = migrating_;
+
+    // Count once at startup; the count is maintained in memory from here on
+    // (`load_partitions` adds the partitioned messages)
+    message_count_ = legacy_count;
+
+    load_partitions();
+
+    if (migrating_) {
+        // Migrated rows keep their rowid, so new messages are numbered after
+        // all of the legacy ones
+        next_id_ = std::max<int64_t>(
+            next_id_,
+            1 + query_int_or_throw(db, "SELECT MAX(rowid) FROM `Data`;",
+                                   "Can't get the last legacy message id"));
+
+        legacy_get_by_hash_stmt = prepare_statement(
+            db, "SELECT rowid FROM `Data` WHERE `Hash` = ?;");
+        if (!legacy_get_by_hash_stmt)
+            throw std::runtime_error(
+                "could not prepare legacy get by hash statement");
+
+        legacy_get_chunk_stmt = prepare_statement(
+            db, fmt::format("SELECT {} FROM `Data` ORDER BY rowid LIMIT ?;",
+                            LEGACY_COLUMNS));
+        if (!legacy_get_chunk_stmt)
+            throw std::runtime_error(
+                "could not prepare legacy get chunk statement");
+
+        legacy_delete_chunk_stmt =
+            prepare_statement(db, "DELETE FROM `Data` WHERE rowid <= ?;");
+        if (!legacy_delete_chunk_stmt)
+            throw std::runtime_error(
+                "could not prepare legacy delete chunk statement");
+    }
+
+    load_heads();
+
+    // Readers are opened after the writer has created the schema
+    for (size_t i = 0; i < num_readers; ++i) {
+        auto reader = std::make_unique<ReadConnection>();
+        reader->db = open_connection(file_path, SQLITE_OPEN_READONLY);
+
+        if (migrating_) {
+            reader->legacy = std::make_unique<TableStatements>();
+            reader->legacy->legacy = true;
+            prepare_table_statements(reader->db, *reader->legacy, "Data",
+                                     LEGACY_COLUMNS);
+        }
+
+        {
+            std::shared_lock lock(read_tables_mutex_);
+            sync_tables(*reader);
+        }
+
+        idle_readers_.push_back(reader.get());
+        readers_.push_back(std::move(reader));
+    }
+
+    OXEN_LOG(info, "Opened database in WAL mode with {} reader connections",
+             num_readers);
+    if (payload_format_ == PayloadFormat::BINARY)
+        OXEN_LOG(info, "Storing message payloads in binary");
+}
+
+static std::string partition_name(uint64_t window) {
+    return PARTITION_PREFIX + std::to_string(window);
+}
+
+void Database::load_partitions() {
+
+    const auto now_ms = util::get_time_ms();
+
+    std::vector<std::string> names;
+    sqlite3_stmt* stmt = prepare_statement(
+        db, "SELECT name FROM sqlite_master WHERE type = 'table' AND "
+            "name LIKE 'Messages\\_%' ESCAPE '\\';");
+    if (!stmt)
+        throw std::runtime_error("could not prepare the partitions statement");
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        names.push_back(column_string(stmt, 0));
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+        throw std::runtime_error("Can't list the message partitions");
+
+    for (const auto& name : names) {
+        const uint64_t window = std::strtoull(
+            name.c_str() + strlen(PARTITION_PREFIX), nullptr, 10);
+
+        if ((window + 1) * PARTITION_WINDOW <= now_ms) {
+            exec_or_throw(db, fmt::format("DROP TABLE `{}`;", name).c_str(),
+                          "Can't drop an expired partition");
+            continue;
+        }
+
+        Partition* partition = create_partition(window);
+        if (!partition)
+            throw std::runtime_error("Can't open partition " + name);
+
+        partition->rows = query_int_or_throw(
+            db, fmt::format("SELECT count(*) FROM `{}`;", name).c_str(),
+            "Can't count messages");
+        message_count_ += partition->rows;
+
+        HashFilter filter(partition->rows);
+        stmt = prepare_statement(
+            db, fmt::format("SELECT `Hash` FROM `{}`;", name));
+        if (!stmt)
+            throw std::runtime_error("could not prepare the hashes statement");
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+            filter.add(column_string(stmt, 0));
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE)
+            throw std::runtime_error("Can't load the hashes of " + name);
+        {
+            std::lock_guard lock(hash_filters_mutex_);
+            hash_filters_.insert_or_assign(window, std::move(filter));
+        }
+
+        next_id_ = std::max<int64_t>(
+            next_id_,
+            1 + query_int_or_throw(
+                    db,
+                    fmt::format("SELECT MAX(rowid) FROM `{}`;", name).c_str(),
+                    "Can't get the last message id"));
+    }
+
+    OXEN_LOG(info, "Loaded {} message partitions", partitions_.size());
+}
+
+Database::Partition* Database::get_partition(uint64_t expiration_timestamp) {
+    const uint64_t window = expiration_timestamp / PARTITION_WINDOW;
+    const auto it = partitions_.find(window);
+    if (it != partitions_.end())
+        return &it->second;
+    return create_partition(window);
+}
+
+Database::Partition* Database::create_partition(uint64_t window) {
+
+    const auto name = partition_name(window);
+
+    // Hash, Owner, Nonce and Data hold either the decoded bytes or, for values
+    // that can't be decoded losslessly (or payloads stored as base64), the
+    // original text. Partitions don't need an index on the expiration time,
+    // as they are dropped as a whole.
+    const auto create_table_query = fmt::format(
+        "CREATE TABLE IF NOT EXISTS `{0}`("
+        "    `id` INTEGER PRIMARY KEY,"
+        "    `Hash` BLOB NOT NULL,"
+        "    `Owner` BLOB NOT NULL,"
         "    `TTL` INTEGER NOT NULL,"
         "    `Timestamp` INTEGER NOT NULL,"
         "    `TimeExpires` INTEGER NOT NULL,"
-        "    `Nonce` VARCHAR(128) NOT NULL,"
+        "    `Nonce` BLOB NOT NULL,"
         "    `Data` BLOB"
         ");"
-        "CREATE UNIQUE INDEX IF NOT EXISTS `idx_data_hash` ON `Data` (`Hash`);"
-        "CREATE INDEX IF NOT EXISTS `idx_data_owner` on `Data` ('Owner');";
+        "CREATE UNIQUE INDEX IF NOT EXISTS `idx_{0}_hash` ON `{0}` (`Hash`);"
+        "CREATE INDEX IF NOT EXISTS `idx_{0}_owner` ON `{0}` (`Owner`);",
+        name);
+
+    char* errmsg = nullptr;
+    if (sqlite3_exec(db, create_table_query.c_str(), nullptr, nullptr,
+                     &errmsg) != SQLITE_OK) {
+        OXEN_LOG(critical, "Can't create partition {}: {}", name,
+                 errmsg ? errmsg : "");
+        sqlite3_free(errmsg);
+        return nullptr;
+    }
 
-    char* errMsg = nullptr;
-    rc = sqlite3_exec(db, create_table_query, nullptr, nullptr, &errMsg);
-    if (rc) {
-        if (errMsg) {
-            printf("%s\n", errMsg);
-            sqlite3_free(errMsg);
-        }
-        throw std::runtime_error("Can't create table");
-    }
-
-    save_stmt = prepare_statement(
-        "INSERT INTO Data "
-        "(Hash, Owner, TTL, Timestamp, TimeExpires, Nonce, Data)"
-        "VALUES (?,?,?,?,?,?,?);");
-    if (!save_stmt)
-        throw std::runtime_error("could not prepare the save statement");
-
-    save_or_ignore_stmt = prepare_statement(
-        "INSERT OR IGNORE INTO Data "
-        "(Hash, Owner, TTL, Timestamp, TimeExpires, Nonce, Data)"
-        "VALUES (?,?,?,?,?,?,?)");
-    if (!save_or_ignore_stmt)
-        throw std::runtime_error("could not prepare the bulk save statement");
-
-    get_all_for_pk_stmt = prepare_statement(
-        "SELECT * FROM Data WHERE `Owner` = ? ORDER BY rowid LIMIT ?;");
-    if (!get_all_for_pk_stmt)
-        throw std::runtime_error(
-            "could not prepare the get all for pk statement");
-
-    get_all_stmt = prepare_statement("SELECT * FROM Data ORDER BY rowid;");
-    if (!get_all_stmt)
-        throw std::runtime_error("could not prepare the get all statement");
-
-    get_stmt =
-        prepare_statement("SELECT * FROM `Data` WHERE `Owner` == ? AND rowid >"
-                          "COALESCE((SELECT `rowid` FROM `Data` WHERE `Hash` = "
-                          "?), 0) ORDER BY rowid LIMIT ?;");
-    if (!get_stmt)
-        throw std::runtime_error("could not prepare get statement");
+    // A message's hash covers its timestamp and TTL, so a duplicate is always
+    // stored in the same partition, where the unique index catches it
+    Partition partition;
+    partition.save_stmt = prepare_statement(
+        db, fmt::format("INSERT INTO `{}` "
+                        "(id, Hash, Owner, TTL, Timestamp, TimeExpires, "
+                        "Nonce, Data) VALUES (?,?,?,?,?,?,?,?);",
+                        name));
+    partition.save_or_ignore_stmt = prepare_statement(
+        db, fmt::format("INSERT OR IGNORE INTO `{}` "
+                        "(id, Hash, Owner, TTL, Timestamp, TimeExpires, "
+                        "Nonce, Data) VALUES (?,?,?,?,?,?,?,?);",
+                        name));
+    if (!partition.save_stmt || !partition.save_or_ignore_stmt) {
+        OXEN_LOG(critical, "Can't prepare the save statements of {}", name);
+        sqlite3_finalize(partition.save_stmt);
+        sqlite3_finalize(partition.save_or_ignore_stmt);
+        return nullptr;
+    }
 
-    get_row_count_stmt = prepare_statement("SELECT count(*) FROM `Data`;");
-    if (!get_row_count_stmt)
-        throw std::runtime_error("could not prepare row count statement");
+    {
+        std::unique_lock lock(read_tables_mutex_);
+        read_tables_.push_back(name);
+        ++read_tables_version_;
+    }
+    {
+        std::lock_guard lock(hash_filters_mutex_);
+        hash_filters_.try_emplace(window);
+    }
 
-    get_by_index_stmt = prepare_statement("SELECT * FROM `Data` LIMIT ?, 1;");
-    if (!get_by_index_stmt)
-        throw std::runtime_error("could not prepare get by index statement");
+    OXEN_LOG(debug, "Created message partition {}", name);
 
-    get_by_hash_stmt =
-        prepare_statement("SELECT * FROM `Data` WHERE `Hash` = ?;");
-    if (!get_by_hash_stmt)
-        throw std::runtime_error("could not prepare get by hash statement");
+    return &partitions_.emplace(window, partition).first->second;
+}
 
-    delete_expired_stmt =
-        prepare_statement("DELETE FROM `Data` WHERE `TimeExpires` <= ?");
-    if (!delete_expired_stmt)
-        throw std::runtime_error(
-            "could not prepare 'delete expired' statement");
+void Database::count_partition_row(uint64_t expiration_timestamp) {
+    const auto it = partitions_.find(expiration_timestamp / PARTITION_WINDOW);
+    if (it != partitions_.end())
+        ++it->second.rows;
 }
 
-bool Database::get_message_count(uint64_t& count) {
+uint64_t Database::drop_expired_partitions(uint64_t now_ms) {
 
-    int rc;
-    bool success = false;
-    while (true) {
-        rc = sqlite3_step(get_row_count_stmt);
-        if (rc == SQLITE_BUSY) {
-            continue;
-        } else if (rc == SQLITE_DONE) {
-            break;
-        } else if (rc == SQLITE_ROW) {
-            count = sqlite3_column_int64(get_row_count_stmt, 0);
-            success = true;
+    uint64_t dropped = 0;
+
+    while (!partitions_.empty() &&
+           (partitions_.begin()->first + 1) * PARTITION_WINDOW <= now_ms) {
+        const auto it = partitions_.begin();
+        const auto name = partition_name(it->first);
+
+        sqlite3_finalize(it->second.save_stmt);
+        sqlite3_finalize(it->second.save_or_ignore_stmt);
+
+        {
+            // Waits for the readers that might be querying the partition
+            std::unique_lock lock(read_tables_mutex_);
+            read_tables_.erase(
+                std::remove(read_tables_.begin(), read_tables_.end(), name),
+                read_tables_.end());
+            ++read_tables_version_;
+
+            // If this fails, the partition is dropped on the next startup
+            if (sqlite3_exec(db,
+                             fmt::format("DROP TABLE `{}`;", name).c_str(),
+                             nullptr, nullptr, nullptr) != SQLITE_OK)
+                OXEN_LOG(error, "Can't drop partition {}: {}", name,
+                         sqlite3_errmsg(db));
+        }
+
+        {
+            std::lock_guard lock(hash_filters_mutex_);
+            hash_filters_.erase(it->first);
+        }
+
+        OXEN_LOG(debug, "Dropped message partition {} ({} messages)", name,
+                 it->second.rows);
+        message_count_ -= it->second.rows;
+        dropped += it->second.rows;
+        partitions_.erase(it);
+    }
+
+    return dropped;
+}
+
+void Database::sync_tables(ReadConnection& reader) {
+
+    if (reader.tables_version == read_tables_version_)
+        return;
+
+    for (auto it = reader.tables.begin(); it != reader.tables.end();) {
+        if (std::find(read_tables_.begin(), read_tables_.end(), it->first) ==
+            read_tables_.end()) {
+            it->second.finalize();
+            it = reader.tables.erase(it);
         } else {
-            OXEN_LOG(critical, "Could not execute `count` db statement");
-            break;
+            ++it;
         }
     }
 
-    rc = sqlite3_reset(get_by_index_stmt);
-    if (rc != SQLITE_OK) {
-        OXEN_LOG(critical, "sqlite reset error: [{}], {}", rc,
-                 sqlite3_errmsg(db));
-        success = false;
+    for (const auto& name : read_tables_) {
+        if (reader.tables.count(name))
+            continue;
+        TableStatements stmts;
+        try {
+            prepare_table_statements(reader.db, stmts, name.c_str(),
+                                     MESSAGE_COLUMNS);
+        } catch (const std::exception& e) {
+            OXEN_LOG(critical, "{} ({})", e.what(), name);
+            stmts.finalize();
+            // Try again on the next read
+            return;
+        }
+        reader.tables.emplace(name, stmts);
     }
 
-    return success;
+    reader.tables_version = read_tables_version_;
+}
+
+void Database::load_heads() {
+
+    // Along with the rowid, to pick the latest of both tables while legacy
+    // messages are being migrated
+    std::unordered_map<std::string, std::pair<int64_t, OwnerHead>> latest;
+
+    std::vector<std::string> tables = read_tables_;
+    if (migrating_)
+        tables.push_back("Data");
+
+    for (const auto& table : tables) {
+        // With MAX(), sqlite takes the other columns from the same row
+        sqlite3_stmt* stmt = prepare_statement(
+            db, fmt::format("SELECT `Owner`, `Hash`, `TimeExpires`, "
+                            "MAX(rowid) FROM `{}` GROUP BY `Owner`;",
+                            table));
+        if (!stmt)
+            throw std::runtime_error(
+                "could not prepare the latest messages statement");
+
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const int64_t rowid = sqlite3_column_int64(stmt, 3);
+            auto& entry = latest[column_hex(stmt, 0)];
+            if (rowid > entry.first) {
+                entry.first = rowid;
+                entry.second = {column_hex(stmt, 1),
+                                static_cast<uint64_t>(
+                                    sqlite3_column_int64(stmt, 2))};
+            }
+        }
+        sqlite3_finalize(stmt);
+
+        if (rc != SQLITE_DONE)
+            throw std::runtime_error("Can't load the latest messages");
+    }
+
+    std::lock_guard lock(heads_mutex_);
+    heads_.reserve(latest.size());
+    for (auto& [owner, entry] : latest)
+        heads_.emplace(owner, std::move(entry.second));
+}
+
+void Database::update_head(const std::string& pubKey, const std::string& hash,
+                           uint64_t expiration_timestamp) {
+    std::lock_guard lock(heads_mutex_);
+    heads_[pubKey] = {hash, expiration_timestamp};
+}
+
+void Database::remove_expired_heads(uint64_t now_ms) {
+    std::lock_guard lock(heads_mutex_);
+    for (auto it = heads_.begin(); it != heads_.end();) {
+        if (it->second.expiration_timestamp <= now_ms)
+            it = heads_.erase(it);
+        else
+            ++it;
+    }
+}
+
+bool Database::is_latest_message(const std::string& pubKey,
+                                 const std::string& msg_hash) {
+    const auto now_ms = util::get_time_ms();
+
+    std::lock_guard lock(heads_mutex_);
+    const auto it = heads_.find(pubKey);
+    // Once the latest message has expired, older ones might still be there
+    // for clients to retrieve
+    return it != heads_.end() && it->second.hash == msg_hash &&
+           it->second.expiration_timestamp > now_ms;
+}
+
+bool Database::get_message_count(uint64_t& count) {
+    count = message_count_;
+    return true;
+}
+
+bool Database::get_message_cache_stats(MessageCacheStats& stats) const {
+    stats.hits = cache_.hits();
+    stats.misses = cache_.misses();
+    stats.bytes = cache_.size_bytes();
+    return true;
 }
 
 /// Extract item from the result of a successfull select statement execution
@@ -268,43 +905,102 @@ static Item extract_item(sqlite3_stmt* stmt) {
 
     // "If the SQL statement does not currently point to a valid row, or if the
     // column index is out of range, the result is undefined"
-    item.hash = std::string((const char*)sqlite3_column_text(stmt, 0));
-    item.pub_key = std::string((const char*)sqlite3_column_text(stmt, 1));
+    item.hash = column_hex(stmt, 0);
+    item.pub_key = column_hex(stmt, 1);
     item.ttl = sqlite3_column_int64(stmt, 2);
     item.timestamp = sqlite3_column_int64(stmt, 3);
     item.expiration_timestamp = sqlite3_column_int64(stmt, 4);
-    item.nonce = std::string((const char*)sqlite3_column_text(stmt, 5));
-    item.data = std::string((char*)sqlite3_column_blob(stmt, 6),
-                            sqlite3_column_bytes(stmt, 6));
+    item.nonce = column_base64(stmt, 5);
+    item.data = column_base64(stmt, 6);
     return item;
 }
 
-bool Database::retrieve_by_index(uint64_t index, Item& item) {
+// Messages along with their rowid, in rowid order
+using message_rows_t = std::vector<std::pair<int64_t, Item>>;
+
+/// Run a statement selecting `MESSAGE_COLUMNS` (or `LEGACY_COLUMNS`),
+/// appending every row to `rows`
+static bool collect_rows(sqlite3_stmt* stmt, sqlite3* db,
+                         message_rows_t& rows) {
+
+    bool success = false;
+
+    while (true) {
+        int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_DONE) {
+            success = true;
+            break;
+        } else if (rc == SQLITE_ROW) {
+            rows.emplace_back(sqlite3_column_int64(stmt, 7),
+                              extract_item(stmt));
+        } else {
+            OXEN_LOG(critical, "Could not execute `{}` db statement, ec: {}",
+                     sqlite3_sql(stmt), rc);
+            break;
+        }
+    }
+
+    int rc = sqlite3_reset(stmt);
+    if (rc != SQLITE_OK) {
+        OXEN_LOG(critical, "sqlite reset error: [{}], {}", rc,
+                 sqlite3_errmsg(db));
+        success = false;
+    }
+    return success;
+}
+
+/// Merge the rows read from another table into `rows`, keeping the first
+/// `limit` (if not negative)
+static void merge_rows(message_rows_t& rows, message_rows_t& table_rows,
+                       int64_t limit) {
+    if (rows.empty()) {
+        rows = std::move(table_rows);
+    } else if (!table_rows.empty()) {
+        message_rows_t merged;
+        merged.reserve(rows.size() + table_rows.size());
+        std::merge(std::make_move_iterator(rows.begin()),
+                   std::make_move_iterator(rows.end()),
+                   std::make_move_iterator(table_rows.begin()),
+                   std::make_move_iterator(table_rows.end()),
+                   std::back_inserter(merged),
+                   [](const auto& a, const auto& b) {
+                       return a.first < b.first;
+                   });
+        rows = std::move(merged);
+    }
+    if (limit >= 0 && rows.size() > static_cast<size_t>(limit))
+        rows.resize(limit);
+}
+
+/// Look up the rowid of the message with `hash`, leaving `rowid` unchanged
+/// if there is none; returns false on database errors
+static bool get_rowid_by_hash(sqlite3_stmt* stmt, sqlite3* db,
+                              const encoded_t& hash, int64_t& rowid) {
 
-    sqlite3_bind_int64(get_by_index_stmt, 1, index);
+    bind_encoded(stmt, 1, hash);
 
     bool success = false;
     int rc;
     while (true) {
-        rc = sqlite3_step(get_by_index_stmt);
+        rc = sqlite3_step(stmt);
         if (rc == SQLITE_BUSY) {
             continue;
         } else if (rc == SQLITE_DONE) {
-            // Note that if the index is out of bounds, we will get here
-            // returning an empty Item
+            success = true;
             break;
         } else if (rc == SQLITE_ROW) {
-            item = extract_item(get_by_index_stmt);
+            rowid = sqlite3_column_int64(stmt, 0);
             success = true;
             break;
         } else {
             OXEN_LOG(critical,
-                     "Could not execute `retrieve by index` db statement");
+                     "Could not execute `rowid by hash` db statement, ec: {}",
+                     rc);
             break;
         }
     }
 
-    rc = sqlite3_reset(get_by_index_stmt);
+    rc = sqlite3_reset(stmt);
     if (rc != SQLITE_OK) {
         OXEN_LOG(critical, "sqlite reset error: [{}], {}", rc,
                  sqlite3_errmsg(db));
@@ -314,39 +1010,217 @@ bool Database::retrieve_by_index(uint64_t index, Item& item) {
     return success;
 }
 
-bool Database::retrieve_by_hash(const std::string& msg_hash, Item& item) {
+/// Get the smallest and largest rowid of a table; returns false if the table
+/// is empty or on database errors
+static bool get_rowid_range(sqlite3_stmt* stmt, sqlite3* db,
+                            int64_t& min_rowid, int64_t& max_rowid) {
 
-    sqlite3_bind_text(get_by_hash_stmt, 1, msg_hash.c_str(), -1, SQLITE_STATIC);
-
-    bool success = false;
+    bool found = false;
     int rc;
     while (true) {
-        rc = sqlite3_step(get_by_hash_stmt);
+        rc = sqlite3_step(stmt);
         if (rc == SQLITE_BUSY) {
             continue;
         } else if (rc == SQLITE_DONE) {
             break;
         } else if (rc == SQLITE_ROW) {
-            item = extract_item(get_by_hash_stmt);
-            success = true;
-            break;
+            // MIN()/MAX() of an empty table are NULL
+            if (sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+                min_rowid = sqlite3_column_int64(stmt, 0);
+                max_rowid = sqlite3_column_int64(stmt, 1);
+                found = true;
+            }
         } else {
-            OXEN_LOG(
-                critical,
-                "Could not execute `retrieve by hash` db statement, ec: {}",
-                rc);
+            OXEN_LOG(critical, "Could not execute `rowid range` db statement");
             break;
         }
     }
 
-    rc = sqlite3_reset(get_by_hash_stmt);
+    rc = sqlite3_reset(stmt);
     if (rc != SQLITE_OK) {
         OXEN_LOG(critical, "sqlite reset error: [{}], {}", rc,
                  sqlite3_errmsg(db));
-        success = false;
+        found = false;
     }
 
-    return success;
+    return found;
+}
+
+bool Database::retrieve_by_index(uint64_t index, Item& item) {
+
+    // Find the table holding `index` from the row counts, taking partitions
+    // in window order and then the legacy table. The counts might be a
+    // little ahead of or behind the reader's snapshot, in which case we get
+    // a neighbouring row (or none, at the very end).
+    std::string name;
+    bool legacy = false;
+    uint64_t offset = index;
+    {
+        std::lock_guard lock(write_mutex_);
+        uint64_t partitioned_rows = 0;
+        for (const auto& [window, partition] : partitions_) {
+            if (name.empty()) {
+                if (offset < partition.rows)
+                    name = partition_name(window);
+                else
+                    offset -= partition.rows;
+            }
+            partitioned_rows += partition.rows;
+        }
+        // The legacy table holds the rest
+        if (name.empty()) {
+            if (!legacy_rows_ || offset >= message_count_ - partitioned_rows)
+                return false;
+            legacy = true;
+        }
+    }
+
+    ReaderGuard reader(*this);
+    TableStatements* table = nullptr;
+    if (legacy) {
+        if (legacy_rows_)
+            table = reader->legacy.get();
+    } else {
+        const auto it = reader->tables.find(name);
+        if (it != reader->tables.end())
+            table = &it->second;
+    }
+    // Dropped or migrated in the meantime
+    if (!table)
+        return false;
+
+    sqlite3_stmt* stmt = table->get_by_offset_stmt;
+    sqlite3_bind_int64(stmt, 1, offset);
+
+    message_rows_t rows;
+    if (!collect_rows(stmt, reader->db, rows) || rows.empty())
+        return false;
+
+    item = std::move(rows.front().second);
+    return true;
+}
+
+bool Database::retrieve_random(Item& item) {
+
+    ReaderGuard reader(*this);
+    const auto tables = reader.tables();
+    ReadTransaction txn(reader->db, tables.size() > 1);
+
+    // Rows are sampled by picking a random rowid between the smallest and
+    // largest one and seeking to the first row at or after it. Rowids are
+    // mostly contiguous, as rows are appended and expire roughly in order,
+    // so this is close to uniform without needing a count or an offset scan.
+    int64_t min_rowid = std::numeric_limits<int64_t>::max();
+    int64_t max_rowid = std::numeric_limits<int64_t>::min();
+    bool found = false;
+
+    for (auto* table : tables) {
+        int64_t min, max;
+        if (get_rowid_range(table->get_rowid_range_stmt, reader->db, min,
+                            max)) {
+            min_rowid = std::min(min_rowid, min);
+            max_rowid = std::max(max_rowid, max);
+            found = true;
+        }
+    }
+
+    if (!found)
+        return false;
+
+    const int64_t start = min_rowid + util::uniform_distribution_portable(
+                                          max_rowid - min_rowid + 1);
+
+    // If every row from `start` onwards has expired, wrap around to the first
+    for (const int64_t rowid : {start, min_rowid}) {
+        message_rows_t rows;
+        for (auto* table : tables) {
+            sqlite3_stmt* stmt = table->get_from_rowid_stmt;
+            sqlite3_bind_int64(stmt, 1, rowid);
+            sqlite3_bind_int64(stmt, 2, util::get_time_ms());
+            if (!collect_rows(stmt, reader->db, rows))
+                return false;
+        }
+
+        if (!rows.empty()) {
+            // Take the closest row of any table
+            auto it = std::min_element(
+                rows.begin(), rows.end(),
+                [](const auto& a, const auto& b) { return a.first < b.first; });
+            item = std::move(it->second);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Database::retrieve_by_hash(const std::string& msg_hash, Item& item) {
+
+    ReaderGuard reader(*this);
+    const auto tables = reader.tables();
+    ReadTransaction txn(reader->db, tables.size() > 1);
+
+    const auto hash = encode_hex(msg_hash);
+    // Legacy hashes are stored as text
+    const encoded_t legacy_hash{msg_hash, false};
+    const auto now_ms = util::get_time_ms();
+
+    message_rows_t rows;
+
+    for (auto* table : tables) {
+        sqlite3_stmt* stmt = table->get_by_hash_stmt;
+        bind_encoded(stmt, 1, table->legacy ? legacy_hash : hash);
+        sqlite3_bind_int64(stmt, 2, now_ms);
+        if (!collect_rows(stmt, reader->db, rows))
+            return false;
+        if (!rows.empty())
+            break;
+    }
+
+    if (rows.empty())
+        return false;
+
+    item = std::move(rows.front().second);
+    return true;
+}
+
+bool Database::contains(const std::string& msg_hash,
+                        uint64_t expiration_timestamp) {
+
+    // A message's hash covers its expiration time, so it can only be in the
+    // partition of that time (or in the legacy table)
+    const uint64_t window = expiration_timestamp / PARTITION_WINDOW;
+    const auto hash = encode_hex(msg_hash);
+
+    bool in_partition;
+    {
+        std::lock_guard lock(hash_filters_mutex_);
+        const auto it = hash_filters_.find(window);
+        in_partition =
+            it != hash_filters_.end() && it->second.might_contain(hash.value);
+    }
+    if (!in_partition && !legacy_rows_)
+        return false;
+
+    ReaderGuard reader(*this);
+    const encoded_t legacy_hash{msg_hash, false};
+    const auto partition = partition_name(window);
+
+    for (auto* table : reader.tables()) {
+        const bool is_partition =
+            table->name.compare(0, strlen(PARTITION_PREFIX),
+                                PARTITION_PREFIX) == 0;
+        if (is_partition && (!in_partition || table->name != partition))
+            continue;
+        int64_t rowid = 0;
+        // On errors, leave it to the insert to catch duplicates
+        if (!get_rowid_by_hash(table->get_id_by_hash_stmt, reader->db,
+                               table->legacy ? legacy_hash : hash, rowid))
+            return false;
+        if (rowid != 0)
+            return true;
+    }
+    return false;
 }
 
 bool Database::store(const std::string& hash, const std::string& pubKey,
@@ -354,20 +1228,75 @@ bool Database::store(const std::string& hash, const std::string& pubKey,
                      const std::string& nonce,
                      DuplicateHandling duplicateHandling) {
 
+    std::lock_guard lock(write_mutex_);
+    bool added = false;
+    const bool inserted = insert(hash, pubKey, bytes, ttl, timestamp, nonce,
+                                 duplicateHandling, added);
+    if (added) {
+        ++message_count_;
+        count_partition_row(timestamp + ttl);
+        update_head(pubKey, hash, timestamp + ttl);
+        cache_.add(Item{hash, pubKey, timestamp, ttl, timestamp + ttl, nonce,
+                        bytes});
+    }
+    return inserted;
+}
+
+bool Database::is_legacy_hash(const std::string& hash) {
+    int64_t rowid = 0;
+    if (legacy_rows_)
+        get_rowid_by_hash(legacy_get_by_hash_stmt, db, {hash, false}, rowid);
+    return rowid != 0;
+}
+
+bool Database::insert(const std::string& hash, const std::string& pubKey,
+                      const std::string& bytes, uint64_t ttl,
+                      uint64_t timestamp, const std::string& nonce,
+                      DuplicateHandling duplicateHandling, bool& added) {
+
+    // Hashes must be unique across all tables
+    if (is_legacy_hash(hash)) {
+        added = false;
+        return duplicateHandling == DuplicateHandling::IGNORE;
+    }
+
+    return insert_row(next_id_++, hash, pubKey, bytes, ttl, timestamp, nonce,
+                      duplicateHandling, added);
+}
+
+bool Database::insert_row(int64_t id, const std::string& hash,
+                          const std::string& pubKey, const std::string& bytes,
+                          uint64_t ttl, uint64_t timestamp,
+                          const std::string& nonce,
+                          DuplicateHandling duplicateHandling, bool& added) {
+
     const auto exp_time = timestamp + ttl;
 
+    added = false;
+    Partition* partition = get_partition(exp_time);
+    if (!partition)
+        return false;
+
     sqlite3_stmt* stmt = duplicateHandling == DuplicateHandling::IGNORE
-                             ? save_or_ignore_stmt
-                             : save_stmt;
+                             ? partition->save_or_ignore_stmt
+                             : partition->save_stmt;
+
+    const auto hash_enc = encode_hex(hash);
+    const auto owner_enc = encode_hex(pubKey);
+    const auto nonce_enc = encode_base64(nonce);
+    const auto data_enc = payload_format_ == PayloadFormat::BINARY
+                              ? encode_base64(bytes)
+                              : encoded_t{bytes, false};
 
     // TODO: bind can return errors, handle them
-    sqlite3_bind_text(stmt, 1, hash.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, pubKey.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_int64(stmt, 3, ttl);
-    sqlite3_bind_int64(stmt, 4, timestamp);
-    sqlite3_bind_int64(stmt, 5, exp_time);
-    sqlite3_bind_blob(stmt, 6, nonce.data(), nonce.size(), SQLITE_STATIC);
-    sqlite3_bind_blob(stmt, 7, bytes.data(), bytes.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 1, id);
+    bind_encoded(stmt, 2, hash_enc);
+    bind_encoded(stmt, 3, owner_enc);
+    sqlite3_bind_int64(stmt, 4, ttl);
+    sqlite3_bind_int64(stmt, 5, timestamp);
+    sqlite3_bind_int64(stmt, 6, exp_time);
+    bind_encoded(stmt, 7, nonce_enc);
+    bind_encoded(stmt, 8, data_enc);
 
     // keep track of db full errorss so we don't print them on every store
     static int db_full_counter = 0;
@@ -384,6 +1313,12 @@ bool Database::store(const std::string& hash, const std::string& pubKey,
             break;
         } else if (rc == SQLITE_DONE) {
             result = true;
+            // INSERT OR IGNORE succeeds for duplicates without adding a row
+            added = sqlite3_changes(db) > 0;
+            if (added) {
+                std::lock_guard lock(hash_filters_mutex_);
+                hash_filters_[exp_time / PARTITION_WINDOW].add(hash_enc.value);
+            }
             break;
         } else if (rc == SQLITE_FULL) {
             if (db_full_counter % DB_FULL_FREQUENCY == 0) {
@@ -406,24 +1341,276 @@ bool Database::store(const std::string& hash, const std::string& pubKey,
     return result;
 }
 
+bool Database::migrate_chunk() {
+
+    const auto now_ms = util::get_time_ms();
+
+    std::lock_guard lock(write_mutex_);
+
+    message_rows_t rows;
+    sqlite3_bind_int64(legacy_get_chunk_stmt, 1, MIGRATION_CHUNK_SIZE);
+    if (!collect_rows(legacy_get_chunk_stmt, db, rows)) {
+        // Rather than retrying in a loop, carry on on the next startup
+        OXEN_LOG(error, "Could not read legacy messages, pausing migration");
+        return false;
+    }
+
+    if (rows.empty()) {
+        // The legacy table is dropped on the next startup
+        legacy_rows_ = false;
+        OXEN_LOG(info, "Finished migrating messages to the new schema");
+        return false;
+    }
+
+    for (const auto& row : rows) {
+        if (row.second.expiration_timestamp > now_ms &&
+            !get_partition(row.second.expiration_timestamp))
+            return false;
+    }
+
+    char* errmsg = nullptr;
+    if (sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, &errmsg) !=
+        SQLITE_OK) {
+        OXEN_LOG(error, "Could not begin migration transaction: {}",
+                 errmsg ? errmsg : "");
+        sqlite3_free(errmsg);
+        return false;
+    }
+
+    uint64_t dropped = 0;
+    std::vector<uint64_t> moved_expiries;
+    bool success = true;
+    for (const auto& [rowid, item] : rows) {
+        // No point in moving expired messages
+        if (item.expiration_timestamp <= now_ms) {
+            ++dropped;
+            continue;
+        }
+        bool added = false;
+        if (!insert_row(rowid, item.hash, item.pub_key, item.data, item.ttl,
+                        item.timestamp, item.nonce, DuplicateHandling::IGNORE,
+                        added)) {
+            success = false;
+            break;
+        }
+        if (added)
+            moved_expiries.push_back(item.expiration_timestamp);
+        else
+            ++dropped;
+    }
+
+    if (success) {
+        sqlite3_bind_int64(legacy_delete_chunk_stmt, 1, rows.back().first);
+        int rc;
+        while ((rc = sqlite3_step(legacy_delete_chunk_stmt)) == SQLITE_BUSY)
+            ;
+        success = rc == SQLITE_DONE;
+        sqlite3_reset(legacy_delete_chunk_stmt);
+    }
+
+    if (!success || sqlite3_exec(db, "COMMIT TRANSACTION;", NULL, NULL,
+                                 NULL) != SQLITE_OK) {
+        OXEN_LOG(error, "Could not migrate legacy messages: {}",
+                 sqlite3_errmsg(db));
+        if (!sqlite3_get_autocommit(db))
+            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        return false;
+    }
+
+    message_count_ -= dropped;
+    for (const uint64_t expiration_timestamp : moved_expiries)
+        count_partition_row(expiration_timestamp);
+
+    OXEN_LOG(debug, "Migrated {} legacy messages", rows.size() - dropped);
+
+    return true;
+}
+
+void Database::store_async(Item item, store_callback_t cb,
+                           DuplicateHandling behaviour) {
+    size_t queued;
+    {
+        std::lock_guard lock(write_queue_mutex_);
+        write_queue_.push_back({std::move(item), behaviour, std::move(cb)});
+        queued = write_queue_.size();
+    }
+    // The database thread only needs waking for the first store of a batch
+    // (to start the commit interval) or to commit a full batch early
+    if (queued == 1 || queued >= GROUP_COMMIT_MAX_BATCH)
+        write_queue_cv_.notify_one();
+}
+
+void Database::write_loop() {
+
+    std::vector<PendingStore> batch;
+
+    while (true) {
+        bool cleanup = false;
+        bool stopping = false;
+        {
+            std::unique_lock lock(write_queue_mutex_);
+            write_queue_cv_.wait(lock, [this] {
+                return stopping_ || cleanup_due_ || migrating_ ||
+                       !write_queue_.empty();
+            });
+            if (stopping_ && write_queue_.empty())
+                return;
+
+            if (!write_queue_.empty()) {
+                // Give concurrent stores a chance to join this transaction
+                write_queue_cv_.wait_for(lock, GROUP_COMMIT_INTERVAL, [this] {
+                    return stopping_ ||
+                           write_queue_.size() >= GROUP_COMMIT_MAX_BATCH;
+                });
+
+                const auto end =
+                    write_queue_.begin() +
+                    std::min(write_queue_.size(), GROUP_COMMIT_MAX_BATCH);
+                batch.assign(std::make_move_iterator(write_queue_.begin()),
+                             std::make_move_iterator(end));
+                write_queue_.erase(write_queue_.begin(), end);
+            }
+
+            stopping = stopping_;
+            cleanup = std::exchange(cleanup_due_, false) && !stopping;
+        }
+
+        if (!batch.empty()) {
+            commit_batch(batch);
+            batch.clear();
+        }
+
+        if (cleanup)
+            perform_cleanup();
+
+        // Legacy messages are moved a chunk at a time in between the other
+        // work, so stores are never held up by more than one chunk
+        if (migrating_ && !stopping)
+            migrating_ = migrate_chunk();
+    }
+}
+
+void Database::commit_batch(std::vector<PendingStore>& batch) {
+
+    std::vector<bool> results(batch.size(), false);
+    // Indices of the stores that added a message
+    std::vector<size_t> added_indices;
+
+    {
+        std::lock_guard lock(write_mutex_);
+
+        for (const auto& store : batch)
+            get_partition(store.item.timestamp + store.item.ttl);
+
+        char* errmsg = nullptr;
+        if (sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, &errmsg) !=
+            SQLITE_OK) {
+            OXEN_LOG(critical, "Could not begin store transaction: {}",
+                     errmsg ? errmsg : "");
+            sqlite3_free(errmsg);
+        } else {
+            for (size_t i = 0; i < batch.size(); ++i) {
+                const auto& item = batch[i].item;
+                bool added = false;
+                results[i] = insert(item.hash, item.pub_key, item.data,
+                                    item.ttl, item.timestamp, item.nonce,
+                                    batch[i].behaviour, added);
+                if (added)
+                    added_indices.push_back(i);
+            }
+
+            if (sqlite3_exec(db, "COMMIT TRANSACTION;", NULL, NULL,
+                             &errmsg) != SQLITE_OK) {
+                OXEN_LOG(critical, "Could not commit {} stores: {}",
+                         batch.size(), errmsg ? errmsg : "");
+                sqlite3_free(errmsg);
+                // Some errors (e.g. SQLITE_FULL) roll back automatically
+                if (!sqlite3_get_autocommit(db))
+                    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+                std::fill(results.begin(), results.end(), false);
+                added_indices.clear();
+            }
+        }
+
+        // Only count messages once they are committed. Heads are updated
+        // under the lock too, so that `bulk_store` can't slip a newer head
+        // in before an older one of ours.
+        message_count_ += added_indices.size();
+        for (const size_t i : added_indices) {
+            const auto& item = batch[i].item;
+            count_partition_row(item.timestamp + item.ttl);
+            update_head(item.pub_key, item.hash, item.timestamp + item.ttl);
+            cache_.add(item);
+        }
+    }
+
+    OXEN_LOG(trace, "Committed {} queued stores", batch.size());
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (!batch[i].cb)
+            continue;
+        try {
+            batch[i].cb(results[i]);
+        } catch (const std::exception& e) {
+            OXEN_LOG(error, "Exception in store callback: {}", e.what());
+        }
+    }
+}
+
 bool Database::bulk_store(const std::vector<Item>& items) {
-    char* errmsg = 0;
+
+    std::lock_guard lock(write_mutex_);
+
+    for (const auto& item : items)
+        get_partition(item.timestamp + item.ttl);
+
+    char* errmsg = nullptr;
     if (sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, &errmsg) !=
         SQLITE_OK) {
+        OXEN_LOG(critical, "Could not begin bulk store transaction: {}",
+                 errmsg ? errmsg : "");
+        sqlite3_free(errmsg);
+        if (!sqlite3_get_autocommit(db))
+            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
         return false;
     }
 
+    std::vector<const Item*> added_items;
     try {
         for (const auto& item : items) {
-            store(item.hash, item.pub_key, item.data, item.ttl, item.timestamp,
-                  item.nonce, DuplicateHandling::IGNORE);
+            bool added = false;
+            insert(item.hash, item.pub_key, item.data, item.ttl,
+                   item.timestamp, item.nonce, DuplicateHandling::IGNORE,
+                   added);
+            if (added)
+                added_items.push_back(&item);
         }
-    } catch (...) {
-        fprintf(stderr, "Failed to store items during bulk operation");
+    } catch (const std::exception& e) {
+        // Don't commit part of the batch
+        OXEN_LOG(critical, "Could not bulk store {} messages: {}",
+                 items.size(), e.what());
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        return false;
     }
 
-    if (sqlite3_exec(db, "END TRANSACTION;", NULL, NULL, &errmsg) != SQLITE_OK)
+    if (sqlite3_exec(db, "COMMIT TRANSACTION;", NULL, NULL, &errmsg) !=
+        SQLITE_OK) {
+        OXEN_LOG(critical, "Could not commit {} bulk stores: {}",
+                 items.size(), errmsg ? errmsg : "");
+        sqlite3_free(errmsg);
+        // Some errors (e.g. SQLITE_FULL) roll back automatically
+        if (!sqlite3_get_autocommit(db))
+            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
         return false;
+    }
+
+    message_count_ += added_items.size();
+    for (const Item* item : added_items) {
+        count_partition_row(item->timestamp + item->ttl);
+        update_head(item->pub_key, item->hash,
+                    item->timestamp + item->ttl);
+        cache_.add(*item);
+    }
 
     return true;
 }
@@ -431,45 +1618,112 @@ bool Database::bulk_store(const std::vector<Item>& items) {
 bool Database::retrieve(const std::string& pubKey, std::vector<Item>& items,
                         const std::string& lastHash, int num_results) {
 
-    sqlite3_stmt* stmt;
-
     if (pubKey.empty()) {
-        stmt = get_all_stmt;
-    } else if (lastHash.empty()) {
-        stmt = get_all_for_pk_stmt;
-        sqlite3_bind_text(stmt, 1, pubKey.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_int(stmt, 2, num_results);
-    } else {
-        stmt = get_stmt;
-        sqlite3_bind_text(stmt, 1, pubKey.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, lastHash.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_int(stmt, 3, num_results);
+        return for_each_chunk([&items](std::vector<Item>& chunk) {
+            items.insert(items.end(), std::make_move_iterator(chunk.begin()),
+                         std::make_move_iterator(chunk.end()));
+            return true;
+        });
     }
 
-    bool success = false;
-
-    while (true) {
-        int rc = sqlite3_step(stmt);
-        if (rc == SQLITE_DONE) {
-            success = true;
-            break;
-        } else if (rc == SQLITE_ROW) {
-            auto item = extract_item(stmt);
-            items.push_back(std::move(item));
-        } else {
-            OXEN_LOG(critical,
-                     "Could not execute `retrieve` db statement, ec: {}", rc);
-            break;
+    // Clients usually retrieve messages soon after they were stored
+    if (cache_.retrieve(pubKey, lastHash, num_results, items))
+        return true;
+
+    ReaderGuard reader(*this);
+    const auto tables = reader.tables();
+    ReadTransaction txn(reader->db, tables.size() > 1);
+
+    // Messages after the one with `lastHash`, or all of them if there is none
+    int64_t last_rowid = 0;
+    if (!lastHash.empty()) {
+        const auto hash = encode_hex(lastHash);
+        const encoded_t legacy_hash{lastHash, false};
+        for (auto* table : tables) {
+            if (!get_rowid_by_hash(table->get_id_by_hash_stmt, reader->db,
+                                   table->legacy ? legacy_hash : hash,
+                                   last_rowid))
+                return false;
+            if (last_rowid != 0)
+                break;
         }
     }
 
-    int rc = sqlite3_reset(stmt);
-    if (rc != SQLITE_OK) {
-        OXEN_LOG(critical, "sqlite reset error: [{}], {}", rc,
-                 sqlite3_errmsg(db));
-        success = false;
+    // Expired messages might not have been cleaned up yet
+    const auto now_ms = util::get_time_ms();
+
+    message_rows_t rows;
+    const auto owner = encode_hex(pubKey);
+    const encoded_t legacy_owner{pubKey, false};
+
+    for (auto* table : tables) {
+        message_rows_t table_rows;
+        sqlite3_stmt* stmt = table->get_stmt;
+        bind_encoded(stmt, 1, table->legacy ? legacy_owner : owner);
+        sqlite3_bind_int64(stmt, 2, last_rowid);
+        sqlite3_bind_int64(stmt, 3, now_ms);
+        sqlite3_bind_int(stmt, 4, num_results);
+        if (!collect_rows(stmt, reader->db, table_rows))
+            return false;
+        merge_rows(rows, table_rows, num_results);
+    }
+
+    for (auto& row : rows)
+        items.push_back(std::move(row.second));
+
+    return true;
+}
+
+bool Database::retrieve_chunk(int64_t& after_rowid, size_t limit,
+                              std::vector<Item>& items) {
+
+    ReaderGuard reader(*this);
+    const auto tables = reader.tables();
+    ReadTransaction txn(reader->db, tables.size() > 1);
+
+    const auto now_ms = util::get_time_ms();
+
+    message_rows_t rows;
+
+    for (auto* table : tables) {
+        message_rows_t table_rows;
+        sqlite3_stmt* stmt = table->get_chunk_stmt;
+        sqlite3_bind_int64(stmt, 1, after_rowid);
+        sqlite3_bind_int64(stmt, 2, now_ms);
+        sqlite3_bind_int64(stmt, 3, limit);
+        if (!collect_rows(stmt, reader->db, table_rows))
+            return false;
+        merge_rows(rows, table_rows, limit);
+    }
+
+    for (auto& row : rows) {
+        after_rowid = row.first;
+        items.push_back(std::move(row.second));
+    }
+
+    return true;
+}
+
+bool Database::for_each_chunk(const chunk_callback_t& cb, size_t chunk_size) {
+
+    // Each chunk continues from the last rowid of the previous one, so that
+    // every query is a seek rather than an offset scan, and rows inserted or
+    // deleted between chunks don't cause other rows to be skipped or repeated
+    int64_t last_rowid = 0;
+    std::vector<Item> chunk;
+    chunk.reserve(chunk_size);
+
+    while (true) {
+        chunk.clear();
+        if (!retrieve_chunk(last_rowid, chunk_size, chunk))
+            return false;
+
+        // `cb` is free to consume the items
+        const bool last_chunk = chunk.size() < chunk_size;
+
+        if (chunk.empty() || !cb(chunk) || last_chunk)
+            return true;
     }
-    return success;
 }
 
 } // namespace oxen
@@ -0,0 +1,70 @@
+#include "HashFilter.hpp"
+
+#include <algorithm>
+#include <functional>
+
+namespace oxen {
+
+// With 16 bits per hash and 8 probes, a full stage has a false positive rate
+// of about 0.06%
+constexpr size_t BITS_PER_HASH = 16;
+constexpr int NUM_PROBES = 8;
+
+// splitmix64 finaliser, to derive a second independent hash
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111eb;
+    x ^= x >> 31;
+    return x;
+}
+
+HashFilter::HashFilter(size_t initial_capacity) {
+    add_stage(std::max<size_t>(initial_capacity, 64));
+}
+
+void HashFilter::add_stage(size_t capacity) {
+    size_t num_bits = 64;
+    while (num_bits < capacity * BITS_PER_HASH)
+        num_bits *= 2;
+    stages_.push_back(Stage{std::vector<uint64_t>(num_bits / 64), capacity});
+}
+
+void HashFilter::add(std::string_view hash) {
+
+    if (stages_.back().count == stages_.back().capacity)
+        add_stage(2 * stages_.back().capacity);
+
+    Stage& stage = stages_.back();
+    const uint64_t mask = stage.bits.size() * 64 - 1;
+    // Double hashing: probe h1, h1 + h2, h1 + 2 * h2, ...
+    const uint64_t h1 = std::hash<std::string_view>{}(hash);
+    const uint64_t h2 = mix(h1) | 1;
+    for (int i = 0; i < NUM_PROBES; ++i) {
+        const uint64_t bit = (h1 + i * h2) & mask;
+        stage.bits[bit / 64] |= uint64_t{1} << (bit % 64);
+    }
+    ++stage.count;
+    ++size_;
+}
+
+bool HashFilter::might_contain(std::string_view hash) const {
+
+    const uint64_t h1 = std::hash<std::string_view>{}(hash);
+    const uint64_t h2 = mix(h1) | 1;
+
+    for (const auto& stage : stages_) {
+        const uint64_t mask = stage.bits.size() * 64 - 1;
+        bool found = true;
+        for (int i = 0; i < NUM_PROBES && found; ++i) {
+            const uint64_t bit = (h1 + i * h2) & mask;
+            found = stage.bits[bit / 64] & (uint64_t{1} << (bit % 64));
+        }
+        if (found)
+            return true;
+    }
+    return false;
+}
+
+} // namespace oxen
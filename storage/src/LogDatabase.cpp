@@ -0,0 +1,693 @@
+#include "LogDatabase.hpp"
+#include "oxen_logger.h"
+#include "utils.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace oxen {
+using namespace storage;
+
+namespace fs = std::filesystem;
+
+// Messages are grouped into segments by expiration time, in windows of this
+// length; expired messages are kept on disk for at most this long
+constexpr uint64_t LOG_SEGMENT_WINDOW = 60 * 60 * 1000; // 1 hour in ms
+constexpr auto LOG_CLEANUP_PERIOD = std::chrono::seconds(10);
+// Same limit as the SQLite database
+constexpr uint64_t LOG_SIZE_LIMIT = uint64_t(3584) * 1024 * 1024; // 3.5 GB
+
+constexpr const char* SEGMENT_PREFIX = "segment-";
+constexpr const char* SEGMENT_SUFFIX = ".log";
+
+struct LogDatabase::Segment {
+    Segment(int fd, std::string path) : fd(fd), path(std::move(path)) {}
+    ~Segment() { ::close(fd); }
+
+    const int fd;
+    const std::string path;
+    uint64_t size = 0;
+    // Whether it is in `unsynced_`; only accessed by the sync thread
+    bool unsynced = false;
+    // Messages stored in this segment
+    std::vector<int64_t> ids;
+};
+
+// A record is its size (not including the size itself), the message id,
+// timestamp and ttl, followed by the hash, owner, nonce and data, each
+// prefixed with its size. Integers are in host byte order, as segments are
+// never moved between machines.
+
+static void put_u32(std::string& buf, uint32_t value) {
+    buf.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void put_u64(std::string& buf, uint64_t value) {
+    buf.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void put_string(std::string& buf, const std::string& str) {
+    put_u32(buf, str.size());
+    buf += str;
+}
+
+static std::string encode_record(int64_t id, const Item& item) {
+    std::string buf;
+    buf.reserve(5 * sizeof(uint32_t) + 3 * sizeof(uint64_t) +
+                item.hash.size() + item.pub_key.size() + item.nonce.size() +
+                item.data.size());
+    put_u32(buf, 0);
+    put_u64(buf, id);
+    put_u64(buf, item.timestamp);
+    put_u64(buf, item.ttl);
+    put_string(buf, item.hash);
+    put_string(buf, item.pub_key);
+    put_string(buf, item.nonce);
+    put_string(buf, item.data);
+    const uint32_t size = buf.size() - sizeof(uint32_t);
+    std::memcpy(buf.data(), &size, sizeof(size));
+    return buf;
+}
+
+namespace {
+// Reads the fields of a record, failing (rather than reading past the end)
+// on truncated records
+struct RecordReader {
+    const char* pos;
+    const char* end;
+
+    template <typename T>
+    bool get(T& value) {
+        if (end - pos < static_cast<ptrdiff_t>(sizeof(T)))
+            return false;
+        std::memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    bool get(std::string& str) {
+        uint32_t size;
+        if (!get(size) || end - pos < static_cast<ptrdiff_t>(size))
+            return false;
+        str.assign(pos, size);
+        pos += size;
+        return true;
+    }
+};
+} // namespace
+
+// Decode the record in `data` (starting with its size)
+static bool decode_record(const std::string& data, int64_t& id, Item& item) {
+    RecordReader reader{data.data() + sizeof(uint32_t),
+                        data.data() + data.size()};
+    uint64_t raw_id;
+    if (!reader.get(raw_id) || !reader.get(item.timestamp) ||
+        !reader.get(item.ttl) || !reader.get(item.hash) ||
+        !reader.get(item.pub_key) || !reader.get(item.nonce) ||
+        !reader.get(item.data) || reader.pos != reader.end)
+        return false;
+    id = raw_id;
+    item.expiration_timestamp = item.timestamp + item.ttl;
+    return true;
+}
+
+static bool read_at(int fd, uint64_t offset, char* buf, size_t size) {
+    while (size > 0) {
+        const ssize_t n = ::pread(fd, buf, size, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const std::string& data) {
+    const char* buf = data.data();
+    size_t size = data.size();
+    while (size > 0) {
+        const ssize_t n = ::write(fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        size -= n;
+    }
+    return true;
+}
+
+static std::string segment_path(const std::string& dir, uint64_t window) {
+    return (fs::u8path(dir) /
+            (SEGMENT_PREFIX + std::to_string(window) + SEGMENT_SUFFIX))
+        .u8string();
+}
+
+LogDatabase::LogDatabase(boost::asio::io_context& ioc,
+                         const std::string& db_path)
+    : dir_((fs::u8path(db_path) / "messages").u8string()),
+      cleanup_timer_(ioc) {
+    fs::create_directories(fs::u8path(dir_));
+    load_segments();
+    sync_thread_ = std::thread([this] { sync_loop(); });
+    schedule_cleanup();
+}
+
+LogDatabase::~LogDatabase() {
+    cleanup_timer_.cancel();
+
+    // Let the sync thread store whatever is still queued
+    {
+        std::lock_guard lock(sync_queue_mutex_);
+        stopping_ = true;
+    }
+    sync_queue_cv_.notify_one();
+    if (sync_thread_.joinable())
+        sync_thread_.join();
+}
+
+void LogDatabase::load_segments() {
+
+    const auto now_ms = util::get_time_ms();
+
+    for (const auto& entry : fs::directory_iterator(fs::u8path(dir_))) {
+        const std::string name = entry.path().filename().u8string();
+        if (name.rfind(SEGMENT_PREFIX, 0) != 0)
+            continue;
+
+        const uint64_t window =
+            std::strtoull(name.c_str() + strlen(SEGMENT_PREFIX), nullptr, 10);
+        const std::string path = entry.path().u8string();
+
+        if ((window + 1) * LOG_SEGMENT_WINDOW <= now_ms) {
+            fs::remove(entry.path());
+            continue;
+        }
+
+        const int fd = ::open(path.c_str(), O_RDWR | O_APPEND);
+        if (fd < 0)
+            throw std::runtime_error("Can't open segment " + path);
+        auto segment = std::make_shared<Segment>(fd, path);
+
+        const uint64_t file_size = entry.file_size();
+        std::string record;
+        while (segment->size + sizeof(uint32_t) <= file_size) {
+            uint32_t size;
+            if (!read_at(fd, segment->size, reinterpret_cast<char*>(&size),
+                         sizeof(size)) ||
+                segment->size + sizeof(size) + size > file_size)
+                break;
+
+            record.resize(sizeof(size) + size);
+            int64_t id;
+            Item item;
+            if (!read_at(fd, segment->size, record.data(), record.size()) ||
+                !decode_record(record, id, item))
+                break;
+
+            segment->size += record.size();
+            // Appends check for duplicates, but make sure a damaged segment
+            // can't leave dangling index entries
+            if (ids_by_hash_.count(item.hash))
+                continue;
+
+            add_to_index(id, item.hash, item.pub_key,
+                         Location{segment, segment->size - record.size(),
+                                  static_cast<uint32_t>(record.size()),
+                                  item.expiration_timestamp, nullptr,
+                                  nullptr});
+            segment->ids.push_back(id);
+            next_id_ = std::max(next_id_, id + 1);
+        }
+
+        if (segment->size < file_size) {
+            OXEN_LOG(warn, "Discarding a torn record at the end of {}", path);
+            if (::ftruncate(fd, segment->size) != 0)
+                throw std::runtime_error("Can't truncate segment " + path);
+        }
+
+        size_ += segment->size;
+        segments_.emplace(window, std::move(segment));
+    }
+
+    OXEN_LOG(info, "Loaded {} messages from {} segments", messages_.size(),
+             segments_.size());
+}
+
+void LogDatabase::schedule_cleanup() {
+    remove_expired(util::get_time_ms());
+
+    cleanup_timer_.expires_after(LOG_CLEANUP_PERIOD);
+    cleanup_timer_.async_wait([this](const boost::system::error_code& ec) {
+        if (ec != boost::asio::error::operation_aborted)
+            schedule_cleanup();
+    });
+}
+
+void LogDatabase::remove_expired(uint64_t now_ms) {
+
+    std::lock_guard lock(mutex_);
+
+    size_t removed = 0;
+    while (!segments_.empty() &&
+           (segments_.begin()->first + 1) * LOG_SEGMENT_WINDOW <= now_ms) {
+        auto segment = std::move(segments_.begin()->second);
+        segments_.erase(segments_.begin());
+
+        for (const int64_t id : segment->ids) {
+            const auto it = messages_.find(id);
+            const auto owner = ids_by_owner_.find(*it->second.owner);
+            owner->second.erase(id);
+            if (owner->second.empty())
+                ids_by_owner_.erase(owner);
+            ids_by_hash_.erase(*it->second.hash);
+            messages_.erase(it);
+        }
+        removed += segment->ids.size();
+
+        // Readers that still hold the segment can finish reading it
+        if (::unlink(segment->path.c_str()) != 0)
+            OXEN_LOG(error, "Can't remove segment {}", segment->path);
+        size_ -= segment->size;
+    }
+
+    if (removed > 0)
+        OXEN_LOG(debug, "Removed {} expired messages", removed);
+}
+
+static bool sync_dir(const std::string& dir) {
+    const int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+    const bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+}
+
+bool LogDatabase::sync_segments() {
+    bool success = true;
+    std::vector<std::shared_ptr<Segment>> failed;
+    for (auto& segment : unsynced_) {
+        if (::fdatasync(segment->fd) == 0) {
+            segment->unsynced = false;
+        } else {
+            OXEN_LOG(critical, "Can't sync segment {}: {}", segment->path,
+                     strerror(errno));
+            success = false;
+            // Tried again with the next batch
+            failed.push_back(std::move(segment));
+        }
+    }
+    unsynced_ = std::move(failed);
+    return success;
+}
+
+void LogDatabase::enqueue(PendingAppend pending) {
+    bool first;
+    {
+        std::lock_guard lock(sync_queue_mutex_);
+        sync_queue_.push_back(std::move(pending));
+        first = sync_queue_.size() == 1;
+    }
+    // Otherwise the sync thread is already busy and takes it with the rest
+    if (first)
+        sync_queue_cv_.notify_one();
+}
+
+void LogDatabase::enqueue_and_wait(PendingAppend pending, bool& success,
+                                   bool& added) {
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+    bool done = false;
+
+    pending.cb = [&](bool s, bool a) {
+        std::lock_guard lock(done_mutex);
+        success = s;
+        added = a;
+        done = true;
+        done_cv.notify_one();
+    };
+    enqueue(std::move(pending));
+
+    std::unique_lock lock(done_mutex);
+    done_cv.wait(lock, [&done] { return done; });
+}
+
+void LogDatabase::sync_loop() {
+
+    std::vector<PendingAppend> batch;
+
+    while (true) {
+        {
+            std::unique_lock lock(sync_queue_mutex_);
+            sync_queue_cv_.wait(lock, [this] {
+                return stopping_ || !sync_queue_.empty();
+            });
+            if (stopping_ && sync_queue_.empty())
+                return;
+            // Everything queued while the previous batch was being synced
+            // shares this batch's sync
+            batch.swap(sync_queue_);
+        }
+
+        sync_batch(batch);
+        batch.clear();
+    }
+}
+
+void LogDatabase::sync_batch(std::vector<PendingAppend>& batch) {
+
+    std::vector<std::pair<bool, bool>> results(batch.size());
+    {
+        std::lock_guard lock(mutex_);
+        for (size_t i = 0; i < batch.size(); ++i) {
+            bool success = true, all_added = true;
+            for (const auto& item : batch[i].items) {
+                bool added;
+                success &= append(item, batch[i].behaviour, added);
+                all_added &= added;
+            }
+            results[i] = {success, all_added};
+        }
+    }
+
+    // Readers can already see the appends, but they are only reported as
+    // stored once they are synced
+    if (!sync_segments()) {
+        for (auto& result : results)
+            result = {false, false};
+    }
+
+    OXEN_LOG(trace, "Synced {} queued stores", batch.size());
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (!batch[i].cb)
+            continue;
+        try {
+            batch[i].cb(results[i].first, results[i].second);
+        } catch (const std::exception& e) {
+            OXEN_LOG(error, "Exception in store callback: {}", e.what());
+        }
+    }
+}
+
+std::shared_ptr<LogDatabase::Segment>
+LogDatabase::get_segment(uint64_t expiration_timestamp) {
+    const uint64_t window = expiration_timestamp / LOG_SEGMENT_WINDOW;
+    auto& segment = segments_[window];
+    if (!segment) {
+        const auto path = segment_path(dir_, window);
+        const int fd = ::open(path.c_str(), O_RDWR | O_APPEND | O_CREAT, 0600);
+        if (fd < 0) {
+            OXEN_LOG(error, "Can't create segment {}", path);
+            segments_.erase(window);
+            return nullptr;
+        }
+        segment = std::make_shared<Segment>(fd, path);
+        // Syncing the segment doesn't make its directory entry durable
+        if (!sync_dir(dir_))
+            OXEN_LOG(error, "Can't sync the segment directory {}", dir_);
+    }
+    return segment;
+}
+
+void LogDatabase::add_to_index(int64_t id, const std::string& hash,
+                               const std::string& owner, Location location) {
+    location.hash = &ids_by_hash_.emplace(hash, id).first->first;
+    const auto owner_it = ids_by_owner_.try_emplace(owner).first;
+    owner_it->second.insert(id);
+    location.owner = &owner_it->first;
+    messages_.emplace(id, std::move(location));
+}
+
+bool LogDatabase::append(const Item& item, DuplicateHandling behaviour,
+                         bool& added) {
+    added = false;
+    if (ids_by_hash_.count(item.hash))
+        return behaviour == DuplicateHandling::IGNORE;
+
+    const int64_t id = next_id_;
+    const std::string record = encode_record(id, item);
+
+    if (size_ + record.size() > LOG_SIZE_LIMIT) {
+        OXEN_LOG(error, "Message store is full ({} bytes)", size_);
+        return false;
+    }
+
+    auto segment = get_segment(item.expiration_timestamp);
+    if (!segment)
+        return false;
+
+    if (!write_all(segment->fd, record)) {
+        OXEN_LOG(error, "Can't append to segment {}", segment->path);
+        // Don't leave a partial record behind
+        if (::ftruncate(segment->fd, segment->size) != 0)
+            OXEN_LOG(critical, "Can't truncate segment {}", segment->path);
+        return false;
+    }
+
+    ++next_id_;
+    add_to_index(id, item.hash, item.pub_key,
+                 Location{segment, segment->size,
+                          static_cast<uint32_t>(record.size()),
+                          item.expiration_timestamp, nullptr, nullptr});
+    segment->ids.push_back(id);
+    segment->size += record.size();
+    size_ += record.size();
+    if (!segment->unsynced) {
+        segment->unsynced = true;
+        unsynced_.push_back(std::move(segment));
+    }
+    added = true;
+    return true;
+}
+
+bool LogDatabase::read_items(const std::vector<Location>& locations,
+                             std::vector<Item>& items) {
+    std::string record;
+    for (const auto& location : locations) {
+        record.resize(location.size);
+        int64_t id;
+        Item item;
+        if (!read_at(location.segment->fd, location.offset, record.data(),
+                     record.size()) ||
+            !decode_record(record, id, item)) {
+            OXEN_LOG(critical, "Can't read a message from {}",
+                     location.segment->path);
+            return false;
+        }
+        items.push_back(std::move(item));
+    }
+    return true;
+}
+
+bool LogDatabase::store(const std::string& hash, const std::string& pubKey,
+                        const std::string& bytes, uint64_t ttl,
+                        uint64_t timestamp, const std::string& nonce,
+                        DuplicateHandling behaviour) {
+    bool success, added;
+    enqueue_and_wait(
+        PendingAppend{{Item{hash, pubKey, timestamp, ttl, timestamp + ttl,
+                            nonce, bytes}},
+                      behaviour,
+                      {}},
+        success, added);
+    return success;
+}
+
+void LogDatabase::store_async(Item item, store_callback_t cb,
+                              DuplicateHandling behaviour) {
+    PendingAppend pending{{}, behaviour, {}};
+    pending.items.push_back(std::move(item));
+    if (cb) {
+        pending.cb = [cb = std::move(cb)](bool success, bool added) {
+            cb(success && added);
+        };
+    }
+    enqueue(std::move(pending));
+}
+
+bool LogDatabase::bulk_store(const std::vector<Item>& items) {
+    // Appended and synced as a whole
+    bool success, added;
+    enqueue_and_wait(PendingAppend{items, DuplicateHandling::IGNORE, {}},
+                     success, added);
+    return success;
+}
+
+bool LogDatabase::retrieve(const std::string& pubKey, std::vector<Item>& items,
+                           const std::string& lastHash, int num_results) {
+
+    if (pubKey.empty()) {
+        return for_each_chunk([&items](std::vector<Item>& chunk) {
+            items.insert(items.end(), std::make_move_iterator(chunk.begin()),
+                         std::make_move_iterator(chunk.end()));
+            return true;
+        });
+    }
+
+    const auto now_ms = util::get_time_ms();
+
+    std::vector<Location> locations;
+    {
+        std::lock_guard lock(mutex_);
+
+        const auto owner = ids_by_owner_.find(pubKey);
+        if (owner == ids_by_owner_.end())
+            return true;
+
+        // Messages after the one with `lastHash`, or all of them if there is
+        // none
+        int64_t last_id = 0;
+        if (const auto it = ids_by_hash_.find(lastHash);
+            it != ids_by_hash_.end())
+            last_id = it->second;
+
+        const auto& ids = owner->second;
+        for (auto it = ids.upper_bound(last_id); it != ids.end(); ++it) {
+            if (num_results >= 0 &&
+                locations.size() >= static_cast<size_t>(num_results))
+                break;
+            const Location& location = messages_.at(*it);
+            // Segments hold messages for a while after they expire
+            if (location.expiration_timestamp > now_ms)
+                locations.push_back(location);
+        }
+    }
+
+    return read_items(locations, items);
+}
+
+bool LogDatabase::for_each_chunk(const chunk_callback_t& cb,
+                                 size_t chunk_size) {
+
+    int64_t last_id = 0;
+    std::vector<Location> locations;
+    std::vector<Item> chunk;
+    chunk.reserve(chunk_size);
+
+    while (true) {
+        locations.clear();
+        {
+            const auto now_ms = util::get_time_ms();
+            std::lock_guard lock(mutex_);
+            for (auto it = messages_.upper_bound(last_id);
+                 it != messages_.end() && locations.size() < chunk_size;
+                 ++it) {
+                last_id = it->first;
+                if (it->second.expiration_timestamp > now_ms)
+                    locations.push_back(it->second);
+            }
+        }
+
+        chunk.clear();
+        if (!read_items(locations, chunk))
+            return false;
+
+        const bool last_chunk = chunk.size() < chunk_size;
+
+        if (chunk.empty() || !cb(chunk) || last_chunk)
+            return true;
+    }
+}
+
+bool LogDatabase::get_message_count(uint64_t& count) {
+    std::lock_guard lock(mutex_);
+    count = messages_.size();
+    return true;
+}
+
+bool LogDatabase::retrieve_random(Item& item) {
+
+    const auto now_ms = util::get_time_ms();
+
+    std::vector<Location> locations;
+    {
+        std::lock_guard lock(mutex_);
+
+        if (messages_.empty())
+            return false;
+
+        const int64_t min_id = messages_.begin()->first;
+        const int64_t max_id = messages_.rbegin()->first;
+        const int64_t start =
+            min_id + util::uniform_distribution_portable(max_id - min_id + 1);
+
+        // If every message from `start` onwards has expired, wrap around
+        for (const int64_t id : {start, min_id}) {
+            for (auto it = messages_.lower_bound(id);
+                 it != messages_.end() && locations.empty(); ++it) {
+                if (it->second.expiration_timestamp > now_ms)
+                    locations.push_back(it->second);
+            }
+        }
+    }
+
+    if (locations.empty())
+        return false;
+
+    std::vector<Item> items;
+    if (!read_items(locations, items))
+        return false;
+    item = std::move(items.front());
+    return true;
+}
+
+bool LogDatabase::retrieve_by_hash(const std::string& msg_hash, Item& item) {
+
+    const auto now_ms = util::get_time_ms();
+
+    std::vector<Location> locations;
+    {
+        std::lock_guard lock(mutex_);
+        const auto it = ids_by_hash_.find(msg_hash);
+        if (it == ids_by_hash_.end())
+            return false;
+        const Location& location = messages_.at(it->second);
+        if (location.expiration_timestamp <= now_ms)
+            return false;
+        locations.push_back(location);
+    }
+
+    std::vector<Item> items;
+    if (!read_items(locations, items))
+        return false;
+    item = std::move(items.front());
+    return true;
+}
+
+bool LogDatabase::contains(const std::string& msg_hash,
+                           uint64_t /*expiration_timestamp*/) {
+    std::lock_guard lock(mutex_);
+    return ids_by_hash_.count(msg_hash) > 0;
+}
+
+bool LogDatabase::is_latest_message(const std::string& pubKey,
+                                    const std::string& msg_hash) {
+
+    const auto now_ms = util::get_time_ms();
+
+    std::lock_guard lock(mutex_);
+
+    const auto owner = ids_by_owner_.find(pubKey);
+    if (owner == ids_by_owner_.end())
+        return false;
+
+    const Location& latest = messages_.at(*owner->second.rbegin());
+    // Once the latest message has expired, older ones might still be there
+    // for clients to retrieve
+    return *latest.hash == msg_hash &&
+           latest.expiration_timestamp > now_ms;
+}
+
+} // namespace oxen
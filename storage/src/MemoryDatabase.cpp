@@ -0,0 +1,238 @@
+#include "MemoryDatabase.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+
+namespace oxen {
+using namespace storage;
+
+constexpr auto MEMORY_CLEANUP_PERIOD = std::chrono::seconds(10);
+
+MemoryDatabase::MemoryDatabase(boost::asio::io_context& ioc)
+    : cleanup_timer_(ioc) {
+    schedule_cleanup();
+}
+
+MemoryDatabase::~MemoryDatabase() { cleanup_timer_.cancel(); }
+
+void MemoryDatabase::schedule_cleanup() {
+    remove_expired(util::get_time_ms());
+
+    cleanup_timer_.expires_after(MEMORY_CLEANUP_PERIOD);
+    cleanup_timer_.async_wait([this](const boost::system::error_code& ec) {
+        if (ec != boost::asio::error::operation_aborted)
+            schedule_cleanup();
+    });
+}
+
+void MemoryDatabase::remove_expired(uint64_t now_ms) {
+    std::lock_guard lock(mutex_);
+
+    while (!expiries_.empty() && expiries_.top().first <= now_ms) {
+        const int64_t id = expiries_.top().second;
+        expiries_.pop();
+
+        const auto it = messages_.find(id);
+        if (it == messages_.end())
+            continue;
+
+        const Item& item = it->second;
+        ids_by_hash_.erase(item.hash);
+        const auto owner = ids_by_owner_.find(item.pub_key);
+        owner->second.erase(id);
+        if (owner->second.empty())
+            ids_by_owner_.erase(owner);
+        messages_.erase(it);
+    }
+}
+
+bool MemoryDatabase::insert(Item item, DuplicateHandling behaviour) {
+    if (ids_by_hash_.count(item.hash))
+        return behaviour == DuplicateHandling::IGNORE;
+
+    const int64_t id = next_id_++;
+    ids_by_hash_.emplace(item.hash, id);
+    ids_by_owner_[item.pub_key].insert(id);
+    expiries_.emplace(item.expiration_timestamp, id);
+    messages_.emplace(id, std::move(item));
+    return true;
+}
+
+bool MemoryDatabase::store(const std::string& hash, const std::string& pubKey,
+                           const std::string& bytes, uint64_t ttl,
+                           uint64_t timestamp, const std::string& nonce,
+                           DuplicateHandling behaviour) {
+    std::lock_guard lock(mutex_);
+    return insert(
+        Item{hash, pubKey, timestamp, ttl, timestamp + ttl, nonce, bytes},
+        behaviour);
+}
+
+void MemoryDatabase::store_async(Item item, store_callback_t cb,
+                                 DuplicateHandling behaviour) {
+    bool added;
+    {
+        std::lock_guard lock(mutex_);
+        added = !ids_by_hash_.count(item.hash);
+        insert(std::move(item), behaviour);
+    }
+    if (cb)
+        cb(added);
+}
+
+bool MemoryDatabase::bulk_store(const std::vector<Item>& items) {
+    std::lock_guard lock(mutex_);
+    for (const auto& item : items)
+        insert(item, DuplicateHandling::IGNORE);
+    return true;
+}
+
+bool MemoryDatabase::retrieve(const std::string& pubKey,
+                              std::vector<Item>& items,
+                              const std::string& lastHash, int num_results) {
+
+    if (pubKey.empty()) {
+        return for_each_chunk([&items](std::vector<Item>& chunk) {
+            items.insert(items.end(), std::make_move_iterator(chunk.begin()),
+                         std::make_move_iterator(chunk.end()));
+            return true;
+        });
+    }
+
+    const auto now_ms = util::get_time_ms();
+
+    std::lock_guard lock(mutex_);
+
+    const auto owner = ids_by_owner_.find(pubKey);
+    if (owner == ids_by_owner_.end())
+        return true;
+
+    // Messages after the one with `lastHash`, or all of them if there is none
+    int64_t last_id = 0;
+    if (const auto it = ids_by_hash_.find(lastHash); it != ids_by_hash_.end())
+        last_id = it->second;
+
+    const auto& ids = owner->second;
+    size_t count = 0;
+    for (auto it = ids.upper_bound(last_id); it != ids.end(); ++it) {
+        if (num_results >= 0 && count >= static_cast<size_t>(num_results))
+            break;
+        const Item& item = messages_.at(*it);
+        if (item.expiration_timestamp > now_ms) {
+            items.push_back(item);
+            ++count;
+        }
+    }
+
+    return true;
+}
+
+bool MemoryDatabase::for_each_chunk(const chunk_callback_t& cb,
+                                    size_t chunk_size) {
+
+    // Like `Database`, continue each chunk from the last id of the previous
+    // one, so that messages stored or expired in between don't cause others
+    // to be skipped or repeated
+    int64_t last_id = 0;
+    std::vector<Item> chunk;
+    chunk.reserve(chunk_size);
+
+    while (true) {
+        chunk.clear();
+        {
+            const auto now_ms = util::get_time_ms();
+            std::lock_guard lock(mutex_);
+            for (auto it = messages_.upper_bound(last_id);
+                 it != messages_.end() && chunk.size() < chunk_size; ++it) {
+                last_id = it->first;
+                if (it->second.expiration_timestamp > now_ms)
+                    chunk.push_back(it->second);
+            }
+        }
+
+        const bool last_chunk = chunk.size() < chunk_size;
+
+        if (chunk.empty() || !cb(chunk) || last_chunk)
+            return true;
+    }
+}
+
+bool MemoryDatabase::get_message_count(uint64_t& count) {
+    std::lock_guard lock(mutex_);
+    count = messages_.size();
+    return true;
+}
+
+bool MemoryDatabase::retrieve_random(Item& item) {
+
+    const auto now_ms = util::get_time_ms();
+
+    std::lock_guard lock(mutex_);
+
+    if (messages_.empty())
+        return false;
+
+    // Same sampling as `Database`: seek to a random id between the smallest
+    // and largest one
+    const int64_t min_id = messages_.begin()->first;
+    const int64_t max_id = messages_.rbegin()->first;
+    const int64_t start =
+        min_id + util::uniform_distribution_portable(max_id - min_id + 1);
+
+    // If every message from `start` onwards has expired, wrap around
+    for (const int64_t id : {start, min_id}) {
+        for (auto it = messages_.lower_bound(id); it != messages_.end();
+             ++it) {
+            if (it->second.expiration_timestamp > now_ms) {
+                item = it->second;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+bool MemoryDatabase::retrieve_by_hash(const std::string& msg_hash,
+                                      Item& item) {
+
+    const auto now_ms = util::get_time_ms();
+
+    std::lock_guard lock(mutex_);
+
+    const auto it = ids_by_hash_.find(msg_hash);
+    if (it == ids_by_hash_.end())
+        return false;
+
+    const Item& found = messages_.at(it->second);
+    if (found.expiration_timestamp <= now_ms)
+        return false;
+
+    item = found;
+    return true;
+}
+
+bool MemoryDatabase::contains(const std::string& msg_hash,
+                              uint64_t /*expiration_timestamp*/) {
+    std::lock_guard lock(mutex_);
+    return ids_by_hash_.count(msg_hash) > 0;
+}
+
+bool MemoryDatabase::is_latest_message(const std::string& pubKey,
+                                       const std::string& msg_hash) {
+
+    const auto now_ms = util::get_time_ms();
+
+    std::lock_guard lock(mutex_);
+
+    const auto owner = ids_by_owner_.find(pubKey);
+    if (owner == ids_by_owner_.end())
+        return false;
+
+    const Item& latest = messages_.at(*owner->second.rbegin());
+    // Once the latest message has expired, older ones might still be there
+    // for clients to retrieve
+    return latest.hash == msg_hash && latest.expiration_timestamp > now_ms;
+}
+
+} // namespace oxen
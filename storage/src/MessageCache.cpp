@@ -0,0 +1,140 @@
+#include "MessageCache.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+
+namespace oxen {
+using namespace storage;
+
+// Approximate memory used by a cached message
+static size_t item_size(const Item& item) {
+    return sizeof(Item) + item.hash.size() + item.pub_key.size() +
+           item.nonce.size() + item.data.size();
+}
+
+MessageCache::MessageCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+void MessageCache::add(const Item& item) {
+
+    const size_t size = item_size(item);
+
+    std::lock_guard lock(mutex_);
+
+    auto it = entries_.find(item.pub_key);
+
+    if (size > max_bytes_) {
+        // The owner's cached messages would be missing this one, so their
+        // next retrieve has to go to the database
+        if (it != entries_.end()) {
+            for (const auto& msg : it->second.messages)
+                bytes_ -= item_size(msg);
+            remove_entry(it);
+        }
+        return;
+    }
+
+    if (it == entries_.end()) {
+        lru_.push_front(item.pub_key);
+        it = entries_.emplace(item.pub_key, Entry{{}, lru_.begin()}).first;
+    } else {
+        lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+    }
+
+    it->second.messages.push_back(item);
+    bytes_ += size;
+
+    evict();
+}
+
+bool MessageCache::retrieve(const std::string& pub_key,
+                            const std::string& last_hash, int num_results,
+                            std::vector<Item>& items) {
+
+    const auto now_ms = util::get_time_ms();
+
+    std::lock_guard lock(mutex_);
+
+    const auto it = entries_.find(pub_key);
+    // Without a cached message to continue from, there might be older
+    // messages that aren't cached
+    if (last_hash.empty() || it == entries_.end()) {
+        ++misses_;
+        return false;
+    }
+
+    const auto& messages = it->second.messages;
+    // Clients usually continue from one of the last few messages
+    const auto last = std::find_if(
+        messages.rbegin(), messages.rend(),
+        [&last_hash](const Item& item) { return item.hash == last_hash; });
+    if (last == messages.rend()) {
+        ++misses_;
+        return false;
+    }
+
+    for (auto msg = last.base(); msg != messages.end(); ++msg) {
+        if (num_results >= 0 &&
+            items.size() >= static_cast<size_t>(num_results))
+            break;
+        // Expired messages might not have been removed yet
+        if (msg->expiration_timestamp > now_ms)
+            items.push_back(*msg);
+    }
+
+    lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+    ++hits_;
+    return true;
+}
+
+void MessageCache::remove_expired(uint64_t now_ms) {
+
+    std::lock_guard lock(mutex_);
+
+    for (auto it = entries_.begin(); it != entries_.end();) {
+        auto& messages = it->second.messages;
+        // Messages can be removed from anywhere without affecting what is
+        // returned, as expired messages are never returned
+        const auto is_expired = [now_ms](const Item& item) {
+            return item.expiration_timestamp <= now_ms;
+        };
+        for (const auto& msg : messages) {
+            if (is_expired(msg))
+                bytes_ -= item_size(msg);
+        }
+        messages.erase(
+            std::remove_if(messages.begin(), messages.end(), is_expired),
+            messages.end());
+
+        if (messages.empty()) {
+            remove_entry(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+size_t MessageCache::size_bytes() const {
+    std::lock_guard lock(mutex_);
+    return bytes_;
+}
+
+void MessageCache::evict() {
+
+    while (bytes_ > max_bytes_ && !lru_.empty()) {
+        const auto it = entries_.find(lru_.back());
+        auto& messages = it->second.messages;
+        // Dropping the oldest message keeps the remaining ones complete
+        bytes_ -= item_size(messages.front());
+        messages.pop_front();
+        if (messages.empty())
+            remove_entry(it);
+    }
+}
+
+void MessageCache::remove_entry(
+    std::unordered_map<std::string, Entry>::iterator it) {
+    lru_.erase(it->second.lru_it);
+    entries_.erase(it);
+}
+
+} // namespace oxen
@@ -0,0 +1,219 @@
+#include "ShardedDatabase.hpp"
+#include "oxen_logger.h"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <future>
+#include <stdexcept>
+
+namespace oxen {
+using namespace storage;
+
+namespace fs = std::filesystem;
+
+// FNV-1a, as shards must be picked the same way across restarts (which
+// `std::hash` doesn't guarantee)
+static uint64_t owner_hash(const std::string& pubKey) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const unsigned char c : pubKey) {
+        hash ^= c;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+ShardedDatabase::ShardedDatabase(boost::asio::io_context& ioc,
+                                 const std::string& db_path,
+                                 size_t num_shards,
+                                 Database::PayloadFormat payload_format,
+                                 size_t cache_size)
+    : pool_(std::max<size_t>(num_shards, 2) - 1) {
+
+    if (num_shards == 0)
+        throw std::runtime_error("The number of shards must be positive");
+
+    const fs::path dir = fs::u8path(db_path) / "shards";
+    fs::create_directories(dir);
+
+    size_t existing = 0;
+    for (const auto& entry : fs::directory_iterator(dir)) {
+        if (entry.is_directory())
+            ++existing;
+    }
+    if (existing != 0 && existing != num_shards) {
+        throw std::runtime_error(
+            "The database has " + std::to_string(existing) +
+            " shards, it can't be opened with " + std::to_string(num_shards));
+    }
+
+    if (fs::exists(fs::u8path(db_path) / "storage.db")) {
+        OXEN_LOG(warn, "Messages in the unsharded database are not moved "
+                       "into the shards and won't be served");
+    }
+
+    shards_.reserve(num_shards);
+    for (size_t i = 0; i < num_shards; ++i) {
+        const fs::path shard_dir = dir / std::to_string(i);
+        fs::create_directories(shard_dir);
+        shards_.push_back(std::make_unique<Database>(
+            ioc, shard_dir.u8string(), payload_format,
+            cache_size / num_shards));
+    }
+}
+
+Database& ShardedDatabase::shard_for(const std::string& pubKey) {
+    return *shards_[owner_hash(pubKey) % shards_.size()];
+}
+
+bool ShardedDatabase::store(const std::string& hash, const std::string& pubKey,
+                            const std::string& bytes, uint64_t ttl,
+                            uint64_t timestamp, const std::string& nonce,
+                            DuplicateHandling behaviour) {
+    return shard_for(pubKey).store(hash, pubKey, bytes, ttl, timestamp, nonce,
+                                   behaviour);
+}
+
+void ShardedDatabase::store_async(Item item, store_callback_t cb,
+                                  DuplicateHandling behaviour) {
+    Database& shard = shard_for(item.pub_key);
+    shard.store_async(std::move(item), std::move(cb), behaviour);
+}
+
+bool ShardedDatabase::bulk_store(const std::vector<Item>& items) {
+
+    std::vector<std::vector<Item>> by_shard(shards_.size());
+    for (const auto& item : items)
+        by_shard[owner_hash(item.pub_key) % shards_.size()].push_back(item);
+
+    std::vector<size_t> non_empty;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        if (!by_shard[i].empty())
+            non_empty.push_back(i);
+    }
+    if (non_empty.empty())
+        return true;
+
+    std::vector<std::future<bool>> results;
+    for (size_t j = 1; j < non_empty.size(); ++j) {
+        std::promise<bool> result;
+        results.push_back(result.get_future());
+        boost::asio::post(pool_, [this, &by_shard, i = non_empty[j],
+                                  result = std::move(result)]() mutable {
+            result.set_value(shards_[i]->bulk_store(by_shard[i]));
+        });
+    }
+
+    bool ok = shards_[non_empty[0]]->bulk_store(by_shard[non_empty[0]]);
+    for (auto& result : results)
+        ok = result.get() && ok;
+    return ok;
+}
+
+bool ShardedDatabase::retrieve(const std::string& pubKey,
+                               std::vector<Item>& items,
+                               const std::string& lastHash, int num_results) {
+    if (!pubKey.empty())
+        return shard_for(pubKey).retrieve(pubKey, items, lastHash,
+                                          num_results);
+
+    for (auto& shard : shards_) {
+        if (!shard->retrieve(pubKey, items, lastHash, num_results))
+            return false;
+    }
+    return true;
+}
+
+bool ShardedDatabase::for_each_chunk(const chunk_callback_t& cb,
+                                     size_t chunk_size) {
+    bool stopped = false;
+    const auto shard_cb = [&cb, &stopped](std::vector<Item>& chunk) {
+        stopped = !cb(chunk);
+        return !stopped;
+    };
+
+    for (auto& shard : shards_) {
+        if (!shard->for_each_chunk(shard_cb, chunk_size))
+            return false;
+        if (stopped)
+            break;
+    }
+    return true;
+}
+
+bool ShardedDatabase::get_message_count(uint64_t& count) {
+    count = 0;
+    for (auto& shard : shards_) {
+        uint64_t shard_count;
+        if (!shard->get_message_count(shard_count))
+            return false;
+        count += shard_count;
+    }
+    return true;
+}
+
+bool ShardedDatabase::retrieve_random(Item& item) {
+
+    std::vector<uint64_t> counts(shards_.size());
+    uint64_t total = 0;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        if (!shards_[i]->get_message_count(counts[i]))
+            return false;
+        total += counts[i];
+    }
+    if (total == 0)
+        return false;
+
+    size_t first = 0;
+    for (uint64_t n = util::uniform_distribution_portable(total);
+         n >= counts[first]; ++first) {
+        n -= counts[first];
+    }
+
+    // The picked shard might only have expired messages left
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        if (shards_[(first + i) % shards_.size()]->retrieve_random(item))
+            return true;
+    }
+    return false;
+}
+
+bool ShardedDatabase::retrieve_by_hash(const std::string& msg_hash,
+                                       Item& item) {
+    for (auto& shard : shards_) {
+        if (shard->retrieve_by_hash(msg_hash, item))
+            return true;
+    }
+    return false;
+}
+
+bool ShardedDatabase::contains(const std::string& msg_hash,
+                               uint64_t expiration_timestamp) {
+    // Each shard rules most hashes out from memory
+    for (auto& shard : shards_) {
+        if (shard->contains(msg_hash, expiration_timestamp))
+            return true;
+    }
+    return false;
+}
+
+bool ShardedDatabase::get_message_cache_stats(
+    MessageCacheStats& stats) const {
+    stats = {};
+    for (const auto& shard : shards_) {
+        MessageCacheStats shard_stats;
+        if (!shard->get_message_cache_stats(shard_stats))
+            return false;
+        stats.hits += shard_stats.hits;
+        stats.misses += shard_stats.misses;
+        stats.bytes += shard_stats.bytes;
+    }
+    return true;
+}
+
+bool ShardedDatabase::is_latest_message(const std::string& pubKey,
+                                        const std::string& msg_hash) {
+    return shard_for(pubKey).is_latest_message(pubKey, msg_hash);
+}
+
+} // namespace oxen
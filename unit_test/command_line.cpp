@@ -65,6 +65,15 @@ BOOST_AUTO_TEST_CASE(it_parses_force_start) {
     BOOST_CHECK_EQUAL(options.force_start, true);
 }
 
+BOOST_AUTO_TEST_CASE(it_parses_binary_payloads) {
+    oxen::command_line_parser parser;
+    const char* argv[] = {"httpserver", "0.0.0.0", "80", "--lmq-port", "123", "--binary-payloads"};
+    BOOST_CHECK_NO_THROW(parser.parse_args(sizeof(argv) / sizeof(char*),
+                                           const_cast<char**>(argv)));
+    const auto options = parser.get_options();
+    BOOST_CHECK_EQUAL(options.binary_payloads, true);
+}
+
 BOOST_AUTO_TEST_CASE(it_parses_ip_and_port) {
     oxen::command_line_parser parser;
     const char* argv[] = {"httpserver", "0.0.0.0", "80", "--lmq-port", "123"};
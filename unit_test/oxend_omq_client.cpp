@@ -0,0 +1,265 @@
+#include "oxend_omq_client.h"
+
+#include <boost/test/unit_test.hpp>
+#include <nlohmann/json.hpp>
+#include <oxenmq/oxenmq.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+using namespace oxen;
+using namespace std::literals;
+
+static std::string mock_oxend_address() {
+    return "ipc://" +
+           (std::filesystem::temp_directory_path() / "ss-test-oxend.sock")
+               .u8string();
+}
+
+static std::string mock_storage_server_address() {
+    return "ipc://" +
+           (std::filesystem::temp_directory_path() / "ss-test-storage.sock")
+               .u8string();
+}
+
+// Waits a few seconds at most for `pred` to hold
+template <typename Pred>
+static bool eventually(Pred pred) {
+    const auto until = std::chrono::steady_clock::now() + 5s;
+    while (!pred() && std::chrono::steady_clock::now() < until)
+        std::this_thread::sleep_for(10ms);
+    return pred();
+}
+
+namespace {
+
+// Stands in for oxend: takes block subscriptions and answers
+// `rpc.get_service_nodes` with `result`
+class MockOxend {
+  public:
+    explicit MockOxend(const std::string& address) {
+        omq_.add_category("sub", oxenmq::AuthLevel::none)
+            .add_request_command("block", [this](oxenmq::Message& m) {
+                std::lock_guard guard(mutex_);
+                ++num_sub_requests_;
+                if (refuse_subscriptions_) {
+                    m.send_reply("ERROR");
+                    return;
+                }
+                const bool renewed = std::find(subscribers_.begin(),
+                                               subscribers_.end(),
+                                               m.conn) != subscribers_.end();
+                if (!renewed)
+                    subscribers_.push_back(m.conn);
+                m.send_reply(renewed ? "ALREADY" : "OK");
+            });
+        omq_.add_category("rpc", oxenmq::AuthLevel::none)
+            .add_request_command(
+                "get_service_nodes", [this](oxenmq::Message& m) {
+                    std::lock_guard guard(mutex_);
+                    last_params_ = nlohmann::json::parse(m.data.at(0));
+                    m.send_reply("200", result.dump());
+                });
+        omq_.listen_plain(address);
+        omq_.start();
+    }
+
+    void notify_block(uint64_t height, const std::string& hash) {
+        std::lock_guard guard(mutex_);
+        for (const auto& conn : subscribers_)
+            omq_.send(conn, "notify.block", std::to_string(height), hash);
+    }
+
+    // Like an oxend that has gone away, as far as its subscribers can tell
+    void refuse_subscriptions() {
+        std::lock_guard guard(mutex_);
+        refuse_subscriptions_ = true;
+        subscribers_.clear();
+    }
+
+    int num_sub_requests() const {
+        std::lock_guard guard(mutex_);
+        return num_sub_requests_;
+    }
+
+    nlohmann::json last_params() const {
+        std::lock_guard guard(mutex_);
+        return last_params_;
+    }
+
+    const nlohmann::json result{{"height", 100}, {"block_hash", "abcd"}};
+
+  private:
+    mutable std::mutex mutex_;
+    std::vector<oxenmq::ConnectionID> subscribers_;
+    int num_sub_requests_ = 0;
+    bool refuse_subscriptions_ = false;
+    nlohmann::json last_params_;
+    // Last, so that its threads stop before the rest goes away
+    oxenmq::OxenMQ omq_;
+};
+
+// Our side of the connection, recording the blocks oxend tells us about.
+// With a `listen_address`, other peers can connect to it as admins, like
+// those with a stats access key.
+class MockStorageServer {
+  public:
+    explicit MockStorageServer(const std::string& address,
+                               const std::string& listen_address = "")
+        : omq_(std::make_unique<oxenmq::OxenMQ>()) {
+        oxend_ = std::make_unique<OxendOmqClient>(
+            *omq_, address,
+            [this](std::string_view block_hash) {
+                std::lock_guard guard(mutex_);
+                blocks_.emplace_back(block_hash);
+            },
+            [this]() {
+                std::lock_guard guard(mutex_);
+                ++num_lost_;
+            });
+        if (!listen_address.empty()) {
+            omq_->listen_plain(listen_address,
+                               [](std::string_view, std::string_view, bool) {
+                                   return oxenmq::AuthLevel::admin;
+                               });
+        }
+        omq_->start();
+    }
+
+    OxendOmqClient& oxend() { return *oxend_; }
+
+    std::vector<std::string> blocks() const {
+        std::lock_guard guard(mutex_);
+        return blocks_;
+    }
+
+    int num_lost() const {
+        std::lock_guard guard(mutex_);
+        return num_lost_;
+    }
+
+  private:
+    mutable std::mutex mutex_;
+    std::vector<std::string> blocks_;
+    int num_lost_ = 0;
+    // As in `OxenmqServer`, OxenMQ's threads are stopped first
+    std::unique_ptr<OxendOmqClient> oxend_;
+    std::unique_ptr<oxenmq::OxenMQ> omq_;
+};
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(oxend_omq_client)
+
+BOOST_AUTO_TEST_CASE(it_subscribes_to_new_blocks) {
+    MockOxend oxend(mock_oxend_address());
+    MockStorageServer server(mock_oxend_address());
+    server.oxend().connect();
+
+    // Subscribing might have missed blocks, so it's reported without a hash
+    BOOST_REQUIRE(eventually([&] { return server.blocks().size() == 1; }));
+    BOOST_CHECK_EQUAL(server.blocks()[0], "");
+    BOOST_CHECK(server.oxend().connected());
+    BOOST_CHECK(server.oxend().subscribed());
+
+    oxend.notify_block(101, "beef");
+    BOOST_REQUIRE(eventually([&] { return server.blocks().size() == 2; }));
+    BOOST_CHECK_EQUAL(server.blocks()[1], "beef");
+}
+
+BOOST_AUTO_TEST_CASE(it_only_takes_blocks_from_oxend) {
+    MockOxend oxend(mock_oxend_address());
+    MockStorageServer server(mock_oxend_address(),
+                             mock_storage_server_address());
+    server.oxend().connect();
+    BOOST_REQUIRE(eventually([&] { return server.blocks().size() == 1; }));
+
+    // Another peer with access to the "notify" category
+    oxenmq::OxenMQ stranger;
+    stranger.start();
+    std::atomic<bool> sent{false};
+    stranger.connect_remote(
+        oxenmq::address{mock_storage_server_address()},
+        [&](oxenmq::ConnectionID conn) {
+            stranger.send(conn, "notify.block", "101", "dead");
+            sent = true;
+        },
+        [](oxenmq::ConnectionID, std::string_view) {});
+    BOOST_REQUIRE(eventually([&] { return sent.load(); }));
+
+    oxend.notify_block(101, "beef");
+    BOOST_REQUIRE(eventually([&] { return server.blocks().size() >= 2; }));
+    std::this_thread::sleep_for(100ms);
+    const auto blocks = server.blocks();
+    BOOST_CHECK_EQUAL(blocks.size(), 2);
+    BOOST_CHECK(std::find(blocks.begin(), blocks.end(), "dead") ==
+                blocks.end());
+}
+
+BOOST_AUTO_TEST_CASE(it_renews_the_subscription) {
+    MockOxend oxend(mock_oxend_address());
+    MockStorageServer server(mock_oxend_address());
+    server.oxend().connect(50ms, 100ms);
+
+    BOOST_REQUIRE(eventually([&] { return oxend.num_sub_requests() >= 3; }));
+    // Renewing an existing subscription doesn't count as a new block
+    BOOST_CHECK_EQUAL(server.blocks().size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(it_reports_a_lost_subscription) {
+    MockOxend oxend(mock_oxend_address());
+    MockStorageServer server(mock_oxend_address());
+    server.oxend().connect(50ms, 100ms);
+    BOOST_REQUIRE(eventually([&] { return server.oxend().subscribed(); }));
+    BOOST_CHECK_EQUAL(server.num_lost(), 0);
+
+    // The next renewal fails, so we can't count on getting new blocks
+    oxend.refuse_subscriptions();
+    BOOST_REQUIRE(eventually([&] { return server.num_lost() == 1; }));
+    BOOST_CHECK(!server.oxend().subscribed());
+}
+
+BOOST_AUTO_TEST_CASE(it_makes_rpc_requests) {
+    MockOxend oxend(mock_oxend_address());
+    MockStorageServer server(mock_oxend_address());
+    server.oxend().connect();
+    BOOST_REQUIRE(eventually([&] { return server.oxend().connected(); }));
+
+    std::mutex mutex;
+    std::optional<std::pair<bool, std::string>> response;
+    server.oxend().request("get_service_nodes",
+                           {{"poll_block_hash", "abcd"}},
+                           [&](bool success, std::string body) {
+                               std::lock_guard guard(mutex);
+                               response.emplace(success, std::move(body));
+                           });
+
+    BOOST_REQUIRE(eventually([&] {
+        std::lock_guard guard(mutex);
+        return response.has_value();
+    }));
+    BOOST_CHECK(response->first);
+    BOOST_CHECK_EQUAL(nlohmann::json::parse(response->second), oxend.result);
+    BOOST_CHECK_EQUAL(oxend.last_params().at("poll_block_hash"), "abcd");
+}
+
+BOOST_AUTO_TEST_CASE(it_fails_requests_until_connected) {
+    // Nothing is listening there
+    MockStorageServer server(mock_oxend_address());
+
+    bool called = false, succeeded = true;
+    server.oxend().request("get_service_nodes", {},
+                           [&](bool success, std::string) {
+                               called = true;
+                               succeeded = success;
+                           });
+    BOOST_CHECK(called);
+    BOOST_CHECK(!succeeded);
+    BOOST_CHECK(!server.oxend().subscribed());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,8 +1,10 @@
 #include "pow.hpp"
+#include "sha512_multi.hpp"
 #include "utils.hpp"
 
 #include <boost/test/unit_test.hpp>
 #include <chrono>
+#include <openssl/sha.h>
 
 using namespace std::chrono_literals;
 
@@ -49,6 +51,14 @@ BOOST_AUTO_TEST_CASE(util_parses_a_valid_ttl) {
     BOOST_CHECK_EQUAL(util::parseTTL("", ttl), false);
 }
 
+BOOST_AUTO_TEST_CASE(util_checks_canonical_decimals) {
+    for (const char* str : {"0", "7", "10000", "1554859211"})
+        BOOST_CHECK_MESSAGE(util::isCanonicalDecimal(str), str);
+    for (const char* str : {"", "00", "0345600", "+345600", "-1", " 345600",
+                            "345600 ", "345600.0", "345600abc", "3e5"})
+        BOOST_CHECK_MESSAGE(!util::isCanonicalDecimal(str), str);
+}
+
 BOOST_AUTO_TEST_CASE(it_checks_a_valid_pow) {
     using namespace valid_pow;
     std::string messageHash;
@@ -133,6 +143,132 @@ BOOST_AUTO_TEST_CASE(it_checks_correct_difficulty) {
     const std::vector<pow_difficulty_t> history3{pow_difficulty_t{t3, 1000},
                                                  pow_difficulty_t{t4, 10}};
     BOOST_CHECK_EQUAL(get_valid_difficulty(timestamp, history3), 10);
+    BOOST_CHECK_EQUAL(get_valid_difficulty(1554859211, history3), 10);
+}
+
+BOOST_AUTO_TEST_CASE(it_checks_pow_of_parsed_messages) {
+    using namespace valid_pow;
+
+    pow_hash_t hash;
+    BOOST_CHECK(checkPoW(nonce, 1554859211, 345600, pubkey, data, hash, 10));
+    std::string expected;
+    checkPoW(nonce, timestamp, ttl, pubkey, data, expected, 10);
+    BOOST_CHECK_EQUAL(std::string(hash.begin(), hash.end()), expected);
+
+    BOOST_CHECK(
+        !checkPoW("AAAAAAABBCF=", 1554859211, 345600, pubkey, data, hash, 10));
+    BOOST_CHECK(!checkPoW(nonce, 1549252653, 345600, pubkey, data, hash, 10));
+    BOOST_CHECK(!checkPoW(nonce, 1554859211, 1000, pubkey, data, hash, 10));
+    BOOST_CHECK(
+        !checkPoW("not base64!", 1554859211, 345600, pubkey, data, hash, 10));
+
+    // Nonces longer than a decoding chunk
+    for (const std::string& long_nonce :
+         {std::string(100, 'A'), std::string(130, 'B') + "==",
+          std::string(131, 'C')}) {
+        checkPoW(long_nonce, 1554859211, 345600, pubkey, data, hash, 10);
+        checkPoW(long_nonce, timestamp, ttl, pubkey, data, expected, 10);
+        BOOST_CHECK_EQUAL(std::string(hash.begin(), hash.end()), expected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(it_hashes_non_canonical_strings_differently) {
+    using namespace valid_pow;
+
+    // A TTL with a leading zero, as a client might send it, parses to the
+    // same value, but the parsed value is hashed as "345600": the client's
+    // PoW over "0345600" can't match, so the store handler rejects such
+    // strings before checking it
+    uint64_t ttlInt;
+    BOOST_REQUIRE(util::parseTTL("0345600", ttlInt));
+    BOOST_CHECK_EQUAL(ttlInt, 345600);
+    BOOST_CHECK(!util::isCanonicalDecimal("0345600"));
+
+    std::string sent;
+    checkPoW(nonce, timestamp, "0345600", pubkey, data, sent, 10);
+    pow_hash_t hash;
+    checkPoW(nonce, 1554859211, ttlInt, pubkey, data, hash, 10);
+    BOOST_CHECK_NE(std::string(hash.begin(), hash.end()), sent);
+
+    BOOST_CHECK(!util::isCanonicalDecimal("01554859211"));
+    BOOST_CHECK(!util::isCanonicalDecimal(" 1554859211"));
+    checkPoW(nonce, " 1554859211", ttl, pubkey, data, sent, 10);
+    BOOST_CHECK_NE(std::string(hash.begin(), hash.end()), sent);
+}
+
+BOOST_AUTO_TEST_CASE(it_hashes_several_messages_at_once) {
+    // Lengths around the block boundaries, where padding spills over
+    std::vector<std::string> messages;
+    for (size_t size : {0, 1, 111, 112, 113, 127, 128, 129, 240, 1000}) {
+        std::string message;
+        for (size_t i = 0; i < size; ++i)
+            message += static_cast<char>(i * 7 + size);
+        messages.push_back(message);
+    }
+
+    for (auto kernel : {sha512_kernel::SCALAR, sha512_kernel::AVX2,
+                        sha512_kernel::AVX512}) {
+        if (!sha512_kernel_supported(kernel))
+            continue;
+
+        // Each message split into pieces
+        std::vector<sha512_input_t> inputs;
+        for (const std::string_view message : messages) {
+            const size_t third = message.size() / 3;
+            inputs.push_back(sha512_input_t{
+                {message.substr(0, third), message.substr(third, third),
+                 message.substr(2 * third)}});
+        }
+        std::vector<sha512_digest_t> digests(inputs.size());
+        sha512_multi(inputs.data(), inputs.size(), digests.data(), kernel);
+
+        for (size_t i = 0; i < messages.size(); ++i) {
+            sha512_digest_t expected;
+            SHA512(reinterpret_cast<const unsigned char*>(messages[i].data()),
+                   messages[i].size(), expected.data());
+            BOOST_CHECK(digests[i] == expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(it_checks_pow_in_batches) {
+    using namespace valid_pow;
+
+    const std::string other_pubkey =
+        "05d5970e75efb8e8daccd4d07f5f59e744c3aea25cec8bfa3e43674c4a55875f4c";
+    // The valid message, then variations that must be rejected
+    std::vector<pow_message_t> messages;
+    for (int i = 0; i < 3; ++i)
+        messages.push_back({nonce, 1554859211, 345600, pubkey, data, 10});
+    messages.push_back({"AAAAAAABBCF=", 1554859211, 345600, pubkey, data, 10});
+    messages.push_back({nonce, 1549252653, 345600, pubkey, data, 10});
+    messages.push_back({nonce, 1554859211, 345601, pubkey, data, 10});
+    messages.push_back({nonce, 1554859211, 345600, other_pubkey, data, 10});
+    messages.push_back({"not base64!", 1554859211, 345600, pubkey, data, 10});
+    messages.push_back({nonce, 1554859211, 1000, pubkey, data, 10});
+    messages.push_back({nonce, 1554859211, 345600, pubkey, data, 10});
+
+    std::unique_ptr<bool[]> valid(new bool[messages.size()]);
+    std::vector<pow_hash_t> hashes(messages.size());
+    checkPoW_batch(messages.data(), messages.size(), valid.get(),
+                   hashes.data());
+
+    // Same results as one at a time
+    for (size_t i = 0; i < messages.size(); ++i) {
+        const auto& m = messages[i];
+        std::string hash;
+        const bool expected = checkPoW(
+            std::string(m.nonce), std::to_string(m.timestamp),
+            std::to_string(m.ttl), std::string(m.recipient),
+            std::string(m.data), hash, m.difficulty);
+        BOOST_CHECK_EQUAL(valid[i], expected);
+        if (!hash.empty())
+            BOOST_CHECK_EQUAL(std::string(hashes[i].begin(), hashes[i].end()),
+                              hash);
+    }
+    BOOST_CHECK(valid[0] && valid[9]);
+    for (size_t i = 3; i < 9; ++i)
+        BOOST_CHECK(!valid[i]);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -35,6 +35,51 @@ BOOST_AUTO_TEST_CASE(it_serializes_and_deserializes) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(it_serializes_binary_payloads) {
+
+    const auto pub_key =
+        "054368520005786b249bcd461d28f75e560ea794014eeb17fcf6003f37d876783e";
+    const std::string data(400, 'A');
+    const auto hash = "hash";
+    const uint64_t timestamp = 12345678;
+    const uint64_t ttl = 3456000;
+    const auto nonce = "nonce";
+    message_t msg{pub_key, data, hash, ttl, timestamp, nonce};
+    // Not valid base64, so sent as is
+    message_t text_msg{pub_key, "data!", hash, ttl, timestamp, nonce};
+    // Valid base64, but not as it would be encoded again (without padding),
+    // so also sent as is
+    message_t unpadded_msg{pub_key, "QQ", hash, ttl, timestamp, nonce};
+    const std::vector<message_t> inputs{msg, text_msg, unpadded_msg};
+
+    const auto batches = serialize_messages(inputs, true);
+    BOOST_REQUIRE_EQUAL(batches.size(), 1);
+    BOOST_CHECK_LT(batches[0].size(), serialize_messages(inputs)[0].size());
+
+    const auto messages = deserialize_messages(batches[0], true);
+    BOOST_REQUIRE_EQUAL(messages.size(), 3);
+    BOOST_CHECK_EQUAL(messages[0].data, data);
+    BOOST_CHECK_EQUAL(messages[0].hash, hash);
+    BOOST_CHECK_EQUAL(messages[0].nonce, nonce);
+    BOOST_CHECK_EQUAL(messages[1].data, "data!");
+    BOOST_CHECK_EQUAL(messages[2].data, "QQ");
+}
+
+BOOST_AUTO_TEST_CASE(it_rejects_unknown_payload_encodings) {
+
+    const std::string pub_key =
+        "054368520005786b249bcd461d28f75e560ea794014eeb17fcf6003f37d876783e";
+    const std::string hash = "hash";
+    message_t msg{pub_key, "data", hash, 3456000, 12345678, "nonce"};
+    std::string buffer;
+    serialize_message(buffer, msg, true);
+    BOOST_REQUIRE_EQUAL(deserialize_messages(buffer, true).size(), 1);
+
+    // The encoding byte comes after the pubkey and the length-prefixed hash
+    buffer[pub_key.size() + sizeof(size_t) + hash.size()] = 0x7f;
+    BOOST_CHECK(deserialize_messages(buffer, true).empty());
+}
+
 BOOST_AUTO_TEST_CASE(it_serialises_in_batches) {
     const auto pub_key =
         "054368520005786b249bcd461d28f75e560ea794014eeb17fcf6003f37d876783e";
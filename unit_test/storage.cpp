@@ -1,13 +1,23 @@
 #include "Database.hpp"
+#include "HashFilter.hpp"
+#include "LogDatabase.hpp"
+#include "MemoryDatabase.hpp"
+#include "ShardedDatabase.hpp"
 #include "utils.hpp"
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <filesystem>
 #include <iostream>
+#include <mutex>
+#include <set>
 #include <string>
 #include <thread>
 
 #include <boost/test/unit_test.hpp>
+#include <fmt/format.h>
+#include <sqlite3.h>
 
 using oxen::storage::Item;
 
@@ -17,17 +27,51 @@ using namespace std::literals;
 
 struct StorageRAIIFixture {
     StorageRAIIFixture() {
-        if (std::filesystem::remove("storage.db")) {
+        if (remove_db_files()) {
             std::cout << "Pre-test db removal" << std::endl;
         }
     }
     ~StorageRAIIFixture() {
-        if (std::filesystem::remove("storage.db")) {
+        if (remove_db_files()) {
             std::cout << "Post-test db removal" << std::endl;
         }
     }
+
+  private:
+    // WAL mode leaves `-wal` and `-shm` files next to the database while
+    // it is open
+    static bool remove_db_files() {
+        std::filesystem::remove("storage.db-wal");
+        std::filesystem::remove("storage.db-shm");
+        return std::filesystem::remove("storage.db");
+    }
 };
 
+// The names of the message partitions of an open database
+static std::vector<std::string> partition_names(sqlite3* db) {
+    std::vector<std::string> names;
+    sqlite3_exec(
+        db,
+        "SELECT name FROM sqlite_master WHERE type = 'table' AND "
+        "name LIKE 'Messages\\_%' ESCAPE '\\' ORDER BY name",
+        [](void* names, int, char** argv, char**) {
+            static_cast<std::vector<std::string>*>(names)->push_back(argv[0]);
+            return 0;
+        },
+        &names, nullptr);
+    return names;
+}
+
+// All the message partitions of an open database, as a subquery
+static std::string all_partitions(sqlite3* db) {
+    std::string query;
+    for (const auto& name : partition_names(db)) {
+        query += query.empty() ? "(" : " UNION ALL ";
+        query += "SELECT * FROM `" + name + "`";
+    }
+    return query + ")";
+}
+
 BOOST_AUTO_TEST_SUITE(storage)
 
 BOOST_AUTO_TEST_CASE(it_creates_the_database_file) {
@@ -38,6 +82,16 @@ BOOST_AUTO_TEST_CASE(it_creates_the_database_file) {
     BOOST_CHECK(std::filesystem::exists("storage.db"));
 }
 
+BOOST_AUTO_TEST_CASE(it_uses_write_ahead_logging) {
+    StorageRAIIFixture fixture;
+
+    boost::asio::io_context ioc;
+    Database storage(ioc, ".");
+    BOOST_CHECK(storage.store("myhash", "mypubkey", "bytesasstring", 100000,
+                              util::get_time_ms(), "nonce"));
+    BOOST_CHECK(std::filesystem::exists("storage.db-wal"));
+}
+
 BOOST_AUTO_TEST_CASE(it_stores_data_persistently) {
     StorageRAIIFixture fixture;
 
@@ -180,20 +234,24 @@ BOOST_AUTO_TEST_CASE(it_removes_expired_entries) {
 
     Database storage(ioc, ".");
 
-    /// Note: `Database` is not thread safe
-    /// and not meant to be used in this way;
-    /// However, it should be fine for tests
     std::thread t([&]() { ioc.run(); });
 
     BOOST_CHECK(storage.store("hash0", pubkey, "bytesasstring0", 100000,
                               util::get_time_ms(), "nonce"));
+    // Expired messages are removed along with their partition, once every
+    // message in it has expired
     BOOST_CHECK(storage.store("hash1", pubkey, "bytesasstring0", 0,
-                              util::get_time_ms(), "nonce"));
+                              util::get_time_ms() - 24h / 1ms, "nonce"));
     {
+        // expired messages are never returned, even before cleanup
         std::vector<Item> items;
         const auto lastHash = "";
         BOOST_CHECK(storage.retrieve(pubkey, items, lastHash));
-        BOOST_CHECK_EQUAL(items.size(), 2);
+        BOOST_CHECK_EQUAL(items.size(), 1);
+        BOOST_CHECK_EQUAL(items[0].hash, "hash0");
+
+        Item item;
+        BOOST_CHECK(!storage.retrieve_by_hash("hash1", item));
     }
     // the timer kicks in every 10 seconds
     // give 100ms to perform the cleanup
@@ -201,17 +259,51 @@ BOOST_AUTO_TEST_CASE(it_removes_expired_entries) {
     std::this_thread::sleep_for(10s + 100ms);
 
     {
-        std::vector<Item> items;
-        const auto lastHash = "";
-        BOOST_CHECK(storage.retrieve(pubkey, items, lastHash));
-        BOOST_CHECK_EQUAL(items.size(), 1);
-        BOOST_CHECK_EQUAL(items[0].hash, "hash0");
+        uint64_t count = 0;
+        BOOST_CHECK(storage.get_message_count(count));
+        BOOST_CHECK_EQUAL(count, 1);
     }
 
     ioc.stop();
     t.join();
 }
 
+BOOST_AUTO_TEST_CASE(it_removes_expired_entries_in_chunks) {
+    StorageRAIIFixture fixture;
+
+    const auto pubkey = "mypubkey";
+    const uint64_t timestamp = util::get_time_ms();
+
+    // more than a single cleanup chunk
+    const size_t num_expired = 5000;
+    // long enough ago for the partition to be dropped
+    const uint64_t expired = timestamp - 24h / 1ms;
+
+    boost::asio::io_context ioc;
+    std::vector<Item> items;
+    for (int i = 0; i < num_expired; ++i) {
+        items.push_back({std::to_string(i), pubkey, expired, 0, expired,
+                         "nonce", "bytesasstring"});
+    }
+    items.push_back({"fresh", pubkey, timestamp, 100000, timestamp + 100000,
+                     "nonce", "bytesasstring"});
+    {
+        Database storage(ioc, ".");
+        BOOST_CHECK(storage.bulk_store(items));
+    }
+
+    // startup cleanup happens in the background
+    Database storage(ioc, ".");
+    uint64_t count = 0;
+    for (int i = 0; i < 100; ++i) {
+        BOOST_CHECK(storage.get_message_count(count));
+        if (count == 1)
+            break;
+        std::this_thread::sleep_for(50ms);
+    }
+    BOOST_CHECK_EQUAL(count, 1);
+}
+
 BOOST_AUTO_TEST_CASE(it_stores_data_in_bulk) {
     StorageRAIIFixture fixture;
 
@@ -283,6 +375,734 @@ BOOST_AUTO_TEST_CASE(it_stores_data_in_bulk_even_when_overlaps) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(it_reads_while_bulk_storing) {
+    StorageRAIIFixture fixture;
+
+    const auto pubkey = "mypubkey";
+    const uint64_t ttl = 123456;
+    const uint64_t timestamp = util::get_time_ms();
+
+    const size_t num_items = 10000;
+
+    boost::asio::io_context ioc;
+    Database storage(ioc, ".");
+
+    BOOST_CHECK(storage.store("first", pubkey, "bytesasstring", ttl,
+                              timestamp, "nonce"));
+
+    std::vector<Item> items;
+    for (int i = 0; i < num_items; ++i) {
+        items.push_back({std::to_string(i), pubkey, timestamp, ttl,
+                         timestamp + ttl, "nonce", "bytesasstring"});
+    }
+
+    // Boost.Test assertions are only used on this thread
+    std::atomic<bool> done{false};
+    bool stored = false;
+    std::thread writer([&]() {
+        stored = storage.bulk_store(items);
+        done = true;
+    });
+
+    // Readers only ever see the state before or after the bulk transaction
+    size_t num_reads = 0;
+    size_t bad_reads = 0;
+    while (!done) {
+        std::vector<Item> results;
+        if (!storage.retrieve(pubkey, results, "") ||
+            (results.size() != 1 && results.size() != num_items + 1))
+            ++bad_reads;
+        ++num_reads;
+    }
+    writer.join();
+    std::cout << "reads during bulk store: " << num_reads << std::endl;
+    BOOST_CHECK(stored);
+    BOOST_CHECK_EQUAL(bad_reads, 0);
+
+    uint64_t count = 0;
+    BOOST_CHECK(storage.get_message_count(count));
+    BOOST_CHECK_EQUAL(count, num_items + 1);
+}
+
+BOOST_AUTO_TEST_CASE(it_commits_queued_stores) {
+    StorageRAIIFixture fixture;
+
+    const auto pubkey = "mypubkey";
+    const uint64_t ttl = 123456;
+    const uint64_t timestamp = util::get_time_ms();
+
+    const size_t num_items = 2000;
+
+    boost::asio::io_context ioc;
+    Database storage(ioc, ".");
+
+    BOOST_CHECK(storage.store("0", pubkey, "bytesasstring", ttl, timestamp,
+                              "nonce"));
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t num_callbacks = 0;
+    size_t num_saved = 0;
+
+    for (int i = 0; i < num_items; ++i) {
+        storage.store_async({std::to_string(i), pubkey, timestamp, ttl,
+                             timestamp + ttl, "nonce", "bytesasstring"},
+                            [&](bool saved) {
+                                std::lock_guard lock(mutex);
+                                ++num_callbacks;
+                                if (saved)
+                                    ++num_saved;
+                                cv.notify_one();
+                            });
+    }
+
+    {
+        std::unique_lock lock(mutex);
+        BOOST_REQUIRE(cv.wait_for(lock, 10s, [&] {
+            return num_callbacks == num_items;
+        }));
+        // "0" was already stored and is rejected as a duplicate
+        BOOST_CHECK_EQUAL(num_saved, num_items - 1);
+    }
+
+    std::vector<Item> items;
+    BOOST_CHECK(storage.retrieve(pubkey, items, ""));
+    BOOST_CHECK_EQUAL(items.size(), num_items);
+}
+
+BOOST_AUTO_TEST_CASE(it_keeps_count_of_stored_messages) {
+    StorageRAIIFixture fixture;
+
+    const auto pubkey = "mypubkey";
+    const uint64_t ttl = 123456;
+    const uint64_t timestamp = util::get_time_ms();
+
+    std::vector<Item> items;
+    for (int i = 0; i < 100; ++i) {
+        items.push_back({std::to_string(i), pubkey, timestamp, ttl,
+                         timestamp + ttl, "nonce", "bytesasstring"});
+    }
+
+    uint64_t count = 0;
+    {
+        boost::asio::io_context ioc;
+        Database storage(ioc, ".");
+
+        BOOST_CHECK(storage.get_message_count(count));
+        BOOST_CHECK_EQUAL(count, 0);
+
+        BOOST_CHECK(storage.store("0", pubkey, "bytesasstring", ttl,
+                                  timestamp, "nonce"));
+        // duplicates are not counted
+        BOOST_CHECK(storage.store("0", pubkey, "bytesasstring", ttl,
+                                  timestamp, "nonce",
+                                  Database::DuplicateHandling::IGNORE));
+        BOOST_CHECK(storage.bulk_store(items));
+
+        BOOST_CHECK(storage.get_message_count(count));
+        BOOST_CHECK_EQUAL(count, items.size());
+    }
+
+    // the count is restored on startup
+    boost::asio::io_context ioc;
+    Database storage(ioc, ".");
+    BOOST_CHECK(storage.get_message_count(count));
+    BOOST_CHECK_EQUAL(count, items.size());
+}
+
+BOOST_AUTO_TEST_CASE(it_retrieves_random_messages) {
+    StorageRAIIFixture fixture;
+
+    const auto pubkey = "mypubkey";
+    const uint64_t ttl = 123456;
+    const uint64_t timestamp = util::get_time_ms();
+
+    const size_t num_items = 10;
+
+    boost::asio::io_context ioc;
+    Database storage(ioc, ".");
+
+    Item item;
+    BOOST_CHECK(!storage.retrieve_random(item));
+
+    std::vector<Item> items;
+    for (int i = 0; i < num_items; ++i) {
+        items.push_back({std::to_string(i), pubkey, timestamp, ttl,
+                         timestamp + ttl, "nonce", "bytesasstring"});
+    }
+    // expired messages are never selected
+    items.push_back({"expired", pubkey, timestamp - 1000, 0, timestamp - 1000,
+                     "nonce", "bytesasstring"});
+    BOOST_CHECK(storage.bulk_store(items));
+
+    std::set<std::string> seen;
+    for (int i = 0; i < 1000; ++i) {
+        BOOST_REQUIRE(storage.retrieve_random(item));
+        BOOST_REQUIRE_NE(item.hash, "expired");
+        seen.insert(item.hash);
+    }
+    BOOST_CHECK_EQUAL(seen.size(), num_items);
+}
+
+BOOST_AUTO_TEST_CASE(it_iterates_over_messages_in_chunks) {
+    StorageRAIIFixture fixture;
+
+    const auto pubkey = "mypubkey";
+    const uint64_t ttl = 123456;
+    const uint64_t timestamp = util::get_time_ms();
+
+    const size_t num_items = 1050;
+
+    boost::asio::io_context ioc;
+    Database storage(ioc, ".");
+
+    std::vector<Item> items;
+    for (int i = 0; i < num_items; ++i) {
+        items.push_back({std::to_string(i), pubkey, timestamp, ttl,
+                         timestamp + ttl, "nonce", "bytesasstring"});
+    }
+    items.push_back({"expired", pubkey, timestamp - 1000, 0, timestamp - 1000,
+                     "nonce", "bytesasstring"});
+    BOOST_CHECK(storage.bulk_store(items));
+
+    std::vector<size_t> chunk_sizes;
+    size_t next = 0;
+    BOOST_CHECK(storage.for_each_chunk(
+        [&](std::vector<Item>& chunk) {
+            chunk_sizes.push_back(chunk.size());
+            for (const auto& item : chunk) {
+                BOOST_REQUIRE_EQUAL(item.hash, std::to_string(next++));
+            }
+            return true;
+        },
+        100));
+    BOOST_CHECK_EQUAL(next, num_items);
+    BOOST_CHECK_EQUAL(chunk_sizes.size(), 11);
+    BOOST_CHECK_EQUAL(chunk_sizes.back(), 50);
+
+    // stops when the callback returns false
+    size_t num_chunks = 0;
+    BOOST_CHECK(storage.for_each_chunk(
+        [&](std::vector<Item>& chunk) { return ++num_chunks < 3; }, 100));
+    BOOST_CHECK_EQUAL(num_chunks, 3);
+}
+
+BOOST_AUTO_TEST_CASE(it_tracks_the_latest_message_of_each_owner) {
+    StorageRAIIFixture fixture;
+
+    const auto now = util::get_time_ms();
+    {
+        boost::asio::io_context ioc;
+        Database storage(ioc, ".");
+        BOOST_CHECK(!storage.is_latest_message("pubkey1", "hash1"));
+
+        BOOST_CHECK(storage.store("hash1", "pubkey1", "data", 100000, now,
+                                  "nonce"));
+        BOOST_CHECK(storage.store("hash2", "pubkey2", "data", 100000, now,
+                                  "nonce"));
+        BOOST_CHECK(storage.is_latest_message("pubkey1", "hash1"));
+
+        std::vector<Item> items{{"hash3", "pubkey1", now, 100000,
+                                 now + 100000, "nonce", "data"},
+                                {"hash4", "pubkey1", now, 100000,
+                                 now + 100000, "nonce", "data"}};
+        BOOST_CHECK(storage.bulk_store(items));
+        BOOST_CHECK(!storage.is_latest_message("pubkey1", "hash1"));
+        BOOST_CHECK(storage.is_latest_message("pubkey1", "hash4"));
+        BOOST_CHECK(storage.is_latest_message("pubkey2", "hash2"));
+
+        // Duplicates don't change anything
+        BOOST_CHECK(!storage.store("hash1", "pubkey1", "data", 100000, now,
+                                   "nonce"));
+        BOOST_CHECK(storage.is_latest_message("pubkey1", "hash4"));
+    }
+
+    // The latest messages are found again on startup
+    boost::asio::io_context ioc;
+    Database storage(ioc, ".");
+    BOOST_CHECK(storage.is_latest_message("pubkey1", "hash4"));
+    BOOST_CHECK(storage.is_latest_message("pubkey2", "hash2"));
+
+    // An expired latest message doesn't count, as older messages might
+    // still be there
+    BOOST_CHECK(
+        storage.store("hash5", "pubkey2", "data", 10, now - 1000, "nonce"));
+    BOOST_CHECK(!storage.is_latest_message("pubkey2", "hash5"));
+}
+
+BOOST_AUTO_TEST_CASE(it_tracks_the_latest_message_across_concurrent_stores) {
+    StorageRAIIFixture fixture;
+
+    const auto pubkey = "mypubkey";
+    const uint64_t ttl = 123456;
+    const uint64_t timestamp = util::get_time_ms();
+
+    const size_t num_rounds = 200;
+
+    boost::asio::io_context ioc;
+    Database storage(ioc, ".");
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool committed = false;
+
+    for (size_t i = 0; i < num_rounds; ++i) {
+        // A queued store and a push batch for the same owner, committing in
+        // whatever order they get to the database
+        committed = false;
+        storage.store_async({"queued" + std::to_string(i), pubkey, timestamp,
+                             ttl, timestamp + ttl, "nonce", "bytesasstring"},
+                            [&](bool) {
+                                std::lock_guard lock(mutex);
+                                committed = true;
+                                cv.notify_one();
+                            });
+        const std::vector<Item> items{{"bulk" + std::to_string(i), pubkey,
+                                       timestamp, ttl, timestamp + ttl,
+                                       "nonce", "bytesasstring"}};
+        BOOST_REQUIRE(storage.bulk_store(items));
+        {
+            std::unique_lock lock(mutex);
+            BOOST_REQUIRE(cv.wait_for(lock, 10s, [&] { return committed; }));
+        }
+
+        // The head is whichever message was committed last
+        std::vector<Item> stored;
+        BOOST_REQUIRE(storage.retrieve(pubkey, stored, ""));
+        BOOST_REQUIRE_EQUAL(stored.size(), 2 * (i + 1));
+        BOOST_REQUIRE(storage.is_latest_message(pubkey, stored.back().hash));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(it_serves_recent_messages_from_the_cache) {
+    StorageRAIIFixture fixture;
+
+    boost::asio::io_context ioc;
+    Database storage(ioc, ".");
+    const auto& cache = *storage.message_cache();
+
+    const auto now = util::get_time_ms();
+    for (int i = 0; i < 5; ++i) {
+        BOOST_CHECK(storage.store("hash" + std::to_string(i), "mypubkey",
+                                  "data", 100000, now, "nonce"));
+    }
+
+    // Older messages might not be cached
+    std::vector<Item> items;
+    BOOST_CHECK(storage.retrieve("mypubkey", items, ""));
+    BOOST_CHECK_EQUAL(items.size(), 5);
+    BOOST_CHECK_EQUAL(cache.misses(), 1);
+    BOOST_CHECK_EQUAL(cache.hits(), 0);
+
+    items.clear();
+    BOOST_CHECK(storage.retrieve("mypubkey", items, "hash1", 2));
+    BOOST_CHECK_EQUAL(cache.hits(), 1);
+    BOOST_REQUIRE_EQUAL(items.size(), 2);
+    BOOST_CHECK_EQUAL(items[0].hash, "hash2");
+    BOOST_CHECK_EQUAL(items[1].hash, "hash3");
+
+    items.clear();
+    BOOST_CHECK(storage.retrieve("mypubkey", items, "unknown"));
+    BOOST_CHECK_EQUAL(cache.misses(), 2);
+    BOOST_CHECK_EQUAL(items.size(), 5);
+}
+
+BOOST_AUTO_TEST_CASE(it_evicts_the_least_recently_used_messages) {
+    const auto now = util::get_time_ms();
+    const auto make_item = [now](const std::string& hash,
+                                 const std::string& pubkey,
+                                 uint64_t ttl = 100000) {
+        return Item{hash, pubkey, now, ttl, now + ttl, "nonce",
+                    std::string(1000, 'x')};
+    };
+
+    // Room for about three messages
+    MessageCache cache(4000);
+    cache.add(make_item("hash1", "pubkey1"));
+    cache.add(make_item("hash2", "pubkey2"));
+    cache.add(make_item("hash3", "pubkey1"));
+
+    std::vector<Item> items;
+    BOOST_CHECK(cache.retrieve("pubkey2", "hash2", -1, items));
+    BOOST_CHECK(items.empty());
+
+    // pubkey1 was used least recently, so loses its oldest message first
+    cache.add(make_item("hash4", "pubkey2"));
+    BOOST_CHECK(!cache.retrieve("pubkey1", "hash1", -1, items));
+    BOOST_CHECK(cache.retrieve("pubkey1", "hash3", -1, items));
+    BOOST_CHECK(cache.retrieve("pubkey2", "hash2", -1, items));
+    BOOST_REQUIRE_EQUAL(items.size(), 1);
+    BOOST_CHECK_EQUAL(items[0].hash, "hash4");
+    BOOST_CHECK_LE(cache.size_bytes(), 4000);
+
+    // Expired messages are dropped
+    cache.add(make_item("hash5", "pubkey2", 1));
+    cache.remove_expired(now + 2);
+    items.clear();
+    BOOST_CHECK(cache.retrieve("pubkey2", "hash4", -1, items));
+    BOOST_CHECK(items.empty());
+    BOOST_CHECK(!cache.retrieve("pubkey2", "hash5", -1, items));
+}
+
+BOOST_AUTO_TEST_CASE(it_drops_owners_with_messages_too_big_to_cache) {
+    const auto now = util::get_time_ms();
+    const auto make_item = [now](const std::string& hash,
+                                 const std::string& pubkey, size_t size) {
+        return Item{hash, pubkey, now, 100000, now + 100000, "nonce",
+                    std::string(size, 'x')};
+    };
+
+    // Smaller than the second message
+    MessageCache cache(2000);
+    cache.add(make_item("hash1", "pubkey1", 100));
+    cache.add(make_item("hash2", "pubkey1", 5000));
+    cache.add(make_item("hash3", "pubkey2", 100));
+
+    // Continuing from hash1 can't be answered without hash2
+    std::vector<Item> items;
+    BOOST_CHECK(!cache.retrieve("pubkey1", "hash1", -1, items));
+    BOOST_CHECK(items.empty());
+    BOOST_CHECK(cache.retrieve("pubkey2", "hash3", -1, items));
+
+    // Later messages are cached again, as they are complete from there on
+    cache.add(make_item("hash4", "pubkey1", 100));
+    BOOST_CHECK(!cache.retrieve("pubkey1", "hash2", -1, items));
+    BOOST_CHECK(cache.retrieve("pubkey1", "hash4", -1, items));
+    BOOST_CHECK(items.empty());
+}
+
+BOOST_AUTO_TEST_CASE(it_stores_hex_values_as_binary) {
+    StorageRAIIFixture fixture;
+
+    const std::string hash(128, 'a');
+    const std::string pubkey = "05" + std::string(64, 'b');
+    const std::string nonce = "AAECAwQFBgc=";
+    // Not canonical hex, so kept as text
+    const std::string upper_hash(128, 'A');
+
+    {
+        boost::asio::io_context ioc;
+        Database storage(ioc, ".");
+        BOOST_CHECK(storage.store(hash, pubkey, "data", 100000,
+                                  util::get_time_ms(), nonce));
+        BOOST_CHECK(storage.store(upper_hash, pubkey, "data", 100000,
+                                  util::get_time_ms(), nonce));
+
+        std::vector<Item> items;
+        BOOST_CHECK(storage.retrieve(pubkey, items, ""));
+        BOOST_REQUIRE_EQUAL(items.size(), 2);
+        BOOST_CHECK_EQUAL(items[0].hash, hash);
+        BOOST_CHECK_EQUAL(items[0].pub_key, pubkey);
+        BOOST_CHECK_EQUAL(items[0].nonce, nonce);
+        BOOST_CHECK_EQUAL(items[1].hash, upper_hash);
+
+        Item item;
+        BOOST_CHECK(storage.retrieve_by_hash(upper_hash, item));
+        BOOST_CHECK_EQUAL(item.hash, upper_hash);
+    }
+
+    sqlite3* db;
+    BOOST_REQUIRE_EQUAL(sqlite3_open("storage.db", &db), SQLITE_OK);
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db,
+                       ("SELECT typeof(Hash), length(Hash), typeof(Owner), "
+                        "length(Nonce) FROM " +
+                        all_partitions(db) + " ORDER BY id")
+                           .c_str(),
+                       -1, &stmt, nullptr);
+    BOOST_REQUIRE_EQUAL(sqlite3_step(stmt), SQLITE_ROW);
+    BOOST_CHECK_EQUAL((const char*)sqlite3_column_text(stmt, 0), "blob");
+    BOOST_CHECK_EQUAL(sqlite3_column_int(stmt, 1), 64);
+    BOOST_CHECK_EQUAL((const char*)sqlite3_column_text(stmt, 2), "blob");
+    BOOST_CHECK_EQUAL(sqlite3_column_int(stmt, 3), 8);
+    BOOST_REQUIRE_EQUAL(sqlite3_step(stmt), SQLITE_ROW);
+    BOOST_CHECK_EQUAL((const char*)sqlite3_column_text(stmt, 0), "text");
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+}
+
+BOOST_AUTO_TEST_CASE(it_stores_payloads_as_binary) {
+    StorageRAIIFixture fixture;
+
+    const std::string data = "aGVsbG8gd29ybGQh";
+    const std::string pubkey = "mypubkey";
+
+    {
+        boost::asio::io_context ioc;
+        Database storage(ioc, ".");
+        BOOST_CHECK(storage.store("hash1", pubkey, data, 100000,
+                                  util::get_time_ms(), "nonce"));
+    }
+    {
+        // Both formats can be read back regardless of the current one
+        boost::asio::io_context ioc;
+        Database storage(ioc, ".", Database::PayloadFormat::BINARY);
+        BOOST_CHECK(storage.store("hash2", pubkey, data, 100000,
+                                  util::get_time_ms(), "nonce"));
+        BOOST_CHECK(storage.store("hash3", pubkey, "not base64", 100000,
+                                  util::get_time_ms(), "nonce"));
+
+        std::vector<Item> items;
+        BOOST_CHECK(storage.retrieve(pubkey, items, ""));
+        BOOST_REQUIRE_EQUAL(items.size(), 3);
+        BOOST_CHECK_EQUAL(items[0].data, data);
+        BOOST_CHECK_EQUAL(items[1].data, data);
+        BOOST_CHECK_EQUAL(items[2].data, "not base64");
+    }
+
+    sqlite3* db;
+    BOOST_REQUIRE_EQUAL(sqlite3_open("storage.db", &db), SQLITE_OK);
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(
+        db,
+        ("SELECT length(Data) FROM " + all_partitions(db) + " ORDER BY id")
+            .c_str(),
+        -1, &stmt, nullptr);
+    BOOST_REQUIRE_EQUAL(sqlite3_step(stmt), SQLITE_ROW);
+    BOOST_CHECK_EQUAL(sqlite3_column_int(stmt, 0), data.size());
+    BOOST_REQUIRE_EQUAL(sqlite3_step(stmt), SQLITE_ROW);
+    BOOST_CHECK_EQUAL(sqlite3_column_int(stmt, 0), 12);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+}
+
+BOOST_AUTO_TEST_CASE(it_partitions_messages_by_expiration_time) {
+    StorageRAIIFixture fixture;
+
+    const auto now = util::get_time_ms();
+    const uint64_t day = 24 * 60 * 60 * 1000;
+    const std::string pubkey = "mypubkey";
+
+    {
+        boost::asio::io_context ioc;
+        Database storage(ioc, ".");
+        // Already expired, and long enough ago for its partition to be over
+        BOOST_CHECK(storage.store("expired", pubkey, "data", day, now - 3 * day,
+                                  "nonce"));
+        // Spread over several partitions, in no particular order of expiry
+        BOOST_CHECK(storage.store("hash0", pubkey, "data", 4 * day, now,
+                                  "nonce"));
+        BOOST_CHECK(storage.store("hash1", pubkey, "data", day, now, "nonce"));
+        BOOST_CHECK(storage.store("hash2", pubkey, "data", 2 * day, now,
+                                  "nonce"));
+        BOOST_CHECK(!storage.store("hash2", pubkey, "data", 2 * day, now,
+                                   "nonce"));
+
+        std::vector<Item> items;
+        BOOST_CHECK(storage.retrieve(pubkey, items, "hash0", 1));
+        BOOST_REQUIRE_EQUAL(items.size(), 1);
+        BOOST_CHECK_EQUAL(items[0].hash, "hash1");
+    }
+
+    // Expired partitions are dropped as a whole (if the database thread
+    // hasn't already done so), leaving one partition per expiration day
+    boost::asio::io_context ioc;
+    Database storage(ioc, ".");
+
+    sqlite3* db;
+    BOOST_REQUIRE_EQUAL(sqlite3_open("storage.db", &db), SQLITE_OK);
+    BOOST_CHECK_EQUAL(partition_names(db).size(), 3);
+    sqlite3_close(db);
+
+    uint64_t count = 0;
+    BOOST_CHECK(storage.get_message_count(count));
+    BOOST_CHECK_EQUAL(count, 3);
+
+    std::vector<Item> items;
+    BOOST_CHECK(storage.retrieve(pubkey, items, ""));
+    BOOST_REQUIRE_EQUAL(items.size(), 3);
+    BOOST_CHECK_EQUAL(items[0].hash, "hash0");
+    BOOST_CHECK_EQUAL(items[1].hash, "hash1");
+    BOOST_CHECK_EQUAL(items[2].hash, "hash2");
+
+    Item item;
+    BOOST_CHECK(storage.retrieve_by_hash("hash2", item));
+
+    // Indices count through the partitions in order of expiry
+    const char* by_expiry[] = {"hash1", "hash2", "hash0"};
+    for (uint64_t i = 0; i < std::size(by_expiry); ++i) {
+        BOOST_REQUIRE(storage.retrieve_by_index(i, item));
+        BOOST_CHECK_EQUAL(item.hash, by_expiry[i]);
+    }
+    BOOST_CHECK(!storage.retrieve_by_index(3, item));
+}
+
+BOOST_AUTO_TEST_CASE(it_filters_known_hashes) {
+    HashFilter filter(100);
+    for (int i = 0; i < 10000; ++i)
+        filter.add("hash" + std::to_string(i));
+    BOOST_CHECK_EQUAL(filter.size(), 10000);
+
+    // No false negatives, even once the filter has grown
+    for (int i = 0; i < 10000; ++i)
+        BOOST_CHECK(filter.might_contain("hash" + std::to_string(i)));
+
+    int false_positives = 0;
+    for (int i = 0; i < 10000; ++i)
+        false_positives += filter.might_contain("other" + std::to_string(i));
+    BOOST_CHECK_LT(false_positives, 100);
+}
+
+BOOST_AUTO_TEST_CASE(it_checks_whether_messages_are_stored) {
+    StorageRAIIFixture fixture;
+
+    const auto now = util::get_time_ms();
+    const auto hex_hash = std::string(128, 'a');
+    {
+        boost::asio::io_context ioc;
+        Database storage(ioc, ".");
+        BOOST_CHECK(storage.store(hex_hash, "05abcd", "data", 100000, now,
+                                  "nonce"));
+        BOOST_CHECK(storage.store("hash1", "05abcd", "data", 100000, now,
+                                  "nonce"));
+
+        BOOST_CHECK(storage.contains(hex_hash, now + 100000));
+        BOOST_CHECK(storage.contains("hash1", now + 100000));
+        BOOST_CHECK(!storage.contains("hash2", now + 100000));
+        // A message expiring at a different time is a different message
+        BOOST_CHECK(!storage.contains("hash1", now + 3 * 24 * 60 * 60 * 1000));
+    }
+
+    // The filters are rebuilt on startup
+    boost::asio::io_context ioc;
+    Database storage(ioc, ".");
+    BOOST_CHECK(storage.contains(hex_hash, now + 100000));
+    BOOST_CHECK(storage.contains("hash1", now + 100000));
+    BOOST_CHECK(!storage.contains("hash2", now + 100000));
+
+    std::vector<Item> items{
+        Item{"hash2", "05abcd", now, 100000, now + 100000, "nonce", "data"}};
+    BOOST_CHECK(storage.bulk_store(items));
+    BOOST_CHECK(storage.contains("hash2", now + 100000));
+}
+
+// Create a database with the schema used by older versions
+static void create_legacy_db(size_t num_entries, const std::string& pubkey) {
+    sqlite3* db;
+    BOOST_REQUIRE_EQUAL(sqlite3_open("storage.db", &db), SQLITE_OK);
+    BOOST_REQUIRE_EQUAL(
+        sqlite3_exec(db,
+                     "CREATE TABLE `Data`("
+                     "    `Hash` VARCHAR(128) NOT NULL,"
+                     "    `Owner` VARCHAR(256) NOT NULL,"
+                     "    `TTL` INTEGER NOT NULL,"
+                     "    `Timestamp` INTEGER NOT NULL,"
+                     "    `TimeExpires` INTEGER NOT NULL,"
+                     "    `Nonce` VARCHAR(128) NOT NULL,"
+                     "    `Data` BLOB"
+                     ");"
+                     "CREATE UNIQUE INDEX `idx_data_hash` ON `Data` (`Hash`);"
+                     "CREATE INDEX `idx_data_owner` on `Data` ('Owner');"
+                     "BEGIN;",
+                     nullptr, nullptr, nullptr),
+        SQLITE_OK);
+
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db,
+                       "INSERT INTO Data (Hash, Owner, TTL, Timestamp, "
+                       "TimeExpires, Nonce, Data) VALUES (?,?,?,?,?,?,?)",
+                       -1, &stmt, nullptr);
+    const auto now = util::get_time_ms();
+    for (size_t i = 0; i < num_entries; ++i) {
+        char hash[129];
+        snprintf(hash, sizeof(hash), "%0128zx", i);
+        const std::string nonce = "AAECAwQFBgc=";
+        // The first message has already expired
+        const uint64_t ttl = i == 0 ? 1 : 100000;
+        const uint64_t timestamp = i == 0 ? now - 1000 : now;
+        sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, pubkey.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, ttl);
+        sqlite3_bind_int64(stmt, 4, timestamp);
+        sqlite3_bind_int64(stmt, 5, timestamp + ttl);
+        sqlite3_bind_blob(stmt, 6, nonce.data(), nonce.size(),
+                          SQLITE_TRANSIENT);
+        sqlite3_bind_blob(stmt, 7, "data", 4, SQLITE_STATIC);
+        BOOST_REQUIRE_EQUAL(sqlite3_step(stmt), SQLITE_DONE);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+    sqlite3_close(db);
+}
+
+BOOST_AUTO_TEST_CASE(it_migrates_legacy_messages) {
+    StorageRAIIFixture fixture;
+
+    const std::string pubkey = "05" + std::string(64, 'c');
+    const size_t num_entries = 5000;
+    create_legacy_db(num_entries, pubkey);
+
+    boost::asio::io_context ioc;
+    Database storage(ioc, ".");
+
+    const auto check_messages = [&](size_t expected) {
+        std::vector<Item> items;
+        BOOST_CHECK(storage.retrieve(pubkey, items, ""));
+        BOOST_REQUIRE_EQUAL(items.size(), expected);
+        // Messages are returned in their original order
+        for (size_t i = 0; i < num_entries - 1; ++i) {
+            char hash[129];
+            snprintf(hash, sizeof(hash), "%0128zx", i + 1);
+            BOOST_REQUIRE_EQUAL(items[i].hash, hash);
+            BOOST_REQUIRE_EQUAL(items[i].nonce, "AAECAwQFBgc=");
+            BOOST_REQUIRE_EQUAL(items[i].data, "data");
+        }
+        return items;
+    };
+
+    // Legacy messages are served while (and after) they are migrated
+    check_messages(num_entries - 1);
+
+    // Hashes are unique across the old and the new table
+    char legacy_hash[129];
+    snprintf(legacy_hash, sizeof(legacy_hash), "%0128zx", num_entries - 1);
+    BOOST_CHECK(!storage.store(legacy_hash, pubkey, "data", 100000,
+                               util::get_time_ms(), "nonce"));
+
+    // New messages come after the legacy ones
+    const std::string new_hash(128, 'f');
+    BOOST_CHECK(storage.store(new_hash, pubkey, "new", 100000,
+                              util::get_time_ms(), "nonce"));
+    {
+        std::vector<Item> items;
+        BOOST_CHECK(storage.retrieve(pubkey, items, legacy_hash));
+        BOOST_REQUIRE_EQUAL(items.size(), 1);
+        BOOST_CHECK_EQUAL(items[0].hash, new_hash);
+    }
+
+    // Wait for the migration to finish
+    sqlite3* db;
+    BOOST_REQUIRE_EQUAL(
+        sqlite3_open_v2("storage.db", &db, SQLITE_OPEN_READONLY, nullptr),
+        SQLITE_OK);
+    int64_t legacy_left = -1;
+    for (int i = 0; i < 100 && legacy_left != 0; ++i) {
+        std::this_thread::sleep_for(50ms);
+        sqlite3_exec(
+            db, "SELECT count(*) FROM Data",
+            [](void* count, int, char** argv, char**) {
+                *static_cast<int64_t*>(count) = std::stoll(argv[0]);
+                return 0;
+            },
+            &legacy_left, nullptr);
+    }
+    sqlite3_close(db);
+    BOOST_CHECK_EQUAL(legacy_left, 0);
+
+    const auto items = check_messages(num_entries);
+    BOOST_CHECK_EQUAL(items.back().hash, new_hash);
+
+    // The expired legacy message was not carried over
+    uint64_t count;
+    BOOST_CHECK(storage.get_message_count(count));
+    BOOST_CHECK_EQUAL(count, num_entries);
+
+    Item item;
+    BOOST_CHECK(storage.retrieve_by_index(count - 1, item));
+    BOOST_CHECK(!storage.retrieve_by_index(count, item));
+}
+
 BOOST_AUTO_TEST_CASE(bulk_performance_check) {
     const auto pubkey = "mypubkey";
     const auto bytes = "bytesasstring";
@@ -380,3 +1200,407 @@ BOOST_AUTO_TEST_CASE(it_checks_the_retrieve_limit_works) {
 }
 
 BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(memory_database)
+
+BOOST_AUTO_TEST_CASE(it_stores_and_retrieves_messages_in_order) {
+    boost::asio::io_context ioc;
+    MemoryDatabase storage(ioc);
+
+    const auto now = util::get_time_ms();
+    for (int i = 0; i < 5; i++) {
+        BOOST_CHECK(storage.store("hash" + std::to_string(i), "mypubkey",
+                                  "bytes", 100000, now, "nonce"));
+    }
+    BOOST_CHECK(storage.store("other", "otherpubkey", "bytes", 100000, now,
+                              "nonce"));
+
+    // Duplicates are rejected unless ignored
+    BOOST_CHECK(!storage.store("hash0", "mypubkey", "bytes", 100000, now,
+                               "nonce"));
+    BOOST_CHECK(storage.store("hash0", "mypubkey", "bytes", 100000, now,
+                              "nonce",
+                              MemoryDatabase::DuplicateHandling::IGNORE));
+
+    uint64_t count = 0;
+    BOOST_CHECK(storage.get_message_count(count));
+    BOOST_CHECK_EQUAL(count, 6);
+
+    std::vector<Item> items;
+    BOOST_CHECK(storage.retrieve("mypubkey", items, ""));
+    BOOST_REQUIRE_EQUAL(items.size(), 5);
+    BOOST_CHECK_EQUAL(items.front().hash, "hash0");
+    BOOST_CHECK_EQUAL(items.back().hash, "hash4");
+
+    items.clear();
+    BOOST_CHECK(storage.retrieve("mypubkey", items, "hash1", 2));
+    BOOST_REQUIRE_EQUAL(items.size(), 2);
+    BOOST_CHECK_EQUAL(items[0].hash, "hash2");
+    BOOST_CHECK_EQUAL(items[1].hash, "hash3");
+
+    BOOST_CHECK(storage.is_latest_message("mypubkey", "hash4"));
+    BOOST_CHECK(!storage.is_latest_message("mypubkey", "hash3"));
+
+    BOOST_CHECK(storage.contains("hash2", now + 100000));
+    BOOST_CHECK(!storage.contains("hash5", now + 100000));
+
+    Item item;
+    BOOST_CHECK(storage.retrieve_by_hash("other", item));
+    BOOST_CHECK_EQUAL(item.pub_key, "otherpubkey");
+    BOOST_CHECK(storage.retrieve_random(item));
+
+    // Chunks cover every message once, in insertion order
+    std::vector<std::string> hashes;
+    BOOST_CHECK(storage.for_each_chunk(
+        [&hashes](std::vector<Item>& chunk) {
+            for (const auto& item : chunk)
+                hashes.push_back(item.hash);
+            return true;
+        },
+        4));
+    BOOST_CHECK_EQUAL(hashes.size(), 6);
+    BOOST_CHECK_EQUAL(hashes.back(), "other");
+}
+
+BOOST_AUTO_TEST_CASE(it_removes_expired_messages) {
+    boost::asio::io_context ioc;
+    MemoryDatabase storage(ioc);
+
+    const auto now = util::get_time_ms();
+    BOOST_CHECK(storage.store("old", "mypubkey", "bytes", 10, now - 1000,
+                              "nonce"));
+    BOOST_CHECK(storage.store("new", "mypubkey", "bytes", 100000, now,
+                              "nonce"));
+
+    // Expired messages are never returned, even before they are removed
+    std::vector<Item> items;
+    BOOST_CHECK(storage.retrieve("mypubkey", items, ""));
+    BOOST_REQUIRE_EQUAL(items.size(), 1);
+    BOOST_CHECK_EQUAL(items[0].hash, "new");
+
+    storage.remove_expired(now);
+
+    uint64_t count = 0;
+    BOOST_CHECK(storage.get_message_count(count));
+    BOOST_CHECK_EQUAL(count, 1);
+
+    Item item;
+    BOOST_CHECK(!storage.retrieve_by_hash("old", item));
+
+    // The hash can be stored again once the message is gone
+    bool added = false;
+    storage.store_async(Item{"old", "mypubkey", now, 100000, now + 100000,
+                             "nonce", "bytes"},
+                        [&added](bool result) { added = result; });
+    BOOST_CHECK(added);
+    BOOST_CHECK(storage.is_latest_message("mypubkey", "old"));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(log_database)
+
+struct LogRAIIFixture {
+    LogRAIIFixture() { std::filesystem::remove_all("messages"); }
+    ~LogRAIIFixture() { std::filesystem::remove_all("messages"); }
+};
+
+BOOST_AUTO_TEST_CASE(it_reloads_messages_from_segments) {
+    LogRAIIFixture fixture;
+
+    const auto now = util::get_time_ms();
+    {
+        boost::asio::io_context ioc;
+        LogDatabase storage(ioc, ".");
+        // Different expiration times go into different segments
+        BOOST_CHECK(storage.store("hash0", "mypubkey", "bytes0", 100000, now,
+                                  "nonce"));
+        BOOST_CHECK(storage.store("hash1", "mypubkey", "bytes1",
+                                  3 * 24 * 60 * 60 * 1000, now, "nonce"));
+        BOOST_CHECK(storage.store("hash2", "mypubkey", "bytes2", 100000, now,
+                                  "nonce"));
+        BOOST_CHECK(!storage.store("hash2", "mypubkey", "bytes2", 100000, now,
+                                   "nonce"));
+    }
+
+    boost::asio::io_context ioc;
+    LogDatabase storage(ioc, ".");
+
+    uint64_t count = 0;
+    BOOST_CHECK(storage.get_message_count(count));
+    BOOST_CHECK_EQUAL(count, 3);
+
+    // The order of messages survives across segments
+    std::vector<Item> items;
+    BOOST_CHECK(storage.retrieve("mypubkey", items, "hash0"));
+    BOOST_REQUIRE_EQUAL(items.size(), 2);
+    BOOST_CHECK_EQUAL(items[0].hash, "hash1");
+    BOOST_CHECK_EQUAL(items[0].data, "bytes1");
+    BOOST_CHECK_EQUAL(items[1].hash, "hash2");
+    BOOST_CHECK(storage.is_latest_message("mypubkey", "hash2"));
+
+    // New messages continue after the reloaded ones
+    BOOST_CHECK(storage.store("hash3", "mypubkey", "bytes3", 100000, now,
+                              "nonce"));
+    items.clear();
+    BOOST_CHECK(storage.retrieve("mypubkey", items, "hash2"));
+    BOOST_REQUIRE_EQUAL(items.size(), 1);
+    BOOST_CHECK_EQUAL(items[0].hash, "hash3");
+}
+
+BOOST_AUTO_TEST_CASE(it_expires_whole_segments) {
+    LogRAIIFixture fixture;
+
+    boost::asio::io_context ioc;
+    LogDatabase storage(ioc, ".");
+
+    const auto now = util::get_time_ms();
+    const uint64_t day = 24 * 60 * 60 * 1000;
+    BOOST_CHECK(storage.store("short", "mypubkey", "bytes", 1000, now,
+                              "nonce"));
+    BOOST_CHECK(storage.store("long", "mypubkey", "bytes", day, now,
+                              "nonce"));
+
+    const auto count_segments = [] {
+        return std::distance(std::filesystem::directory_iterator("messages"),
+                             std::filesystem::directory_iterator{});
+    };
+    BOOST_CHECK_EQUAL(count_segments(), 2);
+
+    // Past the window of the first segment, but not the second one
+    storage.remove_expired(now + day / 2);
+    BOOST_CHECK_EQUAL(count_segments(), 1);
+
+    uint64_t count = 0;
+    BOOST_CHECK(storage.get_message_count(count));
+    BOOST_CHECK_EQUAL(count, 1);
+    Item item;
+    BOOST_CHECK(!storage.retrieve_by_hash("short", item));
+    BOOST_CHECK(storage.retrieve_by_hash("long", item));
+    BOOST_CHECK(storage.retrieve_random(item));
+    BOOST_CHECK_EQUAL(item.hash, "long");
+}
+
+BOOST_AUTO_TEST_CASE(it_syncs_queued_stores_on_its_own_thread) {
+    LogRAIIFixture fixture;
+
+    boost::asio::io_context ioc;
+    LogDatabase storage(ioc, ".");
+
+    const auto now = util::get_time_ms();
+    BOOST_CHECK(storage.store("0", "mypubkey", "bytes", 100000, now, "nonce"));
+
+    const int num_items = 100;
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t num_callbacks = 0;
+    size_t num_saved = 0;
+    bool on_caller_thread = false;
+    const auto caller = std::this_thread::get_id();
+
+    for (int i = 0; i < num_items; ++i) {
+        storage.store_async({std::to_string(i), "mypubkey", now, 100000,
+                             now + 100000, "nonce", "bytes"},
+                            [&](bool saved) {
+                                std::lock_guard lock(mutex);
+                                ++num_callbacks;
+                                if (saved)
+                                    ++num_saved;
+                                if (std::this_thread::get_id() == caller)
+                                    on_caller_thread = true;
+                                cv.notify_one();
+                            });
+    }
+
+    {
+        std::unique_lock lock(mutex);
+        BOOST_REQUIRE(cv.wait_for(lock, 10s, [&] {
+            return num_callbacks == num_items;
+        }));
+        // "0" was already stored and is rejected as a duplicate
+        BOOST_CHECK_EQUAL(num_saved, num_items - 1);
+        BOOST_CHECK(!on_caller_thread);
+    }
+
+    std::vector<Item> items;
+    BOOST_CHECK(storage.retrieve("mypubkey", items, ""));
+    BOOST_CHECK_EQUAL(items.size(), num_items);
+}
+
+BOOST_AUTO_TEST_CASE(it_discards_torn_records) {
+    LogRAIIFixture fixture;
+
+    const auto now = util::get_time_ms();
+    {
+        boost::asio::io_context ioc;
+        LogDatabase storage(ioc, ".");
+        BOOST_CHECK(storage.store("hash0", "mypubkey", "bytes0", 100000, now,
+                                  "nonce"));
+        BOOST_CHECK(storage.store("hash1", "mypubkey", "bytes1", 100000, now,
+                                  "nonce"));
+    }
+
+    // Cut the last record short, as a crash in the middle of a write would
+    const auto segment =
+        std::filesystem::directory_iterator("messages")->path();
+    std::filesystem::resize_file(segment,
+                                 std::filesystem::file_size(segment) - 3);
+
+    boost::asio::io_context ioc;
+    LogDatabase storage(ioc, ".");
+
+    std::vector<Item> items;
+    BOOST_CHECK(storage.retrieve("mypubkey", items, ""));
+    BOOST_REQUIRE_EQUAL(items.size(), 1);
+    BOOST_CHECK_EQUAL(items[0].hash, "hash0");
+
+    // Appends continue after the last complete record
+    BOOST_CHECK(storage.store("hash1", "mypubkey", "bytes1", 100000, now,
+                              "nonce"));
+    items.clear();
+    BOOST_CHECK(storage.retrieve("mypubkey", items, ""));
+    BOOST_CHECK_EQUAL(items.size(), 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(sharded_database)
+
+struct ShardedRAIIFixture {
+    ShardedRAIIFixture() { std::filesystem::remove_all("shards"); }
+    ~ShardedRAIIFixture() { std::filesystem::remove_all("shards"); }
+};
+
+BOOST_AUTO_TEST_CASE(it_splits_messages_by_owner) {
+    ShardedRAIIFixture fixture;
+
+    boost::asio::io_context ioc;
+    ShardedDatabase storage(ioc, ".", 4);
+    BOOST_CHECK_EQUAL(storage.num_shards(), 4);
+
+    const auto now = util::get_time_ms();
+    const int num_owners = 16;
+    for (int i = 0; i < 3; ++i) {
+        for (int owner = 0; owner < num_owners; ++owner) {
+            BOOST_CHECK(storage.store(
+                fmt::format("hash{}-{}", owner, i), fmt::format("pk{}", owner),
+                "bytes", 100000, now, "nonce"));
+        }
+    }
+    BOOST_CHECK(!storage.store("hash3-0", "pk3", "bytes", 100000, now,
+                               "nonce"));
+
+    // Each owner's messages come back in order
+    for (int owner = 0; owner < num_owners; ++owner) {
+        const auto pk = fmt::format("pk{}", owner);
+        std::vector<Item> items;
+        BOOST_CHECK(
+            storage.retrieve(pk, items, fmt::format("hash{}-0", owner)));
+        BOOST_REQUIRE_EQUAL(items.size(), 2);
+        BOOST_CHECK_EQUAL(items[0].hash, fmt::format("hash{}-1", owner));
+        BOOST_CHECK_EQUAL(items[1].hash, fmt::format("hash{}-2", owner));
+        BOOST_CHECK(
+            storage.is_latest_message(pk, fmt::format("hash{}-2", owner)));
+    }
+
+    // The shards are used, and the global operations cover all of them
+    size_t used_shards = 0;
+    for (const auto& entry : std::filesystem::directory_iterator("shards")) {
+        boost::asio::io_context shard_ioc;
+        Database shard(shard_ioc, entry.path().string());
+        uint64_t count = 0;
+        BOOST_CHECK(shard.get_message_count(count));
+        used_shards += count > 0;
+    }
+    BOOST_CHECK_GT(used_shards, 1);
+
+    uint64_t count = 0;
+    BOOST_CHECK(storage.get_message_count(count));
+    BOOST_CHECK_EQUAL(count, 3 * num_owners);
+
+    std::set<std::string> hashes;
+    BOOST_CHECK(storage.for_each_chunk(
+        [&hashes](std::vector<Item>& chunk) {
+            for (const auto& item : chunk)
+                hashes.insert(item.hash);
+            return true;
+        },
+        5));
+    BOOST_CHECK_EQUAL(hashes.size(), 3 * num_owners);
+
+    Item item;
+    BOOST_CHECK(storage.retrieve_by_hash("hash7-1", item));
+    BOOST_CHECK_EQUAL(item.pub_key, "pk7");
+    BOOST_CHECK(storage.retrieve_random(item));
+    BOOST_CHECK(hashes.count(item.hash));
+}
+
+BOOST_AUTO_TEST_CASE(it_bulk_stores_across_shards) {
+    ShardedRAIIFixture fixture;
+
+    boost::asio::io_context ioc;
+    ShardedDatabase storage(ioc, ".", 3);
+
+    const auto now = util::get_time_ms();
+    std::vector<Item> items;
+    for (int i = 0; i < 30; ++i) {
+        items.push_back(Item{fmt::format("hash{}", i),
+                             fmt::format("pk{}", i % 10), now, 100000,
+                             now + 100000, "nonce", "bytes"});
+    }
+    BOOST_CHECK(storage.bulk_store(items));
+    // Duplicates are ignored
+    BOOST_CHECK(storage.bulk_store(items));
+
+    uint64_t count = 0;
+    BOOST_CHECK(storage.get_message_count(count));
+    BOOST_CHECK_EQUAL(count, 30);
+
+    std::vector<Item> retrieved;
+    BOOST_CHECK(storage.retrieve("pk4", retrieved, ""));
+    BOOST_REQUIRE_EQUAL(retrieved.size(), 3);
+    BOOST_CHECK_EQUAL(retrieved[0].hash, "hash4");
+    BOOST_CHECK_EQUAL(retrieved[1].hash, "hash14");
+    BOOST_CHECK_EQUAL(retrieved[2].hash, "hash24");
+}
+
+BOOST_AUTO_TEST_CASE(it_sums_the_shards_cache_stats) {
+    ShardedRAIIFixture fixture;
+
+    boost::asio::io_context ioc;
+    ShardedDatabase storage(ioc, ".", 4);
+
+    const auto now = util::get_time_ms();
+    const int num_owners = 8;
+    for (int owner = 0; owner < num_owners; ++owner) {
+        for (int i = 0; i < 2; ++i) {
+            BOOST_CHECK(storage.store(
+                fmt::format("hash{}-{}", owner, i), fmt::format("pk{}", owner),
+                "bytes", 100000, now, "nonce"));
+        }
+    }
+
+    for (int owner = 0; owner < num_owners; ++owner) {
+        std::vector<Item> items;
+        BOOST_CHECK(storage.retrieve(fmt::format("pk{}", owner), items,
+                                     fmt::format("hash{}-0", owner)));
+        BOOST_CHECK_EQUAL(items.size(), 1);
+    }
+
+    StorageEngine::MessageCacheStats stats;
+    BOOST_REQUIRE(storage.get_message_cache_stats(stats));
+    BOOST_CHECK_EQUAL(stats.hits, num_owners);
+    BOOST_CHECK_EQUAL(stats.misses, 0);
+    BOOST_CHECK_GT(stats.bytes, 0);
+}
+
+BOOST_AUTO_TEST_CASE(it_refuses_a_different_number_of_shards) {
+    ShardedRAIIFixture fixture;
+
+    boost::asio::io_context ioc;
+    { ShardedDatabase storage(ioc, ".", 2); }
+    BOOST_CHECK_THROW(ShardedDatabase(ioc, ".", 3), std::runtime_error);
+    BOOST_CHECK_NO_THROW(ShardedDatabase(ioc, ".", 2));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
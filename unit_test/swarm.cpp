@@ -0,0 +1,194 @@
+#include "swarm.h"
+
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <random>
+
+using namespace oxen;
+
+// A user pubkey whose 16-digit chunks xor to `value`
+static user_pubkey_t pubkey_for(const std::string& value) {
+    bool success;
+    auto pk = user_pubkey_t::create("05" + value + std::string(48, '0'),
+                                    success);
+    BOOST_REQUIRE(success);
+    return pk;
+}
+
+static std::string random_hex(std::mt19937_64& rng, size_t size) {
+    constexpr const char* digits = "0123456789abcdef";
+    std::string result(size, '0');
+    for (auto& c : result)
+        c = digits[rng() % 16];
+    return result;
+}
+
+BOOST_AUTO_TEST_SUITE(swarm)
+
+BOOST_AUTO_TEST_CASE(it_maps_pubkeys_to_the_closest_swarm) {
+    const std::vector<swarm_id_t> ids{100, 200, 0x8000'0000'0000'0000};
+
+    BOOST_CHECK_EQUAL(get_swarm_by_pk(ids, pubkey_for("0000000000000064")),
+                      100);
+    BOOST_CHECK_EQUAL(get_swarm_by_pk(ids, pubkey_for("0000000000000097")),
+                      200);
+    // Ties go to the lower id
+    BOOST_CHECK_EQUAL(get_swarm_by_pk(ids, pubkey_for("0000000000000096")),
+                      100);
+    BOOST_CHECK_EQUAL(get_swarm_by_pk(ids, pubkey_for("7fffffffffffffff")),
+                      0x8000'0000'0000'0000);
+    // Upper case digits have the same value
+    BOOST_CHECK_EQUAL(get_swarm_by_pk(ids, pubkey_for("7FFFFFFFFFFFFFFF")),
+                      0x8000'0000'0000'0000);
+
+    BOOST_CHECK_EQUAL(get_swarm_by_pk(std::vector<swarm_id_t>{},
+                                      pubkey_for("0000000000000064")),
+                      INVALID_SWARM_ID);
+}
+
+BOOST_AUTO_TEST_CASE(it_wraps_around_the_swarm_ring) {
+    const std::vector<swarm_id_t> ids{1000, 0x8000'0000'0000'0000};
+
+    // Closer to 1000 going past the largest id
+    BOOST_CHECK_EQUAL(get_swarm_by_pk(ids, pubkey_for("fffffffffffffff5")),
+                      1000);
+    // ...and to the largest one going past the smallest
+    const std::vector<swarm_id_t> high_ids{0x4000'0000'0000'0000,
+                                           0xffff'ffff'ffff'ff00};
+    BOOST_CHECK_EQUAL(
+        get_swarm_by_pk(high_ids, pubkey_for("0000000000000010")),
+        0xffff'ffff'ffff'ff00);
+}
+
+BOOST_AUTO_TEST_CASE(it_matches_the_linear_search) {
+    std::mt19937_64 rng{42};
+
+    for (size_t num_swarms : {1, 2, 10, 400}) {
+        all_swarms_t swarms;
+        std::vector<swarm_id_t> ids;
+        for (size_t i = 0; i < num_swarms; ++i) {
+            ids.push_back(rng() % INVALID_SWARM_ID);
+            swarms.push_back(SwarmInfo{ids.back(), {}});
+        }
+        std::sort(ids.begin(), ids.end());
+
+        for (int i = 0; i < 1000; ++i) {
+            bool success;
+            const auto pk =
+                user_pubkey_t::create("05" + random_hex(rng, 64), success);
+            BOOST_CHECK_EQUAL(get_swarm_by_pk(ids, pk),
+                              get_swarm_by_pk(swarms, pk));
+        }
+    }
+
+    // Pubkeys that aren't hex still map to the same swarm as before
+    const std::vector<swarm_id_t> ids{0x10, 0x1000'0000'0000'0000};
+    const auto pk = pubkey_for("1000000000000zzz");
+    BOOST_CHECK_EQUAL(get_swarm_by_pk(ids, pk), 0x10);
+}
+
+BOOST_AUTO_TEST_CASE(it_finds_swarm_members) {
+    const sn_record_t us(22021, 22020, std::string(52, 'u'), "", "", "", "",
+                         "127.0.0.1");
+    const sn_record_t other(22021, 22020, std::string(52, 'o'), "", "", "",
+                            "", "127.0.0.1");
+
+    Swarm swarm(us);
+    // Swarms don't have to come in order
+    swarm.apply_swarm_changes({{300, {other}}, {100, {us}}, {200, {}}});
+    swarm.set_swarm_id(100);
+
+    BOOST_REQUIRE(swarm.get_swarm_members(300));
+    BOOST_CHECK(*swarm.get_swarm_members(300) ==
+                std::vector<sn_record_t>{other});
+    BOOST_CHECK(!swarm.get_swarm_members(150));
+
+    BOOST_CHECK(swarm.is_pubkey_for_us(pubkey_for("0000000000000064")));
+    BOOST_CHECK(!swarm.is_pubkey_for_us(pubkey_for("0000000000000190")));
+    BOOST_CHECK_EQUAL(swarm.get_swarm_by_pk(pubkey_for("0000000000000190")),
+                      300);
+}
+
+BOOST_AUTO_TEST_CASE(it_finds_nodes_by_each_key) {
+    const auto make_node = [](char c) {
+        return sn_record_t(22021, 22020, std::string(52, c),
+                           std::string(64, c), std::string(64, c),
+                           std::string(32, c), "ed" + std::string(62, c),
+                           "127.0.0.1");
+    };
+    const sn_record_t us = make_node('a');
+    const sn_record_t active = make_node('b');
+    const sn_record_t decommissioned = make_node('c');
+
+    Swarm swarm(us);
+    swarm.update_state({{1, {us, active}}}, {decommissioned}, SwarmEvents{},
+                       false);
+
+    for (const auto& sn : {us, active, decommissioned}) {
+        BOOST_CHECK(swarm.is_fully_funded_node(sn.sn_address()));
+        BOOST_CHECK(swarm.get_node_by_pk(sn.pub_key_base32z()) == sn);
+        BOOST_CHECK(swarm.find_node_by_ed25519_pk(sn.pubkey_ed25519_hex()) ==
+                    sn);
+        BOOST_CHECK(swarm.find_node_by_x25519_bin(sn.pubkey_x25519_bin()) ==
+                    sn);
+    }
+
+    const sn_record_t unknown = make_node('d');
+    BOOST_CHECK(!swarm.is_fully_funded_node(unknown.sn_address()));
+    BOOST_CHECK(!swarm.get_node_by_pk(unknown.pub_key_base32z()));
+    BOOST_CHECK(!swarm.find_node_by_ed25519_pk(unknown.pubkey_ed25519_hex()));
+    BOOST_CHECK(!swarm.find_node_by_x25519_bin(unknown.pubkey_x25519_bin()));
+
+    // Nodes that left are no longer found
+    swarm.update_state({{1, {us}}}, {}, SwarmEvents{}, false);
+    BOOST_CHECK(!swarm.is_fully_funded_node(active.sn_address()));
+    BOOST_CHECK(!swarm.find_node_by_x25519_bin(active.pubkey_x25519_bin()));
+}
+
+BOOST_AUTO_TEST_CASE(it_derives_swarm_events) {
+    const auto make_node = [](char c) {
+        return sn_record_t(22021, 22020, std::string(52, c),
+                           std::string(64, c), std::string(64, c),
+                           std::string(32, c), std::string(64, c),
+                           "127.0.0.1");
+    };
+    const sn_record_t us = make_node('a');
+    const sn_record_t peer = make_node('b');
+    const sn_record_t joined = make_node('c');
+
+    Swarm swarm(us);
+    const all_swarms_t initial{{1, {us, peer}}, {2, {}}};
+    auto events = swarm.derive_swarm_events(initial);
+    BOOST_CHECK_EQUAL(events.our_swarm_id, 1);
+    swarm.set_swarm_id(events.our_swarm_id);
+    swarm.update_state(initial, {}, events, true);
+    BOOST_CHECK(swarm.other_nodes() == std::vector<sn_record_t>{peer});
+    BOOST_CHECK(swarm.is_unchanged(initial, {}, true));
+    BOOST_CHECK(!swarm.is_unchanged(initial, {}, false));
+
+    const all_swarms_t grown{{1, {us, peer, joined}}, {2, {}}, {3, {}}};
+    BOOST_CHECK(!swarm.is_unchanged(grown, {}, true));
+    events = swarm.derive_swarm_events(grown);
+    BOOST_CHECK_EQUAL(events.our_swarm_id, 1);
+    BOOST_CHECK(events.new_snodes == std::vector<sn_record_t>{joined});
+    BOOST_CHECK(events.new_swarms == std::vector<swarm_id_t>{3});
+    BOOST_CHECK(!events.dissolved);
+
+    // A node changing its IP is a change too
+    auto moved = initial;
+    moved[0].snodes[1].set_ip("10.0.0.1");
+    BOOST_CHECK(!swarm.is_unchanged(moved, {}, true));
+
+    // Swarms applied from elsewhere (e.g. bootstrapping) aren't known to
+    // match the last update
+    swarm.apply_swarm_changes(initial);
+    BOOST_CHECK(!swarm.is_unchanged(initial, {}, true));
+
+    // Our swarm got dissolved
+    events = swarm.derive_swarm_events({{2, {us}}});
+    BOOST_CHECK_EQUAL(events.our_swarm_id, 2);
+    BOOST_CHECK(events.dissolved);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,11 +5,16 @@
 #include <random>
 #include <stdint.h>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
 namespace util {
 
+// Whether `str` is a number in the form `std::to_string` would print it:
+// digits only, without a sign, spaces or leading zeros
+bool isCanonicalDecimal(std::string_view str);
+
 bool validateTTL(uint64_t ttlInt);
 // Convert ttl string into uint64_t, return bool for success/fail
 bool parseTTL(const std::string& ttlString, uint64_t& ttl);
@@ -19,6 +19,13 @@ uint64_t get_time_ms() {
         .count();
 }
 
+bool isCanonicalDecimal(std::string_view str) {
+    if (str.empty() || (str[0] == '0' && str.size() > 1))
+        return false;
+    return std::all_of(str.begin(), str.end(),
+                       [](char c) { return c >= '0' && c <= '9'; });
+}
+
 bool validateTimestamp(uint64_t timestamp, uint64_t ttl) {
     const uint64_t cur_time = get_time_ms();
     // Timestamp must not be in the future (with some tolerance)